@@ -30,6 +30,14 @@
 
 #define FIREWIRE_MTU	4096
 
+/*
+ * The largest jumbo datagram. RFC 2734's datagram_size and fragment_offset
+ * fields are 12 bits, so FIREWIRE_MTU is the RFC limit. Larger datagrams
+ * carry the two reserved bits above each field as a non-RFC extension
+ * that only Apple peers understand, RFC 2734 stacks misparse them.
+ */
+#define FIREWIRE_JUMBO_MTU	16384
+
 /*
  * The number of bytes in an firewire ethernet like address.
  */
@@ -32,11 +32,14 @@
 
 #include <IOKit/firewire/IOFireWireController.h>
 #include <IOKit/firewire/IOFWAsyncStreamListener.h>
+#include <IOKit/firewire/IOFireWireIRMAllocation.h>
+#include <kern/thread_call.h>
 
 
 class IOFireWireController;
 class IOFWAsyncStreamListener;
 class IOFWIPAsyncWriteCommand;
+class IOFWIPBusInterface;
 
 const int		kWaitSecs				= 5;
 const int		kUnicastArbs			= 128;
@@ -46,19 +49,59 @@ const int		kActiveRcbs				= 128;
 const int		kMaxChannels			= 64;
 const int		kMaxAsyncCommands		= 127;
 const int		kMaxAsyncStreamCommands = 5;
+const int		kMaxControlStreamCommands	= 2;	// Async stream commands only ARP, MCAP and ND can use
+const int		kControlAsyncReserve	= 8;	// Async write commands data can't take from ND
+const UInt32	kMaxControlQueue		= 16;	// Control frames held back over a stall
+const UInt32	kMaxTxHoldQueue			= 32;	// Unicast packets held across a bus reset
+const UInt32	kTxHoldMS				= 2000;	// Hold window opened by a bus reset, no packet is held longer
 const int		kRCBExpirationtime		= 2; // 2 seconds active time for reassembly control blocks, decremented by watchdog
 
 const bool		kCopyBuffers			= false; // Set to true if need to copy the payload
 const bool		kQueueCommands			= false; // Set to true if need to queue the block write packets 
 
 const UInt32	kLowWaterMark			= 48;	 // Low water mark for commands in the pre-allocated pool
+const UInt32	kTxCompletionBatch		= 16;	 // Block write completions accounted together in txCompleteFlush
+const UInt32	kRxCacheDepth			= 32;	 // Preallocated receive buffers of each size class
+const UInt32	kRxSmallBufferSize		= 2048;	 // Single cluster receive buffers, MCLBYTES
+const UInt32	kRxLargeBufferSize		= 4096;	 // Single big cluster receive buffers, MBIGCLBYTES
+const UInt32	kRxSteerLanes			= 4;	 // Receive lanes, selected by source node, interleaved on flush
 const UInt32	kWatchDogTimerMS		= 1000;  // Watch dog timeout set to 1 sec = 1000 milli second
+const UInt32	kLinkUpdateMS			= 20;	 // DRB changes within this window share one link status update
+const UInt32	kDrbSpeedBuckets		= 8;	 // Speed codes counted in fDrbSpeedCount, kFWSpeed100MBit up
+const UInt32	kDrbPayloadBuckets		= 16;	 // Max payload logs counted in fDrbPayloadCount
+const UInt32	kMcastFilterWords		= 8;	 // Joined group filter, 256 bits, two per group
+const UInt8		kMCAPExpiration			= 60;	 // Seconds an MCAP advertisement keeps a channel valid
+const UInt8		kMCAPSolicitWait		= 10;	 // Seconds for an owner to answer a solicit, one advertisement period
+const UInt8		kMCAPHoldoff			= 60;	 // Seconds before retrying a failed channel allocation
+const UInt8		kMCAPReclaimHoldoff		= 10;	 // Seconds between attempts to allocate a taken over channel, one advertisement period
+const UInt8		kMCAPReclaimRetries		= 6;	 // Attempts after the first, outlasting the old owner's final warnings
 const UInt32	kMaxPseudoAddressSize	= 4096;
 
 // BusyX Ack workaround to maximize IPoFW performance
 const UInt32 kMaxBusyXAcksPerSecond				= 10;
 const UInt32 kMaxSecondsToTurnOffFastRetry		= 60;
 
+// CoDel queue management of the output queue, overridden by the AQMTargetUS and AQMIntervalUS properties
+const UInt32 kAQMTargetUS						= 5000;		// Acceptable standing queue delay, 0 turns AQM off
+const UInt32 kAQMIntervalUS						= 100000;	// Time the delay has to stay above target before signalling
+
+// Broadcast replication, the bus time constants are in S100 byte times,
+// estimateBusTime scales them and returns eighths of an S100 byte time
+const UInt32 kMaxBroadcastReplicaPeers			= 4;	// Stream broadcasts when more IP peers than this
+const UInt32 kBusTimeArbitration				= 16;	// Arbitration and gaps per packet, independent of speed
+const UInt32 kBusTimeStreamOverhead				= 20;	// Stream packet header, GASP, encapsulation header and CRCs
+const UInt32 kBusTimeBlockWriteOverhead			= 32;	// Block write header, encapsulation header, CRCs and the ack
+
+// Result of classifyPacket, the headers of a packet parsed once
+typedef struct {
+	mbuf_t	m;					// Packet classified, NULL if the results came from a receive buffer
+	UInt16	etherType;			// FWTYPE_IP, FWTYPE_IPV6, FWTYPE_ARP, in host order
+	UInt8	protocol;			// IPv4 ip_p or IPv6 ip6_nxt, 0 if not IP
+	UInt8	icmp6Type;			// ICMPv6 message type, 0 if not ICMPv6
+	UInt16	ipOffset;			// IP header offset from the start of the data
+	UInt16	transportOffset;	// Header following IP, 0 if not reachable
+} IP1394_PKT_INFO;
+
 class IOFWIPMBufCommand : public IOCommand
 {
 	OSDeclareDefaultStructors(IOFWIPMBufCommand);
@@ -69,13 +112,14 @@ private:
 	bool			fInited;
 	IOReturn		fStatus;
 	IOCommandPool	*fPool;
+	IOFWIPBusInterface	*fIPBusIf;
 
 protected:
 	void free(void) APPLE_KEXT_OVERRIDE;
 	
 public:
 	bool init(void) APPLE_KEXT_OVERRIDE;
-	void reinit(mbuf_t pkt, IOFireWireIP *ipNode, IOCommandPool *pool);
+	void reinit(mbuf_t pkt, IOFireWireIP *ipNode, IOFWIPBusInterface *busIf, IOCommandPool *pool);
 	void releaseWithStatus(IOReturn status = kIOReturnSuccess);
 	mbuf_t getMBuf();
 };
@@ -103,6 +147,8 @@ private:
 	OSSet					*fAsyncTransitSet;
     IOCommandPool			*fAsyncStreamTxCmdPool;
 	OSSet					*fAsyncStreamTransitSet;
+    IOCommandPool			*fControlStreamTxCmdPool;
+	OSSet					*fControlStreamCmdSet;		// Commands that return to fControlStreamTxCmdPool
 	UInt32					fMaxTxAsyncDoubleBuffer;
 	IORecursiveLock			*fIPLock;
     IOWorkLoop				*workLoop;
@@ -113,6 +159,28 @@ private:
     OSSet					*activeRcb;         // Linked list of datagrams in reassembly
     OSArray					*mcapState;			// Per channel MCAP descriptors
 	IOTimerEventSource		*timerSource;
+	IOInterruptEventSource	*fRxFlushSource;		// Deferred flush for receive paths without a completion handler
+	thread_call_t			fMCAPThreadCall;		// IRM channel allocation, it waits on the bus so runs off the workloop
+	IOTimerEventSource		*fMCAPTimerSource;		// MCAP aging and advertisements, armed only while there is MCAP work
+	IOTimerEventSource		*fLinkTimerSource;		// Coalesces the link status updates of a topology change
+	bool					fLinkUpdatePending;
+	UInt32					fDrbSpeedCount[kDrbSpeedBuckets];		// Active DRBs by maxSpeed, the minimum is the first non zero entry
+	UInt32					fDrbPayloadCount[kDrbPayloadBuckets];	// Active DRBs by maxPayload
+	UInt64					fMCAPActive;			// Channels with an advertisement to age or one of ours to send, bit per channel
+	bool					fMCAPArbTimers;			// Groups in the solicit or holdoff phase
+	bool					fMCAPTimerArmed;
+	UInt64					fMCAPReplied;			// Channels advertised in the current second, solicits for them wait
+	UInt32					fMcastFilter[kMcastFilterWords];	// Bloom filter of the joined groups' link addresses
+	bool					fMcastFilterValid;		// Off until the stack gives us a multicast list
+	UInt32					fMCAPGroupGen;			// Bumped when groups join or leave a channel, invalidates the cached advertisements
+	UInt32					fRxQueuedCount;			// Packets queued since the last flush, under fIPLock
+	mbuf_t					fRxSmallCache[kRxCacheDepth];	// Receive buffers allocated ahead, refilled from the workloop
+	UInt32					fRxSmallCount;
+	mbuf_t					fRxLargeCache[kRxCacheDepth];
+	UInt32					fRxLargeCount;
+	mbuf_t					fRxLaneHead[kRxSteerLanes];	// Received packets waiting for rxUnicastFlush, one chain per lane
+	mbuf_t					fRxLaneTail[kRxSteerLanes];
+	UInt32					fRxLaneNext;				// Lane served first on the next flush
 	SInt16					fUnitCount;
 	UInt32					fLowWaterMark;
 	UInt32					fPrevTransmitCount;
@@ -123,6 +191,27 @@ private:
 	int						fCurrentMBufCommands;
 	int						fCurrentRCBCommands;
 	UInt32					fOptimalMTU;
+	UInt32					fTxCompletedPackets;	// Completions waiting for txCompleteFlush
+	UInt32					fTxCompletedErrors;
+	mbuf_t					fLargeSendQueue;		// Segments of large sends waiting for transaction labels
+	mbuf_t					fLargeSendTail;
+	mbuf_t					fControlQueue;			// ARP and ND frames waiting out a stall, sent ahead of data
+	mbuf_t					fControlTail;
+	UInt32					fControlQueueLength;
+	mbuf_t					fTxHoldQueue;			// Unicast packets waiting out a bus reset, replayed by txHoldDrain
+	mbuf_t					fTxHoldTail;
+	UInt32					fTxHoldQueueLength;
+	UInt64					fTxHoldDeadline;		// Absolute time the hold window closes, 0 while closed
+	bool					fBusSuspended;			// Between the suspend and resume of a bus reset
+	IP1394_PKT_INFO			fTxInfo;			// Classification of the packet in outputPacket
+	UInt64					fAQMTarget;				// CoDel state, times in absolute time units
+	UInt64					fAQMInterval;
+	UInt64					fAQMFirstAbove;
+	UInt64					fAQMDropNext;
+	UInt32					fAQMCount;
+	UInt32					fAQMLastCount;
+	bool					fAQMDropping;
+	mbuf_t					fAQMLastPkt;			// Packet already judged, back at the head of the queue after a stall
 	
 protected:	
 	IOFWAsyncStreamListener	*fBroadcastReceiveClient;
@@ -156,6 +245,10 @@ public:
 
 	void		processWatchDogTimeout();
 
+	void		processMCAPTimeout();
+
+	void		processLinkTimeout();
+
 	bool		attachIOFireWireIP(IOFireWireIP *provider);
 
 	void		detachIOFireWireIP();
@@ -194,9 +287,33 @@ public:
 		
 	IOFWIPMBufCommand *getMBufCommand();
 		
-	IOFWIPAsyncWriteCommand	*getAsyncCommand(bool block, bool *deferNotify);
+	IOFWIPAsyncWriteCommand	*getAsyncCommand(bool block, bool *deferNotify, bool control = false);
 	
 	void	returnAsyncCommand(IOFWIPAsyncWriteCommand *cmd);
+
+	/*!
+		@function controlReserveReached
+		@abstract Checks whether data has used all async write commands but the control reserve.
+		@param control - true for link control frames, which may use the reserve.
+        @result bool - true if a data frame must wait for a completion.
+	*/
+	bool	controlReserveReached(bool control);
+
+	/*!
+		@function getAsyncStreamCommand
+		@abstract Gets an async stream command, control frames try their own pool first.
+		@param control - true for ARP, MCAP and ND.
+        @result IOFWIPAsyncStreamTxCommand - NULL if none is free.
+	*/
+	IOFWIPAsyncStreamTxCommand	*getAsyncStreamCommand(bool control);
+
+	/*!
+		@function returnAsyncStreamCommand
+		@abstract Returns an async stream command to the pool it came from.
+		@param cmd - async stream command.
+        @result void.
+	*/
+	void	returnAsyncStreamCommand(IOFWIPAsyncStreamTxCommand *cmd);
 	
 	/*!
 		@function freeIPCmdPool
@@ -218,6 +335,15 @@ public:
 
 	DRB		*initDRBwithDevice(UWIDE eui64, IOFireWireNub *fDevObj, bool itsMac);
 
+	/*!
+		@function updateDRBwithDevice
+		@abstract Refreshes a DRB's speed and payload after a bus reset.
+		@param drb - device reference block of the unit.
+		@param device - IOFireWireNub of the unit.
+        @result void.
+	*/
+	void	updateDRBwithDevice(DRB *drb, IOFireWireNub *device);
+
 	static	DRB	*staticInitDRBwithDevice(void *refcon, UWIDE eui64, IOFireWireNub *fDevObj, bool itsMac);
 
     /*!
@@ -251,10 +377,28 @@ public:
 	/*!
 		@function updateBroadcastValues
 		@abstract Updates the max broadcast payload and speed  
-		@param reset - useful to know whether to start from beginning.
+		@param reset - re-read our own speed, payload and node ID from the local node.
 		@result void.
 	*/	
 	void updateBroadcastValues(bool reset);
+
+	/*!
+		@function drbAccount
+		@abstract Adds a DRB's speed and payload to the counts updateBroadcastValues
+				  takes the minimum from, or removes them.
+		@param drb - device reference block in activeDrb.
+		@param add - true when the DRB joins activeDrb, false when it leaves.
+		@result void.
+	*/	
+	void drbAccount(DRB *drb, bool add);
+
+	/*!
+		@function scheduleLinkStatus
+		@abstract Arms the link timer, so the changes of one topology update
+				  end in a single updateLinkStatus.
+		@result void.
+	*/	
+	void scheduleLinkStatus();
 	
 	/*!
 		@function updateLinkStatus
@@ -277,6 +421,58 @@ public:
 	*/
 	static void txCompleteBlockWrite(void *refcon, IOReturn status, IOFireWireNub *device, IOFWCommand *fwCmd);
 
+	/*!
+		@function txCompleteFlush
+		@abstract Accounts a batch of block write completions and services the output queue once.
+		@param force - flush even if the batch isn't full.
+        @result void.
+	*/
+	void txCompleteFlush(bool force);
+
+	/*!
+		@function isControlFrame
+		@abstract Classifies ARP and IPv6 Neighbor Discovery frames as link control traffic.
+		@param m - mbuf with the firewire header.
+		@param type - ether type of the frame.
+        @result bool - true for link control frames.
+	*/
+	bool isControlFrame(mbuf_t m, UInt16 type);
+
+	/*!
+		@function classifyPacket
+		@abstract Parses the IP headers of an outgoing packet once.
+		@param m - mbuf with the firewire header.
+		@param type - ether type of the frame.
+		@param info - filled in with the protocol and offsets.
+        @result void.
+	*/
+	void classifyPacket(mbuf_t m, UInt16 type, IP1394_PKT_INFO *info);
+
+	/*!
+		@function txControlDrain
+		@abstract Sends control frames held back over a stall, in order.
+        @result SInt32 - kIOFireWireOutOfTLabels if frames are still held.
+	*/
+	SInt32 txControlDrain();
+
+	/*!
+		@function txHoldPacket
+		@abstract Parks a unicast packet that failed against the old bus generation,
+				  for txHoldDrain to resolve again. Outside the hold window, or with
+				  the queue full, the packet is dropped as an output error.
+		@param m - mbuf with the firewire header, always consumed.
+        @result void.
+	*/
+	void txHoldPacket(mbuf_t m);
+
+	/*!
+		@function txHoldDrain
+		@abstract Resubmits the held packets against the current generation, or
+				  drops them all once the hold window has closed.
+        @result void.
+	*/
+	void txHoldDrain();
+
 	/*!
 		@function txAsyncStreamComplete
 		@abstract Callback for the Async stream transmit complete 
@@ -299,6 +495,16 @@ public:
 	SInt32  txARP(mbuf_t m, UInt16 nodeID, UInt32 busGeneration, IOFWSpeed speed);
 	
 	SInt32	txBroadcastIP(const mbuf_t m, UInt16 nodeID, UInt32 busGeneration, UInt16 ownMaxPayload, UInt16 maxBroadcastPayload, IOFWSpeed speed, const UInt16 type, UInt32 channel);
+
+	/*!
+		@function txReplicatedBroadcast
+		@abstract Replicates a broadcast datagram as per peer block writes, if that costs less bus time.
+		@param m - mbuf containing the IP packet, consumed only when true is returned.
+        @result bool - true if the datagram was sent as block writes.
+	*/
+	bool	txReplicatedBroadcast(const mbuf_t m, UInt16 nodeID, UInt32 busGeneration, UInt16 ownMaxPayload, UInt16 maxPayload, IOFWSpeed speed, const UInt16 type);
+
+	UInt32	estimateBusTime(UInt32 bytes, UInt32 maxPayload, IOFWSpeed speed, UInt32 overhead);
 	
 	SInt32	txUnicastUnFragmented(IOFireWireNub *device, const FWAddress addr, const mbuf_t m, const UInt16 pktSize, const UInt16 type);
 	
@@ -306,15 +512,61 @@ public:
 												const UInt16 pktSize, const UInt16 type, UInt16 maxPayload, UInt16 dgl);
 	
 	SInt32	txUnicastIP(mbuf_t m, UInt16 nodeID, UInt32 busGeneration, UInt16 ownMaxPayload, IOFWSpeed speed,const UInt16 type);
-	
+
+	/*!
+		@function txMulticastIP
+		@abstract Transmit multicast IP packet on the MCAP channel and speed of its group.
+		@param m - mbuf containing the IP packet.
+        @result SInt32 - status from txBroadcastIP.
+	*/
+	SInt32	txMulticastIP(mbuf_t m, UInt16 nodeID, UInt32 busGeneration, UInt16 ownMaxPayload, UInt16 maxBroadcastPayload, IOFWSpeed speed, const UInt16 type);
+
+	/*!
+		@function txLargeSend
+		@abstract Segments a TCP/IPv4 super-packet (TSO) to the destination's payload and transmits it.
+		@param m - mbuf containing the super-packet.
+		@param mss - maximum segment size requested by the stack.
+        @result SInt32 - kIOReturnSuccess, the packet is always consumed.
+	*/
+	SInt32	txLargeSend(mbuf_t m, UInt32 mss);
+
+	/*!
+		@function txLargeSendDrain
+		@abstract Transmits the queued large send segments in order.
+        @result SInt32 - kIOFireWireOutOfTLabels if segments are still queued.
+	*/
+	SInt32	txLargeSendDrain();
+
 	UInt32	outputPacket(mbuf_t pkt, void * param);
+
+	/*!
+		@function initAQM
+		@abstract Reads the CoDel target and interval from the interface properties.
+		@param none.
+        @result void.
+	*/
+	void	initAQM();
+
+	/*!
+		@function aqmShouldDrop
+		@abstract CoDel on the sojourn time of a packet leaving the output queue.
+		@param pkt - mbuf stamped with its enqueue time by firewire_frameout.
+        @result bool - true if the packet is to be dropped, ECN capable packets are marked instead.
+	*/
+	bool	aqmShouldDrop(mbuf_t pkt);
+
+	/*!
+		@function aqmControlLaw
+		@abstract Next signal time, interval / sqrt(count) after t.
+		@param t - absolute time.
+        @result UInt64 - absolute time of the next drop or mark.
+	*/
+	UInt64	aqmControlLaw(UInt64 t);
 	
 	static  UInt32	staticOutputPacket(mbuf_t pkt, void * param);
 
 	IOTransmitPacket		getOutputHandler() const;
 
-	IOUpdateARPCache		getARPCacheHandler() const;
-	
 	IOUpdateMulticastCache	getMulticastCacheHandler() const;
 	
 	/*!
@@ -331,10 +583,41 @@ public:
 		@function txMCAP
 		@abstract multicast solicitation and advertisement messages.
 		@param MCB*			- mcb - multicast channel control block
-		@param ipAddress	- address of the multicast group.
+		@param MARB*		- arb - group to solicit an owner for, IPv4 or IPv6.
         @result void.
 	*/
-	void txMCAP(MCB *mcb, UInt32 groupAddress);
+	void txMCAP(MCB *mcb, MARB *arb);
+
+	/*!
+		@function mcapDescriptor
+		@abstract Fills in the length, type and group of the MCAP descriptor for a group.
+				  An IPv6 group is only described once its whole address is known.
+		@param arb		- multicast group.
+		@param descr	- room for an MCAST_DESCR_IPV6.
+		@result length of the descriptor.
+	*/
+	UInt32 mcapDescriptor(MARB *arb, MCAST_DESCR *descr);
+
+	/*!
+		@function mcapGroup6
+		@abstract Places the bytes of an IPv6 multicast link address where
+				  FIREWIRE_MAP_IPV6_MULTICAST took them from. Bytes 2 to 9 of the
+				  group aren't in the link address, they are left zero and the
+				  result is only good for matching until the MARB learns the
+				  whole group.
+		@param fwaddr	- IPv6 multicast link address.
+		@param group6	- returns the IPv6 group.
+		@result void.
+	*/
+	static void mcapGroup6(const UInt8 *fwaddr, UInt8 *group6);
+
+	void txMCAPAdvertise(UInt64 channels);
+
+	OSData *mcapAdvertisement(MCB *mcb);
+
+	IOFWIPAsyncStreamTxCommand *txMCAPCommand(UInt8 opcode, struct mcap_packet **packet);
+
+	void txMCAPSubmit(IOFWIPAsyncStreamTxCommand *asyncStreamCmd, struct mcap_packet *packet);
 	
 	/*!
 		@function rxUnicastFlush
@@ -343,6 +626,31 @@ public:
 	*/
 	void rxUnicastFlush();
 
+	/*!
+		@function rxScheduleFlush
+		@abstract Arranges delivery of a packet queued on the broadcast or ARP path,
+				which has no rxUnicastComplete to flush it. Only kicks fRxFlushSource,
+				the flush itself always runs on the workloop.
+	*/
+	void rxScheduleFlush();
+
+	/*!
+		@function rxSteer
+		@abstract Queues a received packet on the lane of the node that sent it.
+		@param m - packet with its firewire header.
+		@param sourceID - node ID of the sender.
+        @result void.
+	*/
+	void rxSteer(mbuf_t m, UInt16 sourceID);
+
+	/*!
+		@function rxCoalesce
+		@abstract Merges consecutive in-order TCP/IPv4 segments of one flow on a lane.
+		@param chain - packets of one lane, linked with mbuf_nextpkt.
+        @result mbuf_t - the chain after merging.
+	*/
+	mbuf_t rxCoalesce(mbuf_t chain);
+
 	/*!
 		@function rxUnicastComplete
 		@abstract triggers the indication workloop to do batch processing
@@ -403,9 +711,10 @@ public:
 		@param len - length of the packet.
 		@params flags - indicates broadcast or unicast	
 		@params type - indicates type of the packet IPv4 or IPv6	
+		@params sourceID - node ID of the sender, selects the receive lane
 		@result IOReturn.
 	*/
-	IOReturn rxIP(void *pkt, UInt32 len, UInt32 flags, UInt16 type);
+	IOReturn rxIP(void *pkt, UInt32 len, UInt32 flags, UInt16 type, UInt16 sourceID);
 	
 	/*!
 		@function rxARP
@@ -413,11 +722,10 @@ public:
 		@param fwIPObj - IOFireWireIP object.
 		@param arp - 1394 arp packet without the GASP or Async header.
 		@params flags - indicates broadcast or unicast
+		@params sourceID - node ID of the sender, selects the receive lane
         @result IOReturn.
 	*/
-	IOReturn rxARP(IP1394_ARP *arp, UInt32 flags);
-
-	static bool staticUpdateARPCache(void *refcon, IP1394_ARP *fwa);
+	IOReturn rxARP(IP1394_ARP *arp, UInt32 flags, UInt16 sourceID);
 
 	static bool staticUpdateMulticastCache(void *refcon, IOFWAddress *addrs, UInt32 count);
 	
@@ -448,6 +756,45 @@ public:
 	*/
 	MARB *getMulticastArb(UInt32 groupAddress);
 
+	/*!
+		@function getMulticastArb6
+		@abstract Locates the multicast MARB for an IPv6 group by its link address,
+				  the only part of the group the stack gives us.
+        @param fwaddr - IPv6 multicast link address.
+        @result Returns MARB if successfull else NULL.
+	*/
+	MARB *getMulticastArb6(const UInt8 *fwaddr);
+
+	/*!
+		@function getMcapGroupArb
+		@abstract Locates the MARB an MCAP descriptor is for. An IPv6 descriptor
+				  carries the whole group, the MARB learns it if it didn't know it.
+        @param groupDescr - MCAP group descriptor, IPv4 or IPv6.
+        @result Returns MARB if successfull else NULL.
+	*/
+	MARB *getMcapGroupArb(MCAST_DESCR *groupDescr);
+
+	/*!
+		@function mcastFilterUpdate
+		@abstract Rebuilds the joined group filter from the multicast list.
+		@param addrs - link addresses of every group joined.
+		@param count - number of addresses.
+		@result void.
+	*/
+	void mcastFilterUpdate(IOFWAddress *addrs, UInt32 count);
+
+	/*!
+		@function rxMcastFilter
+		@abstract Peeks at the destination of a received stream datagram. 
+				  Multicast for a group we have not joined is dropped before
+				  an mbuf is allocated, anything else passes.
+		@param datagram	- IPv4 or IPv6 datagram.
+		@param len		- its length.
+		@param type		- FWTYPE_IP or FWTYPE_IPV6.
+		@result false if the datagram is for a group we have not joined.
+	*/
+	bool rxMcastFilter(const void *datagram, UInt32 len, UInt16 type);
+
 	/*!
 		@function getDrbFromDeviceID
 		@abstract Locates the corresponding DRB (Address resolution block) for IOFireWireNub
@@ -546,8 +893,108 @@ public:
 	void updateMcapState();
 	
 	void releaseMulticastARB(MCB *mcb);
+
+	/*!
+		@function mcapRelinquish
+		@abstract Gives up a channel we own once its final warnings are sent.
+				  Its groups go back to the default broadcast channel.
+		@param mcb - channel we own.
+		@result true if the IRM allocation has to be released by mcapThread.
+	*/
+	bool mcapRelinquish(MCB *mcb);
+
+	/*!
+		@function mcapDisown
+		@abstract Another node took over a channel we own. The channel stays
+				  allocated at the IRM, only our allocation object goes.
+		@param mcb - channel we owned.
+		@result void.
+	*/
+	void mcapDisown(MCB *mcb);
+
+	/*!
+		@function mcapBusReset
+		@abstract Keeps the channels we own across a bus reset, advertising
+				  them under our new node ID. Adopted channels have no IRM
+				  allocation of ours and are allocated again by mcapThread.
+		@result void.
+	*/
+	void mcapBusReset();
+
+	/*!
+		@function mcapSchedule
+		@abstract Runs mcapThread for pending IRM allocations and releases.
+		@result void.
+	*/
+	void mcapSchedule();
+
+	/*!
+		@function mcapThread
+		@abstract IRM allocations are synchronous bus transactions, they run
+				  here and never under fIPLock or on the workloop.
+	*/
+	static void mcapThread(thread_call_param_t param0, thread_call_param_t param1);
+
+	void mcapReleaseChannels();
+
+	void mcapReclaimChannels();
+
+	void mcapAllocateChannels();
+
+	/*!
+		@function mcapAllocationLost
+		@abstract Called by the controller when a bus reset cost us a channel
+				  at the IRM, we stop advertising it straight away.
+	*/
+	static IOReturn mcapAllocationLost(void *refCon, IOFireWireIRMAllocation *allocation);
+
+	/*!
+		@function mcapStop
+		@abstract Stops mcapThread and gives the channels we own back to the IRM.
+		@result void.
+	*/
+	void mcapStop();
+
+	/*!
+		@function mcapArmChannel
+		@abstract Adds a channel to the ones the MCAP timer ages, and arms the
+				  timer if it is idle. The channel drops out once it has
+				  neither an advertisement to age nor an owner in us.
+		@param mcb - channel with MCAP state.
+		@result void.
+	*/
+	void mcapArmChannel(MCB *mcb);
+
+	/*!
+		@function mcapArmGroups
+		@abstract Arms the MCAP timer for a group in the solicit or holdoff phase.
+		@result void.
+	*/
+	void mcapArmGroups();
+
+	void mcapArmTimer();
 	
     mbuf_t allocateMbuf(UInt32 size);
+
+	/*!
+		@function rxAllocateMbuf
+		@abstract Takes a receive buffer from the preallocated cache of its size class.
+		@param size - packet length, including the firewire header.
+        @result mbuf_t - NULL only if the cache is empty and allocateMbuf fails too.
+	*/
+	mbuf_t rxAllocateMbuf(UInt32 size);
+
+	/*!
+		@function rxCacheRefill
+		@abstract Tops up both receive buffer caches, called outside the receive callbacks.
+	*/
+	void rxCacheRefill();
+
+	/*!
+		@function rxCacheFree
+		@abstract Frees the buffers held in the receive caches.
+	*/
+	void rxCacheFree();
 	
 	/*!
 		@function bufferToMbuf
@@ -212,6 +212,23 @@ typedef struct {
 
 #define MCAST_TYPE			1	/* IPv4 MCAST type */
 
+/* RFC 3146 reuses the MCAP descriptor for IPv6 groups, with a type of two
+ and the whole 128-bit group address. */
+
+typedef struct {
+   UInt8	length;             /* Total size of descriptor (bytes) */
+   UInt8	type;               /* Constant two (2) for MCAST_DESCR_IPV6 */
+   UInt16	reserved1;
+   UInt8	expiration;         /* For advertisements, lifespan remaining */
+   UInt8	channel;            /* Channel number for the group */
+   UInt8	speed;              /* Transmission speed for the group */
+   UInt8	reserved2;
+   UInt32	bandwidth;          /* Not yet utilized */
+   UInt8	groupAddress[16];	/* IPv6 multicast address */
+} MCAST_DESCR_IPV6;
+
+#define MCAST_TYPE_IPV6		2	/* IPv6 MCAST type */
+
 typedef struct {
    UInt16	length;             /* Total length of MCAP message, in bytes */
    UInt8	reserved;
@@ -295,8 +312,18 @@ class MARB : public OSObject		/* Used by both ARP 1394 and MCAP */
 	OSDeclareDefaultStructors(MARB);
 public:
 	TNF_HANDLE	handle;         /* Pseudo "hardware" address used internally */
+	UInt8		groupType;      /* MCAST_TYPE or MCAST_TYPE_IPV6 */
+	UInt8		group6[16];     /* IPv6 group, only the link address bytes until group6Known */
+	bool		group6Known;    /* Whole IPv6 group learned from a packet or an advertisement */
+	UInt8		mcapPhase;      /* Where we are in getting the group a channel */
+	UInt8		mcapTimer;      /* Seconds left in the current phase */
 };
 
+#define MCAP_PHASE_IDLE     0     /* On a channel, or not sent to yet */
+#define MCAP_PHASE_SOLICIT  1     /* Solicited, waiting for an owner to advertise */
+#define MCAP_PHASE_ALLOCATE 2     /* No owner answered, waiting for the IRM allocation */
+#define MCAP_PHASE_HOLDOFF  3     /* Allocation failed, stays on the broadcast channel */
+
 /* Address resolution block (ARB) contains all of the information necessary to
  map, in either direction, between an IPv4 address and a link-level "hardware"
  address */
@@ -348,6 +375,15 @@ public:
    UInt8	expiration;          /* Seconds remaining in valid channel mapping */
    UInt8	nextTransmit;        /* Seconds 'til MCAP advertisement transmitted */
    UInt8	finalWarning;        /* Channel deallocation warning messages */
+   OSObject *irmAllocation;      /* IRM channel allocation when we own the channel */
+   bool		owned;               /* We advertise this channel */
+   bool		irmRelease;          /* Allocation to be given back to the IRM */
+   bool		irmReclaim;          /* Adopted channel to be allocated at the IRM */
+   UInt8	irmHoldoff;          /* Seconds before the next attempt to allocate an adopted channel */
+   UInt8	irmRetries;          /* Allocation attempts left while the old owner lets the channel go */
+   UInt8	txIdle;              /* Seconds since we last sent on the channel */
+   OSData	*advert;             /* Our group descriptors for the channel, cached between advertisements */
+   UInt32	advertGen;           /* Group generation the cached descriptors were built at */
 };
 
 #define MCAP_UNOWNED 0        /* No channel owner */
@@ -82,14 +82,12 @@ extern "C"{
 class IOFireWireNub;
 
 typedef UInt32	(*IOTransmitPacket)(mbuf_t m, void *param);
-typedef bool	(*IOUpdateARPCache)(void *refcon, IP1394_ARP *fwa);
 typedef bool	(*IOUpdateMulticastCache)(void *refcon, IOFWAddress *addrs, UInt32 count);
 
 typedef struct IOFireWireIPPrivateHandlers 
 {
 	OSObject				*newService;
     IOTransmitPacket		transmitPacket;
-	IOUpdateARPCache		updateARPCache;
 	IOUpdateMulticastCache	updateMulticastCache;
 };
 
@@ -161,12 +159,12 @@ protected:
     UInt8 					macAddr[kIOFWAddressSize];
     bool					fStarted;	
 	bool					fPacketsQueued;
+	UInt32					fMaxDatagramSize;		// FIREWIRE_MTU, or larger once a jumbo MTU is set
 
 	OSObject				*fDiagnostics;
 
 	OSObject				*fPrivateInterface;
     IOTransmitPacket		fOutAction;
-	IOUpdateARPCache		fUpdateARPCache;
 	IOUpdateMulticastCache	fUpdateMulticastCache;
 
 	const OSSymbol 			*fDiagnostics_Symbol;
@@ -227,6 +225,30 @@ public:
 		UInt32	fDoFastRetry;
 		UInt32	fNoRCBCommands;
 		UInt32  fRxFragmentPktsDropped;
+		UInt32	fTxMcastOnChannel;
+		UInt32	fTxBcastReplicated;
+		UInt32	fTxCompleteBatches;
+		UInt32	fTxLargeSendPkts;
+		UInt32	fTxLargeSendSegments;
+		UInt32	fTxControlHeld;
+		UInt32	fTxControlReserveStalls;
+		UInt32	fAQMDrops;
+		UInt32	fAQMMarks;
+		UInt32	fRxCacheMisses;
+		UInt32	fRxDirectCopies;
+		UInt32	fRxCoalescedPkts;
+		UInt32	fRxCoalescedSegments;
+		UInt32	fMCAPChannelsAllocated;
+		UInt32	fMCAPAllocationFailures;
+		UInt32	fMCAPTakeovers;
+		UInt32	fMCAPAdvertBuilds;
+		UInt32	fMCAPRepliesLimited;
+		UInt32	fRxMcastFiltered;
+		UInt32	fTxHeldPkts;
+		UInt32	fTxHeldReplayed;
+		UInt32	fTxHeldExpired;
+		UInt32	fLinkStatusUpdates;
+		UInt32	fLinkStatusCoalesced;
 	}IPoFWDiagnostics;
 
 	IPoFWDiagnostics	fIPoFWDiagnostics;
@@ -271,7 +293,6 @@ public:
     virtual void			receivePackets(mbuf_t pkt, UInt32 pkt_len, UInt32 options);
 	virtual UInt32			outputPacket(mbuf_t m, void * param) APPLE_KEXT_OVERRIDE;
 
-	virtual	bool			arpCacheHandler(IP1394_ARP *fwa);
 	virtual UInt32			transmitPacket(mbuf_t m, void * param);
 
 	virtual bool			multicastCacheHandler(IOFWAddress *addrs, UInt32 count);
@@ -295,7 +316,8 @@ public:
 		@function getFeatures
 		@abstract 
 		@param none.
-		@result Tell family we can handle multipage mbufs. kIONetworkFeatureMultiPages
+		@result Tell family we can handle multipage mbufs and TCP/IPv4 large sends.
+				kIONetworkFeatureMultiPages | kIONetworkFeatureTSOIPv4
 	*/
 	UInt32 getFeatures(void) const APPLE_KEXT_OVERRIDE;
 
@@ -305,6 +327,14 @@ public:
 	UInt32	getMaxARDMAPacketSize();
 	UInt8	getMaxARDMARec(UInt32 size);
 
+	/*!
+		@function updateMTU
+		@abstract Sets the interface MTU the link payload calls for. Once a jumbo
+				  MTU is set by setMaxPacketSize, every later payload driven
+				  change is ignored until the MTU drops back to FIREWIRE_MTU.
+		@param mtu - MTU for the current link payload.
+		@result void.
+	*/
 	void updateMTU(UInt32 mtu);
 	
     /*!
@@ -323,6 +353,13 @@ public:
     */
     LCB* getLcb() const
     {return fLcb;};
+
+    /*!
+		@function isBusifEnabled
+		@abstract Returns true while a bus interface is registered to carry our traffic.
+    */
+	bool isBusifEnabled() const
+	{return busifEnabled;};
 	
     /*!
 		@function getIPLock
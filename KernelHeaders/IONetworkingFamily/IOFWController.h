@@ -48,6 +48,12 @@
 
 #define kIOFWMaxPacketSize          4096
 
+/*! @defined kIOFWMaxJumboPacketSize
+    @abstract The maximum size of a jumbo FireWire packet, a
+        FIREWIRE_JUMBO_MTU datagram with its link header. */
+
+#define kIOFWMaxJumboPacketSize     (16384 + 18)
+
 /*! @defined kIOFWMinPacketSize
     @abstract The minimum size of an FireWire packet, including
         the FCS bytes. */
@@ -53,27 +53,78 @@ extern "C"{
 #include "IOFireWireIP.h" 
 
 struct fw_desc {
-	u_int16_t	type;			/* Type of protocol stored in data */
-	u_long 		protocol_family;	/* Protocol family */
-	u_long		data[2];		/* Protocol data */
+	struct fw_desc	*next;			/* Next descriptor in the same hash bucket */
+	u_int16_t		type;			/* Type of protocol stored in data */
+	u_long 			protocol_family;	/* Protocol family */
+	u_long			data[2];		/* Protocol data */
 };
 
-#define FIREWIRE_DESC_BLK_SIZE (10)
+/* Direct mapped slots for the common types, a hash of the rest */
+#define FIREWIRE_DESC_SLOT_IP		0
+#define FIREWIRE_DESC_SLOT_ARP		1
+#define FIREWIRE_DESC_SLOT_IPV6		2
+#define FIREWIRE_DESC_SLOTS			3
+#define FIREWIRE_DESC_HASH_SIZE		(16)	/* power of 2 */
 
 //
 // Statics for demux module
 //
 struct firewire_desc_blk_str {
-    u_long  n_max_used;
-    u_long	n_count;
-	u_long	n_used;
-    struct fw_desc  block_ptr[1];
+	u_long			n_used;
+	struct fw_desc	*slot[FIREWIRE_DESC_SLOTS];
+	struct fw_desc	*hash[FIREWIRE_DESC_HASH_SIZE];
 };
-/* Size of the above struct before the array of struct fw_desc */
-#define FIREWIRE_DESC_HEADER_SIZE	((size_t)&(((struct firewire_desc_blk_str*)0)->block_ptr[0]))
 
 static ifnet_t	loop_ifp;
 
+//
+// Slot for a type in network byte order, or -1 if it belongs in the hash
+//
+static int firewire_desc_slot(u_long fw_type)
+{
+	switch (ntohs((u_int16_t)fw_type)) 
+	{
+		case FWTYPE_IP:
+			return FIREWIRE_DESC_SLOT_IP;
+		case FWTYPE_ARP:
+			return FIREWIRE_DESC_SLOT_ARP;
+		case FWTYPE_IPV6:
+			return FIREWIRE_DESC_SLOT_IPV6;
+		default:
+			return -1;
+	}
+}
+
+static struct fw_desc **firewire_desc_bucket(struct firewire_desc_blk_str *desc_blk, u_long fw_type)
+{
+	int slot = firewire_desc_slot(fw_type);
+	
+	if (slot >= 0)
+		return &desc_blk->slot[slot];
+
+	return &desc_blk->hash[(fw_type ^ (fw_type >> 8)) & (FIREWIRE_DESC_HASH_SIZE - 1)];
+}
+
+static void firewire_free_desc_blk(struct firewire_desc_blk_str *desc_blk)
+{
+	for (int i = 0; i < FIREWIRE_DESC_SLOTS; i++) 
+	{
+		if (desc_blk->slot[i])
+			FREE(desc_blk->slot[i], M_IFADDR);
+	}
+
+	for (int i = 0; i < FIREWIRE_DESC_HASH_SIZE; i++) 
+	{
+		while (desc_blk->hash[i]) 
+		{
+			struct fw_desc *ed = desc_blk->hash[i];
+			desc_blk->hash[i] = ed->next;
+			FREE(ed, M_IFADDR);
+		}
+	}
+
+	FREE(desc_blk, M_IFADDR);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -85,8 +136,6 @@ static ifnet_t	loop_ifp;
 //  dlil_detach_protocol calls this funcion
 // 
 // Release all descriptor entries owned by this ifp/protocol_family (there may be several).
-// Setting the type to 0 releases the entry. Eventually we should compact-out
-// the unused entries.
 //
 ////////////////////////////////////////////////////////////////////////////////
 __private_extern__
@@ -104,27 +153,42 @@ int  firewire_del_proto(ifnet_t ifp, protocol_family_t protocol_family)
 		
 	int		found = 0;
 	
-	for (u_long current = desc_blk->n_max_used; current > 0; current--) 
+	for (int i = 0; i < FIREWIRE_DESC_SLOTS; i++) 
 	{
-		if (desc_blk->block_ptr[current - 1].protocol_family == protocol_family) 
+		if (desc_blk->slot[i] && desc_blk->slot[i]->protocol_family == protocol_family) 
 		{
 			found = 1;
-			desc_blk->block_ptr[current - 1].type = 0;
+			FREE(desc_blk->slot[i], M_IFADDR);
+			desc_blk->slot[i] = NULL;
 			desc_blk->n_used--;
 		}
 	}
+
+	for (int i = 0; i < FIREWIRE_DESC_HASH_SIZE; i++) 
+	{
+		struct fw_desc **prev = &desc_blk->hash[i];
+
+		while (*prev) 
+		{
+			struct fw_desc *ed = *prev;
+
+			if (ed->protocol_family == protocol_family) 
+			{
+				found = 1;
+				*prev = ed->next;
+				FREE(ed, M_IFADDR);
+				desc_blk->n_used--;
+			}
+			else
+				prev = &ed->next;
+		}
+	}
 	
 	if (desc_blk->n_used == 0) 
 	{
-		FREE(fwIf->getFamilyCookie(), M_IFADDR);
+		firewire_free_desc_blk(desc_blk);
 		fwIf->setFamilyCookie(NULL);
 	}
-	else 
-	{
-		/* Decrement n_max_used */
-		for (; desc_blk->n_max_used > 0 && desc_blk->block_ptr[desc_blk->n_max_used - 1].type == 0; desc_blk->n_max_used--)
-			;
-	}
 	
 	return found;
  }
@@ -151,7 +215,8 @@ firewire_add_proto_internal(ifnet_t ifp, u_long protocol_family, const struct if
 	struct firewire_desc_blk_str	*desc_blk	= (struct firewire_desc_blk_str *)fwIf->getFamilyCookie();
 
 	struct fw_desc	*ed;
-	u_long		   i;
+	struct fw_desc	**bucket;
+	u_long			fw_type;
    
 	switch (demux->type) 
 	{
@@ -164,66 +229,39 @@ firewire_add_proto_internal(ifnet_t ifp, u_long protocol_family, const struct if
 			return EOPNOTSUPP;
 	}
 
-	// Check for case where all of the descriptor blocks are in use
-	if (desc_blk == NULL || desc_blk->n_used == desc_blk->n_count) 
-	{
-		struct firewire_desc_blk_str *tmp;
-		u_long	new_count = FIREWIRE_DESC_BLK_SIZE;
-		u_long	new_size;
-		u_long	old_size = 0;
-
-		i = 0;
-		if (desc_blk) 
-		{
-			new_count += desc_blk->n_count;
-			old_size = desc_blk->n_count * sizeof(struct fw_desc) + FIREWIRE_DESC_HEADER_SIZE;
-			i = desc_blk->n_used;
-		}
-		
-		new_size = new_count * sizeof(struct fw_desc) + FIREWIRE_DESC_HEADER_SIZE;
+	/* 2 byte ethernet raw protocol type is at native_type */
+	/* prtocol must be in network byte order */
+	fw_type = *(u_int16_t*)demux->data;
 
-		tmp = (struct firewire_desc_blk_str*)_MALLOC(new_size, M_IFADDR, MBUF_WAITOK);
-		if (tmp  == 0) 
+	if (desc_blk == NULL) 
+	{
+		desc_blk = (struct firewire_desc_blk_str*)_MALLOC(sizeof(*desc_blk), M_IFADDR, M_WAITOK);
+		if (desc_blk == 0) 
 			return ENOMEM;
 		
-		bzero(tmp + old_size, new_size - old_size);
-		if (desc_blk) 
-		{
-			bcopy(desc_blk, tmp, old_size);
-			FREE(desc_blk, M_IFADDR);
-		}
-		desc_blk = tmp;
+		bzero(desc_blk, sizeof(*desc_blk));
 		fwIf->setFamilyCookie(desc_blk);
-		desc_blk->n_count = new_count;
 	}
-	else
+
+	bucket = firewire_desc_bucket(desc_blk, fw_type);
+
+	// A type demuxes to one protocol, the first attach keeps it
+	for (ed = *bucket; ed; ed = ed->next) 
 	{
-		// Find a free entry
-		for (i = 0; i < desc_blk->n_count; i++) 
-		{
-			if (desc_blk->block_ptr[i].type == 0) 
-				break;
-		}
+		if (ed->type == DLIL_DESC_ETYPE2 && ed->data[0] == fw_type) 
+			return EADDRINUSE;
 	}
-		
-	// Bump n_max_used if appropriate
-	if (i + 1 > desc_blk->n_max_used) {
-		desc_blk->n_max_used = i + 1;
-	}
-	
-	ed = &desc_blk->block_ptr[i];
+
+	ed = (struct fw_desc*)_MALLOC(sizeof(*ed), M_IFADDR, M_WAITOK);
+	if (ed == 0) 
+		return ENOMEM;
+
+	ed->type			= DLIL_DESC_ETYPE2;
 	ed->protocol_family = protocol_family;
-	ed->data[0] = 0;
-	ed->data[1] = 0;
-	
-	switch (demux->type) {
-		case DLIL_DESC_ETYPE2:
-			/* 2 byte ethernet raw protocol type is at native_type */
-			/* prtocol must be in network byte order */
-			ed->type = DLIL_DESC_ETYPE2;
-			ed->data[0] = *(u_int16_t*)demux->data;
-			break;
-	}
+	ed->data[0]			= fw_type;
+	ed->data[1]			= 0;
+	ed->next			= *bucket;
+	*bucket				= ed;
     
 	desc_blk->n_used++;
 
@@ -259,6 +297,9 @@ firewire_add_proto(ifnet_t   ifp, protocol_family_t protocol, const struct ifnet
 // Invoked by : 
 //  dlil_input_packet()
 // 
+// IP, ARP and IPv6 are a direct lookup, other types a short hash chain, so the
+// cost doesn't grow with the number of attached protocols.
+//
 ////////////////////////////////////////////////////////////////////////////////
 __private_extern__ int firewire_demux(ifnet_t ifp, mbuf_t m, char *frame_header, protocol_family_t *protocol_family)
 {
@@ -274,19 +315,14 @@ __private_extern__ int firewire_demux(ifnet_t ifp, mbuf_t m, char *frame_header,
 	if (desc_blk == NULL)
 		return EINVAL;
 
-	u_short			fw_type = eh->fw_type;
-    u_int16_t		type = DLIL_DESC_ETYPE2;
-    u_long			maxd = desc_blk->n_max_used;
-    struct fw_desc	*ed = desc_blk->block_ptr;
+	u_long			fw_type = eh->fw_type;
+	struct fw_desc	*ed = *firewire_desc_bucket(desc_blk, fw_type);
 
-    /* 
-     * Search through the connected protocols for a match. 
-     */
-	for (u_long i = 0; i < maxd; i++) 
+	for (; ed; ed = ed->next) 
 	{
-		if ((ed[i].type == type) && (ed[i].data[0] == fw_type)) 
+		if (ed->data[0] == fw_type) 
 		{
-			*protocol_family = ed[i].protocol_family;
+			*protocol_family = ed->protocol_family;
 			return 0;
 		}
 	}
@@ -377,6 +413,15 @@ firewire_frameout(ifnet_t ifp, mbuf_t *m,
 	(void)memcpy(&fwh->fw_type, fw_type,sizeof(fwh->fw_type));
 	memcpy(fwh->fw_dhost, edst, FIREWIRE_ADDR_LEN);
 	(void)memcpy(fwh->fw_shost, ifnet_lladdr(ifp), sizeof(fwh->fw_shost));
+
+#if VERSION_MAJOR >= 16
+	//
+	// Enqueue time, the driver's queue management works on sojourn time
+	//
+	u_int64_t now;
+	clock_get_uptime(&now);
+	mbuf_set_timestamp(*m, now, TRUE);
+#endif
 	
 	return 0;
 }
@@ -408,7 +453,8 @@ __private_extern__
 int  firewire_del_if(IOFWInterface	*fwIf)
 {
 	if (fwIf->getFamilyCookie()) {
-		FREE(fwIf->getFamilyCookie(), M_IFADDR);
+		firewire_free_desc_blk((struct firewire_desc_blk_str *)fwIf->getFamilyCookie());
+		fwIf->setFamilyCookie(NULL);
 		return 0;
 	}
 	else
@@ -274,7 +274,8 @@ inet_firewire_arp_input(
 	sender_hw.sdl_alen = FIREWIRE_ADDR_LEN;
 	bcopy(&fwa->senderUniqueID, LLADDR(&sender_hw), FIREWIRE_ADDR_LEN);
 
-	if(fwIpObj->arpCacheHandler(fwa))
+	// rxARP has already updated the ARB cache, nothing to answer with once the bus interface is gone
+	if(fwIpObj->isBusifEnabled())
 		inet_arp_handle_input(ifp, ntohs(fwa->opcode), &sender_hw, &sender_ip, &target_ip);
 
 	mbuf_free((mbuf_t)m);
@@ -1,5 +1,8 @@
 #include "../../KernelHeaders/IOKit/IOFWIPBusInterface.h"
 #include <sys/kpi_mbuf.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
 
 #define BCOPY(s, d, l) do { bcopy((void *) s, (void *) d, l); } while(0)
 
@@ -20,6 +23,32 @@ extern "C"
 */
 void watchdog(OSObject *, IOTimerEventSource *);
 
+/*!
+	@function mcapTimeout
+	@abstract MCAP timer - ages advertisements and sends ours, armed only while 
+			  channels or groups have MCAP state to tick.
+	@param timer - IOTimerEventsource.
+	@result void.
+*/
+void mcapTimeout(OSObject *, IOTimerEventSource *);
+
+/*!
+	@function linkTimeout
+	@abstract link timer - updates the link status once the DRB changes of a
+			  topology update have settled.
+	@param timer - IOTimerEventsource.
+	@result void.
+*/
+void linkTimeout(OSObject *, IOTimerEventSource *);
+
+/*!
+	@function rxFlushDeferred
+	@abstract hands the packets queued by the broadcast and ARP receive paths to the stack.
+	@param owner - IOFWIPBusInterface.
+	@result void.
+*/
+void rxFlushDeferred(OSObject *, IOInterruptEventSource *, int);
+
 extern errno_t mbuf_inet6_cksum(mbuf_t mbuf, int protocol, u_int32_t offset, u_int32_t length, u_int16_t *csum);
 }
 
@@ -68,14 +97,55 @@ bool IOFWIPBusInterface::init(IOFireWireIP *primaryInterface)
     fAsyncStreamTxCmdPool	= 0;
 	fAsyncTransitSet		= 0;
 	fAsyncStreamTransitSet	= 0;
+	fControlStreamTxCmdPool	= 0;
+	fControlStreamCmdSet	= 0;
 	fCurrentMBufCommands	= 0;
 	fCurrentAsyncIPCommands	= 0;
 	fCurrentRCBCommands		= 0;
 	fUnitCount				= 0;
 	fOptimalMTU				= 0;
+	fTxCompletedPackets		= 0;
+	fTxCompletedErrors		= 0;
+	fLargeSendQueue			= NULL;
+	fLargeSendTail			= NULL;
+	fControlQueue			= NULL;
+	fControlTail			= NULL;
+	fControlQueueLength		= 0;
+	fTxHoldQueue			= NULL;
+	fTxHoldTail				= NULL;
+	fTxHoldQueueLength		= 0;
+	fTxHoldDeadline			= 0;
+	fBusSuspended			= false;
+	fTxInfo.m				= NULL;
+	fAQMLastPkt				= NULL;
+	fRxFlushSource			= NULL;
+	fMCAPThreadCall			= NULL;
+	fMCAPTimerSource		= NULL;
+	fLinkTimerSource		= NULL;
+	fLinkUpdatePending		= false;
+	memset(fDrbSpeedCount, 0, sizeof(fDrbSpeedCount));
+	memset(fDrbPayloadCount, 0, sizeof(fDrbPayloadCount));
+	fMCAPActive				= 0;
+	fMCAPArbTimers			= false;
+	fMCAPTimerArmed			= false;
+	fMCAPReplied			= 0;
+	fMCAPGroupGen			= 0;
+	fMcastFilterValid		= false;
+	memset(fMcastFilter, 0, sizeof(fMcastFilter));
+	fRxQueuedCount			= 0;
+	fRxSmallCount			= 0;
+	fRxLargeCount			= 0;
+	fRxLaneNext				= 0;
+	for( UInt32 i = 0; i < kRxSteerLanes; i++ )
+	{
+		fRxLaneHead[i]		= NULL;
+		fRxLaneTail[i]		= NULL;
+	}
 	fLowWaterMark			= kLowWaterMark;
 	fIPLocalNode->fIPoFWDiagnostics.fMaxQueueSize		= TRANSMIT_QUEUE_SIZE;
 
+	initAQM();
+
 	// set the secondary interface handlers with IOFireWireIP
 	if( not attachIOFireWireIP ( fIPLocalNode ) )
 	{
@@ -94,6 +164,8 @@ bool IOFWIPBusInterface::init(IOFireWireIP *primaryInterface)
 
 		fStarted  = true;
 
+		rxCacheRefill();
+
 		registerService();
 	}
 	
@@ -132,6 +204,32 @@ bool IOFWIPBusInterface::finalize(IOOptionBits options)
 		}
 		timerSource = NULL;
 
+		if(fMCAPTimerSource != NULL) 
+		{
+			fMCAPTimerSource->cancelTimeout();
+			if (workLoop != NULL)
+				workLoop->removeEventSource(fMCAPTimerSource);
+			fMCAPTimerSource->release();
+		}
+		fMCAPTimerSource = NULL;
+
+		if(fLinkTimerSource != NULL) 
+		{
+			fLinkTimerSource->cancelTimeout();
+			if (workLoop != NULL)
+				workLoop->removeEventSource(fLinkTimerSource);
+			fLinkTimerSource->release();
+		}
+		fLinkTimerSource = NULL;
+
+		if(fRxFlushSource != NULL)
+		{
+			if (workLoop != NULL)
+				workLoop->removeEventSource(fRxFlushSource);
+			fRxFlushSource->release();
+		}
+		fRxFlushSource = NULL;
+
 		IORecursiveLockUnlock(fIPLock);
 
 		IOFWIPAsyncWriteCommand *cmd1 = NULL;
@@ -163,6 +261,14 @@ bool IOFWIPBusInterface::finalize(IOOptionBits options)
 		fAsyncStreamTransitSet->flushCollection();
 		fAsyncStreamTransitSet->free();
 		fAsyncStreamTransitSet = NULL;
+
+		// Not there if start failed before the control lane was set up
+		if(fControlStreamCmdSet != NULL)
+		{
+			fControlStreamCmdSet->flushCollection();
+			fControlStreamCmdSet->free();
+			fControlStreamCmdSet = NULL;
+		}
 	}
 	
 	return super::finalize(options);
@@ -172,8 +278,57 @@ void IOFWIPBusInterface::stop(IOService *provider)
 {
 	if( fStarted )
 	{
+		mcapStop();
+
 		IORecursiveLockLock(fIPLock);
 
+		// Segments of a large send that never made it out
+		while( fLargeSendQueue != NULL )
+		{
+			mbuf_t seg = fLargeSendQueue;
+			fLargeSendQueue = mbuf_nextpkt(seg);
+			mbuf_setnextpkt(seg, NULL);
+			fIPLocalNode->freePacket(seg);
+		}
+		fLargeSendTail = NULL;
+
+		// Control frames still held back over a stall
+		while( fControlQueue != NULL )
+		{
+			mbuf_t pkt = fControlQueue;
+			fControlQueue = mbuf_nextpkt(pkt);
+			mbuf_setnextpkt(pkt, NULL);
+			fIPLocalNode->freePacket(pkt);
+		}
+		fControlTail		= NULL;
+		fControlQueueLength = 0;
+
+		// Packets held across a bus reset
+		while( fTxHoldQueue != NULL )
+		{
+			mbuf_t pkt = fTxHoldQueue;
+			fTxHoldQueue = mbuf_nextpkt(pkt);
+			mbuf_setnextpkt(pkt, NULL);
+			fIPLocalNode->freePacket(pkt);
+		}
+		fTxHoldTail			= NULL;
+		fTxHoldQueueLength	= 0;
+		fTxHoldDeadline		= 0;
+
+		for( UInt32 i = 0; i < kRxSteerLanes; i++ )
+		{
+			while( fRxLaneHead[i] != NULL )
+			{
+				mbuf_t pkt = fRxLaneHead[i];
+				fRxLaneHead[i] = mbuf_nextpkt(pkt);
+				mbuf_setnextpkt(pkt, NULL);
+				fIPLocalNode->freePacket(pkt);
+			}
+			fRxLaneTail[i] = NULL;
+		}
+
+		rxCacheFree();
+
 		freeAsyncCmdPool();
 		
 		freeAsyncStreamCmdPool();
@@ -231,6 +386,20 @@ IOReturn IOFWIPBusInterface::message(UInt32 type, IOService *provider, void *arg
             break;
 
         case kIOMessageServiceIsSuspended:
+            if(fStarted == true)
+			{
+				recursiveScopeLock lock(fIPLock);
+
+				// Open the hold window, a reset inside it doesn't extend it
+				fBusSuspended = true;
+				if( fTxHoldDeadline == 0 )
+				{
+					UInt64 hold;
+					clock_get_uptime(&fTxHoldDeadline);
+					nanoseconds_to_absolutetime((UInt64)kTxHoldMS * 1000 * 1000, &hold);
+					fTxHoldDeadline += hold;
+				}
+			}
             break;
 
         case kIOMessageServiceIsResumed:
@@ -243,6 +412,12 @@ IOReturn IOFWIPBusInterface::message(UInt32 type, IOService *provider, void *arg
 				resetMARBCache();
 				
 				updateBroadcastValues(true);
+
+				fBusSuspended = false;
+
+				txHoldDrain();			// Resolved again with the new generation
+
+				mcapBusReset();
             }
             break;
             
@@ -295,6 +470,7 @@ bool IOFWIPBusInterface::attachIOFireWireIP(IOFireWireIP *provider)
 		if(mcb)
 		{
 			mcb->channel = channel;
+			mcb->txIdle	 = kMCAPExpiration;
 			mcapState->setObject(channel, mcb);
 			mcb->release();
 		}
@@ -303,6 +479,10 @@ bool IOFWIPBusInterface::attachIOFireWireIP(IOFireWireIP *provider)
 	fAsyncStreamTransitSet = OSSet::withCapacity(kMaxAsyncStreamCommands);
 	if(fAsyncStreamTransitSet == 0)
 		return false;
+
+	fControlStreamCmdSet = OSSet::withCapacity(kMaxControlStreamCommands);
+	if(fControlStreamCmdSet == 0)
+		return false;
 	
 	fAsyncTransitSet = OSSet::withCapacity(kMaxAsyncCommands);
 	if(fAsyncTransitSet == 0)
@@ -326,6 +506,56 @@ bool IOFWIPBusInterface::attachIOFireWireIP(IOFireWireIP *provider)
 		return false;
 	}
 
+	fMCAPTimerSource = IOTimerEventSource::timerEventSource ( ( OSObject* ) this,
+														   ( IOTimerEventSource::Action ) &mcapTimeout);
+	if ( fMCAPTimerSource == NULL )
+	{
+		IOLog( "IOFWIPBusInterface::attachIOFireWireIP - Couldn't allocate MCAP timer event source\n" );
+		return false;
+	}
+
+	if ( workLoop->addEventSource ( fMCAPTimerSource ) != kIOReturnSuccess )
+	{
+		IOLog( "IOFWIPBusInterface::attachIOFireWireIP - Couldn't add MCAP timer event source\n" );        
+		return false;
+	}
+
+	fLinkTimerSource = IOTimerEventSource::timerEventSource ( ( OSObject* ) this,
+														   ( IOTimerEventSource::Action ) &linkTimeout);
+	if ( fLinkTimerSource == NULL )
+	{
+		IOLog( "IOFWIPBusInterface::attachIOFireWireIP - Couldn't allocate link timer event source\n" );
+		return false;
+	}
+
+	if ( workLoop->addEventSource ( fLinkTimerSource ) != kIOReturnSuccess )
+	{
+		IOLog( "IOFWIPBusInterface::attachIOFireWireIP - Couldn't add link timer event source\n" );        
+		return false;
+	}
+
+	// Batched delivery for the receive paths that have no completion handler
+	fRxFlushSource = IOInterruptEventSource::interruptEventSource( ( OSObject* ) this,
+																  ( IOInterruptEventSource::Action ) &rxFlushDeferred );
+	if ( fRxFlushSource == NULL )
+	{
+		IOLog( "IOFWIPBusInterface::attachIOFireWireIP - Couldn't allocate receive flush event source\n" );
+		return false;
+	}
+
+	if ( workLoop->addEventSource ( fRxFlushSource ) != kIOReturnSuccess )
+	{
+		IOLog( "IOFWIPBusInterface::attachIOFireWireIP - Couldn't add receive flush event source\n" );        
+		return false;
+	}
+
+	fMCAPThreadCall = thread_call_allocate( (thread_call_func_t)&mcapThread, (thread_call_param_t)this );
+	if ( fMCAPThreadCall == NULL )
+	{
+		IOLog( "IOFWIPBusInterface::attachIOFireWireIP - Couldn't allocate MCAP thread call\n" );
+		return false;
+	}
+
 	// Asyncstream hook up to recieve the broadcast packets
 	fBroadcastReceiveClient = fControl->createAsyncStreamListener( 0x1f, rxAsyncStream, this );
 	if ( not fBroadcastReceiveClient )
@@ -348,7 +578,6 @@ bool IOFWIPBusInterface::attachIOFireWireIP(IOFireWireIP *provider)
 	
 	privateHandlers.newService				= this;
     privateHandlers.transmitPacket			= getOutputHandler();
-	privateHandlers.updateARPCache			= getARPCacheHandler();
 	privateHandlers.updateMulticastCache	= getMulticastCacheHandler();
 
 	fIPLocalNode->registerFWIPPrivateHandlers(&privateHandlers);
@@ -530,7 +759,7 @@ void IOFWIPBusInterface::fwIPUnitAttach()
 {
 	incrementUnitCount();
 	
-	updateBroadcastValues(true);
+	updateBroadcastValues(false);
 	
 	fLowWaterMark = kLowWaterMark; // new unit, so lets learn afresh
 }
@@ -544,13 +773,17 @@ void IOFWIPBusInterface::fwIPUnitTerminate()
 {
 	decrementUnitCount();
 	
-	updateBroadcastValues(true);
+	updateBroadcastValues(false);
 }
 
 /*!
 	@function updateBroadcastValues
-	@abstract Updates the max broadcast payload and speed  
-	@param reset - useful to know whether to start from beginning.
+	@abstract Updates the max broadcast payload and speed. Our own values are
+			  the starting point, lowered by the slowest active DRB. The DRBs
+			  are counted by drbAccount as they come and go, so this takes the
+			  minimum from the counts instead of walking activeDrb, and the
+			  link status is left to the link timer.
+	@param reset - re-read our own speed, payload and node ID from the local node.
 	@result void.
 */	
 void IOFWIPBusInterface::updateBroadcastValues(bool reset)
@@ -565,9 +798,6 @@ void IOFWIPBusInterface::updateBroadcastValues(bool reset)
 
 			if( localDevice )
 			{
-				fLcb->maxBroadcastPayload = localDevice->maxPackLog(true);
-
-				fLcb->maxBroadcastSpeed = localDevice->FWSpeed();
 				// Update our own max payload
 				fLcb->ownMaxPayload = localDevice->maxPackLog(true);
 				// Update the nodeID
@@ -577,24 +807,90 @@ void IOFWIPBusInterface::updateBroadcastValues(bool reset)
 			}
 		}
 
-		// Display the active DRB
-		DRB *drb = NULL;
-		OSCollectionIterator * iterator = OSCollectionIterator::withCollection( activeDrb );
-		if( iterator )
+		fLcb->maxBroadcastPayload	= fLcb->ownMaxPayload;
+		fLcb->maxBroadcastSpeed		= fLcb->ownMaxSpeed;
+
+		for( UInt32 speed = 0; speed < kDrbSpeedBuckets; speed++ )
 		{
-			while( NULL != (drb = OSDynamicCast(DRB, iterator->getNextObject())) )
-			{ 
-				if(fLcb->maxBroadcastSpeed > drb->maxSpeed)
-					fLcb->maxBroadcastSpeed = drb->maxSpeed;
-				
-				if(fLcb->maxBroadcastPayload > drb->maxPayload)
-					fLcb->maxBroadcastPayload = drb->maxPayload;
+			if( fDrbSpeedCount[speed] != 0 )
+			{
+				if( (UInt32)fLcb->maxBroadcastSpeed > speed )
+					fLcb->maxBroadcastSpeed = (IOFWSpeed)speed;
+				break;
+			}
+		}
+
+		for( UInt32 payload = 0; payload < kDrbPayloadBuckets; payload++ )
+		{
+			if( fDrbPayloadCount[payload] != 0 )
+			{
+				if( fLcb->maxBroadcastPayload > payload )
+					fLcb->maxBroadcastPayload = payload;
+				break;
 			}
-			iterator->release();
 		}
 	}
 	
-	updateLinkStatus();
+	scheduleLinkStatus();
+}
+
+/*!
+	@function drbAccount
+	@abstract Adds a DRB's speed and payload to the counts updateBroadcastValues
+			  takes the minimum from, or removes them. Called with the DRB's
+			  values as they were accounted, before any change to them.
+	@param drb - device reference block in activeDrb.
+	@param add - true when the DRB joins activeDrb, false when it leaves.
+	@result void.
+*/	
+void IOFWIPBusInterface::drbAccount(DRB *drb, bool add)
+{
+	recursiveScopeLock lock(fIPLock);
+
+	UInt32 speed	= MIN((UInt32)drb->maxSpeed, kDrbSpeedBuckets - 1);
+	UInt32 payload	= MIN((UInt32)drb->maxPayload, kDrbPayloadBuckets - 1);
+
+	if( add )
+	{
+		fDrbSpeedCount[speed]++;
+		fDrbPayloadCount[payload]++;
+	}
+	else
+	{
+		if( fDrbSpeedCount[speed] > 0 )
+			fDrbSpeedCount[speed]--;
+		if( fDrbPayloadCount[payload] > 0 )
+			fDrbPayloadCount[payload]--;
+	}
+}
+
+/*!
+	@function scheduleLinkStatus
+	@abstract Arms the link timer if it isn't already, so every unit
+			  reporting in after a bus reset shares one updateLinkStatus.
+			  Without the timer, before attach or after stop, the link status
+			  is updated right away.
+	@result void.
+*/	
+void IOFWIPBusInterface::scheduleLinkStatus()
+{
+	recursiveScopeLock lock(fIPLock);
+
+	if( fLinkTimerSource == NULL )
+	{
+		updateLinkStatus();
+		return;
+	}
+
+	if( fLinkUpdatePending )
+	{
+		if( fIPLocalNode != NULL )
+			fIPLocalNode->fIPoFWDiagnostics.fLinkStatusCoalesced++;
+		return;
+	}
+
+	fLinkUpdatePending = true;
+	fLinkTimerSource->setTimeoutMS(kLinkUpdateMS);
 }
 
 /*!
@@ -609,6 +905,8 @@ void IOFWIPBusInterface::updateLinkStatus()
 
 	if(fStarted and (fIPLocalNode != NULL) )
 	{
+		fIPLocalNode->fIPoFWDiagnostics.fLinkStatusUpdates++;
+
 		// set medium inactive, before setting it to active for radar 3300357
 		fIPLocalNode->setLinkStatus(kIONetworkLinkValid, fIPLocalNode->getCurrentMedium(), 0); 
 
@@ -739,8 +1037,15 @@ IOFWIPMBufCommand *IOFWIPBusInterface::getMBufCommand()
 	return mBufCommand;
 }
 
-IOFWIPAsyncWriteCommand *IOFWIPBusInterface::getAsyncCommand(bool block, bool *deferNotify)
+IOFWIPAsyncWriteCommand *IOFWIPBusInterface::getAsyncCommand(bool block, bool *deferNotify, bool control)
 {
+	// The last kControlAsyncReserve commands are kept for Neighbor Discovery
+	if( controlReserveReached(control) )
+	{
+		fIPLocalNode->fIPoFWDiagnostics.fTxControlReserveStalls++;
+		return NULL;
+	}
+
 	IOFWIPAsyncWriteCommand * cmd = (IOFWIPAsyncWriteCommand *)fAsyncCmdPool->getCommand(block);
 
 	if(cmd == NULL) 
@@ -797,6 +1102,58 @@ void IOFWIPBusInterface::returnAsyncCommand(IOFWIPAsyncWriteCommand *cmd)
 		fIPLocalNode->fIPoFWDiagnostics.fDoubleCompletes++;
 }
 
+/*!
+	@function controlReserveReached
+	@abstract Data frames may only have kMaxAsyncCommands - kControlAsyncReserve block
+			  writes outstanding, the rest are kept for link control frames.
+	@param control - true for link control frames.
+	@result bool - true if a data frame has to wait for a completion.
+*/
+bool IOFWIPBusInterface::controlReserveReached(bool control)
+{
+	UInt32 outstanding = fIPLocalNode->fIPoFWDiagnostics.fActiveCmds - fIPLocalNode->fIPoFWDiagnostics.fInActiveCmds;
+
+	return (not control) and (outstanding >= (UInt32)(kMaxAsyncCommands - kControlAsyncReserve));
+}
+
+/*!
+	@function getAsyncStreamCommand
+	@abstract Control frames take from their own pool before the shared one, so
+			  broadcast data can't hold every async stream command.
+	@param control - true for ARP, MCAP and ND.
+	@result IOFWIPAsyncStreamTxCommand - NULL if none is free.
+*/
+IOFWIPAsyncStreamTxCommand *IOFWIPBusInterface::getAsyncStreamCommand(bool control)
+{
+	IOFWIPAsyncStreamTxCommand *cmd = NULL;
+
+	// create a command pool on demand
+	if(fAsyncStreamTxCmdPool == NULL)
+		initAsyncStreamCmdPool();
+
+	if( control and (fControlStreamTxCmdPool != NULL) )
+		cmd = (IOFWIPAsyncStreamTxCommand*)fControlStreamTxCmdPool->getCommand(false);
+
+	if( (cmd == NULL) and (fAsyncStreamTxCmdPool != NULL) )
+		cmd = (IOFWIPAsyncStreamTxCommand*)fAsyncStreamTxCmdPool->getCommand(false);
+
+	return cmd;
+}
+
+void IOFWIPBusInterface::returnAsyncStreamCommand(IOFWIPAsyncStreamTxCommand *cmd)
+{
+	IOCommandPool *pool = fAsyncStreamTxCmdPool;
+
+	if( (fControlStreamCmdSet != NULL) and fControlStreamCmdSet->containsObject(cmd) )
+		pool = fControlStreamTxCmdPool;
+
+	if(pool != NULL) 		// Queue the command back into the command pool
+	{
+		pool->returnCommand(cmd);
+		fIPLocalNode->fIPoFWDiagnostics.fInActiveBcastCmds++;
+	}
+}
+
 /*!
 	@function initAsyncStreamCmdPool
 	@abstract constructs AsyncStreamcommand objects and queues them in the pool
@@ -835,6 +1192,30 @@ UInt32 IOFWIPBusInterface::initAsyncStreamCmdPool()
         fAsyncStreamTxCmdPool->returnCommand(cmd2);
 		fAsyncStreamTransitSet->setObject(cmd2);
     }
+
+	if(fControlStreamTxCmdPool == NULL)
+		fControlStreamTxCmdPool = IOCommandPool::withWorkLoop(workLoop);
+
+	// Reserve for ARP, MCAP and ND, so broadcast data can't starve them
+	for(i=0; (status == kIOReturnSuccess) and (i<kMaxControlStreamCommands); i++){
+
+        cmd2 = new IOFWIPAsyncStreamTxCommand;
+        if(!cmd2) {
+            status = kIOReturnNoMemory;
+            break;
+        }
+
+        if(!cmd2->initAll(fIPLocalNode, fControl, this, 0, 0, 0, GASP_TAG, fMaxTxAsyncDoubleBuffer, 
+						kFWSpeed100MBit, txCompleteAsyncStream, this)) {
+            status = kIOReturnNoMemory;
+			cmd2->release();
+            break;
+        }
+
+        fControlStreamTxCmdPool->returnCommand(cmd2);
+		fAsyncStreamTransitSet->setObject(cmd2);
+		fControlStreamCmdSet->setObject(cmd2);
+    }
 	
     return status;
 }
@@ -898,12 +1279,22 @@ void IOFWIPBusInterface::freeAsyncStreamCmdPool()
 	fAsyncStreamTxCmdPool->release();
 	fAsyncStreamTxCmdPool = NULL;
 
-    return;
-}
+	if(fControlStreamTxCmdPool == NULL)
+		return;
 
-IOUpdateARPCache IOFWIPBusInterface::getARPCacheHandler() const
-{
-	return (IOUpdateARPCache) &IOFWIPBusInterface::staticUpdateARPCache;
+	do{
+        cmd2 = (IOFWIPAsyncStreamTxCommand*)fControlStreamTxCmdPool->getCommand(false);
+        if(cmd2 != NULL)
+		{
+			freeCount++;
+            cmd2->release();
+        }
+    }while(cmd2 != NULL);
+
+	fControlStreamTxCmdPool->release();
+	fControlStreamTxCmdPool = NULL;
+
+    return;
 }
 
 IOUpdateMulticastCache IOFWIPBusInterface::getMulticastCacheHandler() const
@@ -936,6 +1327,8 @@ DRB *IOFWIPBusInterface::initDRBwithDevice(UWIDE eui64, IOFireWireNub *device, b
 		if ((drb = new DRB) == NULL)
 			return NULL;
 	}
+	else
+		drbAccount(drb, false);		// Counted again with the new values below
 	
 	CSRNodeUniqueID fwuid = device->getUniqueID();
 	if(itsMac)
@@ -952,9 +1345,38 @@ DRB *IOFWIPBusInterface::initDRBwithDevice(UWIDE eui64, IOFireWireNub *device, b
 	
 	activeDrb->setObject(drb);
 
+	drbAccount(drb, true);
+
     return drb;
 }
 
+/*!
+	@function updateDRBwithDevice
+	@abstract Refreshes a DRB's speed and payload in the new topology. Only the
+			  counts of this DRB change, updateBroadcastValues then takes the
+			  minimum without walking the other units.
+	@param drb - device reference block of the unit.
+	@param device - IOFireWireNub of the unit.
+	@result void.
+*/
+void IOFWIPBusInterface::updateDRBwithDevice(DRB *drb, IOFireWireNub *device)
+{
+	recursiveScopeLock lock(fIPLock);
+
+	bool active = activeDrb->containsObject(drb);
+
+	if( active )
+		drbAccount(drb, false);
+
+	drb->maxSpeed	= device->FWSpeed();
+	drb->maxPayload	= device->maxPackLog(true);
+
+	if( active )
+		drbAccount(drb, true);
+
+	updateBroadcastValues(false);
+}
+
 /*!
 	@function getMTU
 	@abstract returns the MTU (Max Transmission Unit) supported by the IOFireWireIP.
@@ -963,7 +1385,7 @@ DRB *IOFWIPBusInterface::initDRBwithDevice(UWIDE eui64, IOFireWireNub *device, b
 */
 UInt32 IOFWIPBusInterface::getMTU()
 {
-    return FIREWIRE_MTU;
+    return fIPLocalNode->fMaxDatagramSize;
 }
 
 UInt32 IOFWIPBusInterface::outputPacket(mbuf_t pkt, void * param)
@@ -971,26 +1393,61 @@ UInt32 IOFWIPBusInterface::outputPacket(mbuf_t pkt, void * param)
 	struct firewire_header *fwh;
 	int	status = kIOReturnError;
 	
+	mbuf_tso_request_flags_t	tsoRequest	= 0;
+	u_int32_t					tsoMSS		= 0;
+	bool						ndpOptions	= false;
+
 	fwh = (struct firewire_header*)mbuf_data(pkt);
+
+	// Parsed once here, isControlFrame and the NDP checks below use the result
+	classifyPacket(pkt, htons(fwh->fw_type), &fTxInfo);
+
+	bool ndp = (fTxInfo.protocol == IPPROTO_ICMPV6)
+				and ((fTxInfo.icmp6Type == ND_NEIGHBOR_SOLICIT) or (fTxInfo.icmp6Type == ND_NEIGHBOR_ADVERT));
 	
-	switch(htons(fwh->fw_type))
+	// Queueing delay control comes first, link control frames are exempt. A packet
+	// retried after a stall was judged the first time round, once is all CoDel wants
+	if( (pkt != fAQMLastPkt) and (not isControlFrame(pkt, htons(fwh->fw_type))) and aqmShouldDrop(pkt) )
 	{
-		case FWTYPE_IPV6:
-			addNDPOptions(pkt);
-			status = txIP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, FWTYPE_IPV6);
-			break;
-			
-		case FWTYPE_IP:
-			status = txIP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, FWTYPE_IP);
-			break;
+		fTxInfo.m = NULL;
+		fAQMLastPkt = NULL;
+		fIPLocalNode->freePacket(pkt);
+		fIPLocalNode->fIPoFWDiagnostics.fAQMDrops++;
+		return kIOReturnOutputDropped;
+	}
 
-		case FWTYPE_ARP:
-			status = txARP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->maxBroadcastSpeed);
-			break;
-			
-		default :
-			fIPLocalNode->freePacket(pkt);
-			break;
+	// Held control frames go ahead of everything
+	if( (fControlQueue != NULL) and (txControlDrain() == kIOFireWireOutOfTLabels) )
+		status = kIOFireWireOutOfTLabels;
+	// Segments left over from an earlier large send keep their place in the stream
+	else if( (fLargeSendQueue != NULL) and (txLargeSendDrain() == kIOFireWireOutOfTLabels) )
+		status = kIOFireWireOutOfTLabels;
+	else
+	{
+		switch(htons(fwh->fw_type))
+		{
+			case FWTYPE_IPV6:
+				if(ndp)
+					addNDPOptions(pkt);
+				ndpOptions = true;
+				status = txIP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, FWTYPE_IPV6);
+				break;
+				
+			case FWTYPE_IP:
+				if( (mbuf_get_tso_requested(pkt, &tsoRequest, &tsoMSS) == 0) and (tsoRequest & MBUF_TSO_IPV4) )
+					status = txLargeSend(pkt, tsoMSS);
+				else
+					status = txIP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, FWTYPE_IP);
+				break;
+
+			case FWTYPE_ARP:
+				status = txARP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->maxBroadcastSpeed);
+				break;
+				
+			default :
+				fIPLocalNode->freePacket(pkt);
+				break;
+		}
 	}
 
 	if(status == kIOFireWireOutOfTLabels)
@@ -1003,17 +1460,43 @@ UInt32 IOFWIPBusInterface::outputPacket(mbuf_t pkt, void * param)
 		if((fIPLocalNode->transmitQueue->getSize() > fIPLocalNode->fIPoFWDiagnostics.fMaxQueueSize)
 			|| ((fIPLocalNode->fIPoFWDiagnostics.fActiveCmds - fIPLocalNode->fIPoFWDiagnostics.fInActiveCmds)  <= 1))
 		{
-			// So far, too many stalls. Sink the packets, till we have manageable queue
-			fIPLocalNode->freePacket(pkt);
-			fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
-			status = kIOReturnOutputDropped;
-		}
-	}
-	else
-		status = kIOReturnOutputSuccess;
+			// So far, too many stalls. Sink the packets, till we have manageable queue,
+			// but hold on to ARP and ND, the link needs them to recover
+			UInt16 type = htons(fwh->fw_type);
 
-    return status;
-}
+			if( isControlFrame(pkt, type) and (fControlQueueLength < kMaxControlQueue) )
+			{
+				recursiveScopeLock lock(fIPLock);
+
+				if( ndp and (not ndpOptions) )
+					addNDPOptions(pkt);
+
+				if( fControlTail != NULL )
+					mbuf_setnextpkt(fControlTail, pkt);
+				else
+					fControlQueue = pkt;
+				fControlTail = pkt;
+				fControlQueueLength++;
+				fIPLocalNode->fIPoFWDiagnostics.fTxControlHeld++;
+			}
+			else
+			{
+				fIPLocalNode->freePacket(pkt);
+				fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+			}
+			status = kIOReturnOutputDropped;
+		}
+	}
+	else
+		status = kIOReturnOutputSuccess;
+
+	fTxInfo.m = NULL;
+
+	// Only a stalled packet comes back, anything else is gone and its address may be reused
+	fAQMLastPkt = (status == kIOReturnOutputStall) ? pkt : NULL;
+
+    return status;
+}
 
 /*!
 	@function txComplete
@@ -1027,45 +1510,70 @@ UInt32 IOFWIPBusInterface::outputPacket(mbuf_t pkt, void * param)
 void IOFWIPBusInterface::txCompleteBlockWrite(void *refcon, IOReturn status, IOFireWireNub *device, IOFWCommand *fwCmd)
 {
     IOFWIPBusInterface			*fwIPPriv	= (IOFWIPBusInterface*)refcon;
+	// Only IOFWIPAsyncWriteCommands complete here, getAsyncCommand registered us with them
+    IOFWIPAsyncWriteCommand		*cmd		= (IOFWIPAsyncWriteCommand*)fwCmd;
 	
-	if(not fwIPPriv)
+	if( (not fwIPPriv) or (not cmd) )
 		return;
-		
-	IOFireWireIP				*fwIPObject	= OSDynamicCast(IOFireWireIP, fwIPPriv->fIPLocalNode);
 	
-	if(not fwIPObject)
+	// Statistics are accounted once per batch in txCompleteFlush
+	if(status == kIOReturnSuccess)
+		fwIPPriv->fTxCompletedPackets++;
+	else if(status != kIOFireWireBusReset)
+		fwIPPriv->fTxCompletedErrors++;		// Reset failures are accounted once per datagram by txHoldPacket
+	
+	cmd->resetDescriptor(status);
+	
+	fwIPPriv->returnAsyncCommand(cmd);
+	
+	fwIPPriv->txCompleteFlush(false);
+
+    return;
+}
+
+/*!
+	@function txCompleteFlush
+	@abstract Processes the block write completions collected by txCompleteBlockWrite.
+			  Statistics are updated and the output queue serviced once per batch, a batch
+			  ends after kTxCompletionBatch completions or when few commands are left in
+			  flight, so the queue never waits on completions that won't come.
+	@param force - flush whatever is pending, used by the watchdog.
+	@result void.
+*/
+void IOFWIPBusInterface::txCompleteFlush(bool force)
+{
+	UInt32 pending		= fTxCompletedPackets + fTxCompletedErrors;
+	UInt32 outstanding	= fIPLocalNode->fIPoFWDiagnostics.fActiveCmds - fIPLocalNode->fIPoFWDiagnostics.fInActiveCmds;
+	
+	if( pending == 0 )
 		return;
-		
-    IOFWIPAsyncWriteCommand		*cmd		= OSDynamicCast(IOFWIPAsyncWriteCommand, fwCmd);
 	
-	if(not cmd)
+	if( (not force) and (pending < kTxCompletionBatch) and (outstanding > kTxCompletionBatch) )
 		return;
 	
-	// Only in case of kIOFireWireOutOfTLabels, we ignore freeing of Mbuf
-	if(status == kIOReturnSuccess)
-	{
-		// We get callback 1 packet at a time, so we can increment by 1
-		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->outputPackets);
-		fwIPObject->fIPoFWDiagnostics.fTxUni++;
-	}
-	else 
-	{
-		// Increment error output packets
-		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->outputErrors);
-		fwIPObject->fIPoFWDiagnostics.fCallErrs++;
-	}
+	IONetworkStats *netStats = fIPLocalNode->getNetStats();
 	
-	cmd->resetDescriptor(status);
+	netStats->outputPackets								+= fTxCompletedPackets;
+	fIPLocalNode->fIPoFWDiagnostics.fTxUni				+= fTxCompletedPackets;
+	netStats->outputErrors								+= fTxCompletedErrors;
+	fIPLocalNode->fIPoFWDiagnostics.fCallErrs			+= fTxCompletedErrors;
+	fIPLocalNode->fIPoFWDiagnostics.fTxCompleteBatches++;
 	
-	fwIPPriv->returnAsyncCommand(cmd);
+	fTxCompletedPackets = 0;
+	fTxCompletedErrors	= 0;
 	
-	if ( (fwIPObject->fIPoFWDiagnostics.fActiveCmds - fwIPObject->fIPoFWDiagnostics.fInActiveCmds)  <= fwIPPriv->fLowWaterMark )
+	// Freed labels go to held control frames first, then the rest of a large send
+	if( fControlQueue != NULL )
+		txControlDrain();
+
+	if( fLargeSendQueue != NULL )
+		txLargeSendDrain();
+	
+	if ( outstanding <= fLowWaterMark )
 	{
-		fwIPObject->transmitQueue->service( IOBasicOutputQueue::kServiceAsync );
-		fwIPObject->fIPoFWDiagnostics.fServiceInCallback++;
+		fIPLocalNode->transmitQueue->service( IOBasicOutputQueue::kServiceAsync );
+		fIPLocalNode->fIPoFWDiagnostics.fServiceInCallback++;
 	}
-
-    return;
 }
 
 /*!
@@ -1103,11 +1611,11 @@ void IOFWIPBusInterface::txCompleteAsyncStream(void *refcon, IOReturn status,
 	else
 		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->outputErrors);
 
-	if(fwIPPriv->fAsyncStreamTxCmdPool != NULL) 		// Queue the command back into the command pool
-	{
-		fwIPPriv->fAsyncStreamTxCmdPool->returnCommand(cmd);
-		fwIPObject->fIPoFWDiagnostics.fInActiveBcastCmds++;
-	}
+	fwIPPriv->returnAsyncStreamCommand(cmd);
+
+	// A stream command is free again, held ARP may be waiting for one
+	if( fwIPPriv->fControlQueue != NULL )
+		fwIPPriv->txControlDrain();
 
     return;
 }
@@ -1122,19 +1630,14 @@ SInt32 IOFWIPBusInterface::txARP(mbuf_t m, UInt16 nodeID, UInt32 busGeneration,
 {
 	IOReturn status = kIOReturnSuccess;
 	
-	if(fAsyncStreamTxCmdPool == NULL)
-		status = initAsyncStreamCmdPool();
-	
 	// Get an async command from the command pool
-	IOFWIPAsyncStreamTxCommand	*cmd = (IOFWIPAsyncStreamTxCommand*)fAsyncStreamTxCmdPool->getCommand(false);
+	IOFWIPAsyncStreamTxCommand	*cmd = getAsyncStreamCommand(true);
 		
-	// Lets not block to get a command, IP may retry soon ..:)
+	// Lets not block to get a command, the packet stays ours and is retried like a label shortage
 	if(cmd == NULL)
 	{
-		// Error, so we touch the error output packets
-		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
 		fIPLocalNode->fIPoFWDiagnostics.fNoBCastCommands++;
-		return status;
+		return kIOFireWireOutOfTLabels;
 	}
 
 	fIPLocalNode->fIPoFWDiagnostics.fActiveBcastCmds++;
@@ -1180,8 +1683,7 @@ SInt32 IOFWIPBusInterface::txARP(mbuf_t m, UInt16 nodeID, UInt32 busGeneration,
 	else
 	{
 		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
-		fAsyncStreamTxCmdPool->returnCommand(cmd);
-		fIPLocalNode->fIPoFWDiagnostics.fInActiveBcastCmds++;
+		returnAsyncStreamCommand(cmd);
 	}
 
 	if(status != kIOReturnSuccess)
@@ -1205,10 +1707,15 @@ SInt32	IOFWIPBusInterface::txBroadcastIP(const mbuf_t m, UInt16 nodeID, UInt32 b
 	if( maxPayload < fOptimalMTU || fOptimalMTU == 0 )
 	{
 		fOptimalMTU = maxPayload;
-		fIPLocalNode->networkInterface->setIfnetMTU( MAX(fOptimalMTU, 1500) );
+		fIPLocalNode->updateMTU( MAX(fOptimalMTU, 1500) );
 		fIPLocalNode->fIPoFWDiagnostics.fMaxPacketSize = fOptimalMTU;
 	}
 
+	// With few peers or a slow node on the bus, per peer block writes can cost less bus time
+	if( (channel == DEFAULT_BROADCAST_CHANNEL)
+		and txReplicatedBroadcast(m, nodeID, busGeneration, ownMaxPayload, maxPayload, speed, type) )
+		return kIOReturnSuccess;
+
 	IOReturn	status = ENOBUFS;
 	// Asynchronous stream datagrams are never fragmented!
 	if (datagramSize + sizeof(IP1394_UNFRAG_HDR) > maxPayload)
@@ -1218,19 +1725,22 @@ SInt32	IOFWIPBusInterface::txBroadcastIP(const mbuf_t m, UInt16 nodeID, UInt32 b
 		return status;
 	}
 
-	// create a command pool on demand
-	if(fAsyncStreamTxCmdPool == NULL)
-		initAsyncStreamCmdPool();
-	
+	bool control = isControlFrame(m, type);
+
 	// Get an async command from the command pool
-	IOFWIPAsyncStreamTxCommand *asyncStreamCmd = (IOFWIPAsyncStreamTxCommand*)fAsyncStreamTxCmdPool->getCommand(false);
+	IOFWIPAsyncStreamTxCommand *asyncStreamCmd = getAsyncStreamCommand(control);
 	
 	// Lets not block to get a command, IP may retry soon ..:)
 	if(asyncStreamCmd == NULL)
 	{
+		fIPLocalNode->fIPoFWDiagnostics.fNoBCastCommands++;
+
+		// Neighbor Discovery is retried like a label shortage rather than lost
+		if( control )
+			return kIOFireWireOutOfTLabels;
+
 		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
 		fIPLocalNode->freePacket(m);
-		fIPLocalNode->fIPoFWDiagnostics.fNoBCastCommands++;
 		return status;
 	}
 
@@ -1271,8 +1781,7 @@ SInt32	IOFWIPBusInterface::txBroadcastIP(const mbuf_t m, UInt16 nodeID, UInt32 b
 	else
 	{
 		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
-		fAsyncStreamTxCmdPool->returnCommand(asyncStreamCmd);
-		fIPLocalNode->fIPoFWDiagnostics.fInActiveBcastCmds++;
+		returnAsyncStreamCommand(asyncStreamCmd);
 	}
 
 	if(status != kIOReturnSuccess)
@@ -1285,11 +1794,156 @@ SInt32	IOFWIPBusInterface::txBroadcastIP(const mbuf_t m, UInt16 nodeID, UInt32 b
 	return status;
 }
 
+/*!
+	@function estimateBusTime
+	@abstract Rough serial bus occupancy of a datagram, in eighths of an S100 byte time
+			  so an S800 byte is still a whole unit. The kBusTime constants are S100
+			  byte times and are scaled by eight here, callers only compare results.
+	@param bytes - size of the datagram.
+	@param maxPayload - largest payload per packet, the datagram is fragmented above it.
+	@param speed - speed the packets are sent at.
+	@param overhead - per packet header, CRC and acknowledge bytes sent at that speed.
+	@result UInt32 - estimated bus time.
+*/
+UInt32 IOFWIPBusInterface::estimateBusTime(UInt32 bytes, UInt32 maxPayload, IOFWSpeed speed, UInt32 overhead)
+{
+	UInt32 packets = 1;
+
+	if( bytes + sizeof(IP1394_UNFRAG_HDR) > maxPayload )
+		packets = (bytes + (maxPayload - sizeof(IP1394_FRAG_HDR)) - 1) / (maxPayload - sizeof(IP1394_FRAG_HDR));
+
+	speed = (IOFWSpeed)MIN(speed, kFWSpeed800MBit);
+
+	// Arbitration and gaps don't scale with speed, the packets do
+	return	  ((packets * kBusTimeArbitration) << kFWSpeed800MBit)
+			+ (((bytes + packets * overhead) << kFWSpeed800MBit) >> speed);
+}
+
+/*!
+	@function txReplicatedBroadcast
+	@abstract Sends a broadcast class datagram as one block write to each IP peer.
+	@discussion maxBroadcastSpeed and maxBroadcastPayload follow the slowest node on the
+				bus, so a single S100 device drags every stream packet down to S100. When
+				only a few peers are present, and each one is resolved, the datagram is
+				replicated as unicast block writes at every peer's own speed, if that
+				is estimated to take less bus time than the single stream packet.
+	@param m - mbuf containing the IP packet, consumed only if the function returns true.
+	@param maxPayload - broadcast payload in bytes.
+	@param speed - broadcast speed.
+	@result bool - true if the datagram was replicated, false if it has to be streamed.
+*/
+bool IOFWIPBusInterface::txReplicatedBroadcast(const mbuf_t m, UInt16 nodeID, UInt32 busGeneration,
+												UInt16 ownMaxPayload, UInt16 maxPayload,
+												IOFWSpeed speed, const UInt16 type)
+{
+	UInt8	peerAddr[kMaxBroadcastReplicaPeers][kIOFWAddressSize];
+	UInt32	peerCount		= 0;
+	UInt32	datagramSize	= mbuf_pkthdr_len(m) - sizeof(struct firewire_header);
+	UInt32	unicastTime		= 0;
+	UInt32	streamTime		= 0xFFFFFFFF;
+	bool	eligible		= true;
+
+	recursiveScopeLock lock(fIPLock);
+
+	OSCollectionIterator *drbIterator = OSCollectionIterator::withCollection( activeDrb );
+	OSCollectionIterator *arbIterator = OSCollectionIterator::withCollection( unicastArb );
+
+	if( drbIterator and arbIterator )
+	{
+		DRB *drb = NULL;
+
+		while( eligible and NULL != (drb = OSDynamicCast(DRB, drbIterator->getNextObject())) )
+		{
+			if( drb->deviceID == NULL )
+				continue;
+
+			ARB *arb = NULL;
+
+			arbIterator->reset();
+			while( NULL != (arb = OSDynamicCast(ARB, arbIterator->getNextObject())) )
+				if (arb->eui64.hi == drb->eui64.hi && arb->eui64.lo == drb->eui64.lo)
+					break;
+
+			// Every peer must be reachable by block write, else some would miss the datagram
+			if( (arb == NULL)
+				or (arb->handle.unicast.deviceID == NULL)
+				or ((arb->handle.unicast.unicastFifoHi == 0) and (arb->handle.unicast.unicastFifoLo == 0))
+				or (peerCount >= kMaxBroadcastReplicaPeers) )
+			{
+				eligible = false;
+				break;
+			}
+
+			UInt32 peerPayload = MIN((UInt32)1 << (arb->handle.unicast.maxRec+1), (UInt32)1 << ownMaxPayload);
+			peerPayload = MIN(peerPayload, (UInt32)1 << drb->maxPayload);
+
+			unicastTime += estimateBusTime(datagramSize, peerPayload, drb->maxSpeed, kBusTimeBlockWriteOverhead);
+
+			bcopy(arb->fwaddr, peerAddr[peerCount++], kIOFWAddressSize);
+		}
+	}
+
+	if( drbIterator )
+		drbIterator->release();
+
+	if( arbIterator )
+		arbIterator->release();
+
+	if( (not eligible) or (peerCount == 0) )
+		return false;
+
+	// Stream packets are never fragmented, an oversized datagram can only go out as block writes
+	if( datagramSize + sizeof(IP1394_UNFRAG_HDR) <= maxPayload )
+		streamTime = estimateBusTime(datagramSize, maxPayload, speed, kBusTimeStreamOverhead);
+
+	if( unicastTime >= streamTime )
+		return false;
+
+	mbuf_t	copies[kMaxBroadcastReplicaPeers];
+	bool	complete = true;
+
+	// Every copy is made before any goes out, a peer short of its copy would miss the datagram
+	copies[peerCount - 1] = m;		// Last peer gets the original
+	for( UInt32 i = 0; i < peerCount - 1; i++ )
+	{
+		if( mbuf_dup(m, MBUF_DONTWAIT, &copies[i]) != 0 )
+		{
+			while( i > 0 )
+				fIPLocalNode->freePacket(copies[--i]);
+
+			fIPLocalNode->fIPoFWDiagnostics.fNoMbufs++;
+			return false;			// Stream it instead, the original is still the caller's
+		}
+	}
+
+	for( UInt32 i = 0; i < peerCount; i++ )
+	{
+		mbuf_t n = copies[i];
+
+		struct firewire_header *fwh = (struct firewire_header *)mbuf_data(n);
+		bcopy(peerAddr[i], fwh->fw_dhost, kIOFWAddressSize);
+
+		// Not worth stalling the queue for one copy of a broadcast
+		if( txUnicastIP(n, nodeID, busGeneration, ownMaxPayload, speed, type) == kIOFireWireOutOfTLabels )
+		{
+			fIPLocalNode->freePacket(n);
+			fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+			complete = false;
+		}
+	}
+
+	if( complete )
+		fIPLocalNode->fIPoFWDiagnostics.fTxBcastReplicated++;
+
+	return true;
+}
+
 SInt32 IOFWIPBusInterface::txUnicastUnFragmented(IOFireWireNub *device, const FWAddress addr, const mbuf_t m, const UInt16 pktSize, const UInt16 type)
 {
 	SInt32 status = kIOReturnSuccess;
 
 	bool deferNotify = true;
+	bool control	 = isControlFrame(m, type);
 
 	IOFWIPMBufCommand * mBufCommand = getMBufCommand();
 
@@ -1300,9 +1954,9 @@ SInt32 IOFWIPBusInterface::txUnicastUnFragmented(IOFireWireNub *device, const FW
 		return status;
 	}
 
-	mBufCommand->reinit(m, fIPLocalNode, fMbufCmdPool);
+	mBufCommand->reinit(m, fIPLocalNode, this, fMbufCmdPool);
 
-	IOFWIPAsyncWriteCommand *cmd = getAsyncCommand(false, &deferNotify); // Get an async command from the command pool
+	IOFWIPAsyncWriteCommand *cmd = getAsyncCommand(false, &deferNotify, control); // Get an async command from the command pool
 
 	mBufCommand->retain();
 	
@@ -1321,6 +1975,8 @@ SInt32 IOFWIPBusInterface::txUnicastUnFragmented(IOFireWireNub *device, const FW
 								deferNotify, kQueueCommands);
 
 	}
+	else if( controlReserveReached(control) )
+		status = kIOFireWireOutOfTLabels;	// Data waits for a completion, as for a label shortage
 
 	mBufCommand->releaseWithStatus(status);
 
@@ -1338,6 +1994,7 @@ SInt32 IOFWIPBusInterface::txUnicastFragmented(IOFireWireNub *device, const FWAd
 	UInt32	offset = sizeof(struct firewire_header);
 	SInt32	status = kIOReturnSuccess;
 	bool	deferNotify = true;
+	bool	control = isControlFrame(m, type);
 
 	IOFWIPMBufCommand * mBufCommand = getMBufCommand();
 
@@ -1348,7 +2005,7 @@ SInt32 IOFWIPBusInterface::txUnicastFragmented(IOFireWireNub *device, const FWAd
 		return status;
 	}
 	
-	mBufCommand->reinit(m, fIPLocalNode, fMbufCmdPool);
+	mBufCommand->reinit(m, fIPLocalNode, this, fMbufCmdPool);
 	mBufCommand->retain();
 	
 	while (residual) 
@@ -1356,11 +2013,17 @@ SInt32 IOFWIPBusInterface::txUnicastFragmented(IOFireWireNub *device, const FWAd
 		deferNotify = true;
 		status		= kIOReturnSuccess;
 		
-		IOFWIPAsyncWriteCommand *cmd = getAsyncCommand(false, &deferNotify); // Get an async command from the command pool
+		IOFWIPAsyncWriteCommand *cmd = getAsyncCommand(false, &deferNotify, control); // Get an async command from the command pool
 	
 		// Lets not block to get a command, IP may retry soon ..:)
+		// Only a datagram with nothing sent yet may stall, the fragments already
+		// queued read from the mbuf, so it can't be requeued or freed under them
 		if(not cmd) 
+		{
+			if( (fragmentOffset == 0) and controlReserveReached(control) )
+				status = kIOFireWireOutOfTLabels;
 			break;
+		}
 		
 		// false - don't copy , if true - copy the packets
 		fIPLocalNode->fIPoFWDiagnostics.fTxFragmentPkts++;
@@ -1417,10 +2080,10 @@ SInt32 IOFWIPBusInterface::txUnicastIP(mbuf_t m, UInt16 nodeID, UInt32 busGenera
 
 	SInt32 status = EHOSTUNREACH;
 	
+	// Held if a bus reset is settling, the node may come back with the new generation
 	if(arb == NULL)
 	{
-		fIPLocalNode->freePacket(m);
-		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+		txHoldPacket(m);
 		IORecursiveLockUnlock(fIPLock);
 		return status;
 	}
@@ -1431,8 +2094,7 @@ SInt32 IOFWIPBusInterface::txUnicastIP(mbuf_t m, UInt16 nodeID, UInt32 busGenera
 	// Node had disappeared, but entry exists for specified timer value
 	if(device == NULL) 
 	{
-		fIPLocalNode->freePacket(m);
-		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+		txHoldPacket(m);
 		IORecursiveLockUnlock(fIPLock);
 		return status;
 	}
@@ -1440,6 +2102,15 @@ SInt32 IOFWIPBusInterface::txUnicastIP(mbuf_t m, UInt16 nodeID, UInt32 busGenera
 	// Get the actual length of the packet from the mbuf
 	UInt16 datagramSize = mbuf_pkthdr_len(m) - sizeof(struct firewire_header);
 	UInt16 residual		= datagramSize;
+
+	// Jumbo datagrams are an Apple extension, an RFC 2734 peer would misparse them
+	if( (datagramSize > FIREWIRE_MTU) and (not arb->itsMac) )
+	{
+		fIPLocalNode->freePacket(m);
+		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+		IORecursiveLockUnlock(fIPLock);
+		return status;
+	}
 	
 	// setup block write
 	FWAddress addr; 
@@ -1455,7 +2126,7 @@ SInt32 IOFWIPBusInterface::txUnicastIP(mbuf_t m, UInt16 nodeID, UInt32 busGenera
 	if( maxPayload < fOptimalMTU || fOptimalMTU == 0 )
 	{
 		fOptimalMTU = maxPayload;
-		fIPLocalNode->networkInterface->setIfnetMTU( MAX(fOptimalMTU, 1500) );
+		fIPLocalNode->updateMTU( MAX(fOptimalMTU, 1500) );
 		fIPLocalNode->fIPoFWDiagnostics.fMaxPacketSize = fOptimalMTU;
 	}
 
@@ -1471,10 +2142,86 @@ SInt32 IOFWIPBusInterface::txUnicastIP(mbuf_t m, UInt16 nodeID, UInt32 busGenera
 		status = txUnicastFragmented(device, addr, m, residual, type, maxPayload, dgl);
 	
     IORecursiveLockUnlock(fIPLock);
-		
+
 	return status;
 }
 
+/*!
+	@function txMulticastIP
+	@abstract Transmit multicast IP packet on the channel MCAP assigned to its group.
+			  If rxMCAP bound the group to a channel other than the default broadcast
+			  channel, the packet goes out on that channel at the speed advertised for
+			  the group, so non members never see it on channel 31. Groups without an
+			  MCAP assignment fall back to the default broadcast channel.
+	@param m - mbuf containing the IP packet.
+	@param type - type of the packet (IPv6 or IPv4).
+	@result SInt32.
+*/
+SInt32 IOFWIPBusInterface::txMulticastIP(mbuf_t m, UInt16 nodeID, UInt32 busGeneration, UInt16 ownMaxPayload, UInt16 maxBroadcastPayload, IOFWSpeed speed, const UInt16 type)
+{
+	struct firewire_header *fwh = (struct firewire_header *)mbuf_data(m);
+
+	UInt32		groupAddress	= 0;
+	UInt32		channel			= DEFAULT_BROADCAST_CHANNEL;
+	IOFWSpeed	groupSpeed		= speed;
+	bool		solicit			= false;
+
+	// Same mapping as updateMulticastCache, group address follows the multicast prefix
+	memcpy(&groupAddress, &fwh->fw_dhost[4], sizeof(groupAddress));
+
+	IORecursiveLockLock(fIPLock);
+
+	MARB *arb = NULL;
+
+	if( fwh->fw_dhost[0] == ipv6multicast[0] )
+	{
+		arb = getMulticastArb6(fwh->fw_dhost);
+
+		// The link address drops part of the group, take the whole of it from the packet
+		if( (arb != NULL) and (not arb->group6Known) and (type == FWTYPE_IPV6)
+			and (mbuf_copydata(m, sizeof(struct firewire_header) + offsetof(struct ip6_hdr, ip6_dst),
+								sizeof(arb->group6), arb->group6) == 0) )
+		{
+			arb->group6Known = true;
+			fMCAPGroupGen++;		// Cached advertisements may now describe it
+		}
+	}
+	else
+		arb = getMulticastArb(groupAddress);
+
+	if( arb != NULL
+		and arb->handle.multicast.channel != DEFAULT_BROADCAST_CHANNEL
+		and arb->handle.multicast.channel < kMaxChannels )
+	{
+		channel		= arb->handle.multicast.channel;
+		groupSpeed	= (IOFWSpeed)MIN(arb->handle.multicast.spd, fLcb->ownMaxSpeed);
+		fIPLocalNode->fIPoFWDiagnostics.fTxMcastOnChannel++;
+
+		MCB *mcb = OSDynamicCast(MCB, mcapState->getObject(channel));
+		if( mcb != NULL )
+			mcb->txIdle = 0;		// Keeps an owned channel renewed
+	}
+	else if( (arb != NULL) and (arb->mcapPhase == MCAP_PHASE_IDLE) )
+	{
+		// We send to a group with no channel, see if it has an owner before allocating one
+		arb->mcapPhase	= MCAP_PHASE_SOLICIT;
+		arb->mcapTimer	= kMCAPSolicitWait;
+		solicit			= true;
+		arb->retain();
+		mcapArmGroups();
+	}
+
+	IORecursiveLockUnlock(fIPLock);
+
+	if( solicit )
+	{
+		txMCAP(0, arb);
+		arb->release();
+	}
+
+	return txBroadcastIP(m, nodeID, busGeneration, ownMaxPayload, maxBroadcastPayload, groupSpeed, type, channel);
+}
+
 /*!
 	@function txIP
 	@abstract Transmit IP packet.
@@ -1495,11 +2242,12 @@ SInt32 IOFWIPBusInterface::txIP(mbuf_t m, UInt16 nodeID, UInt32 busGeneration, U
 	SInt32 status = kIOReturnSuccess;
 
 	struct firewire_header *fwh = (struct firewire_header *)mbuf_data(m);
-	
-	if(		( bcmp(fwh->fw_dhost, fwbroadcastaddr, kIOFWAddressSize)	== 0 )
-		or	( bcmp(fwh->fw_dhost, ipv4multicast, FIREWIREMCAST_V4_LEN)	== 0 )	
-		or	( bcmp(fwh->fw_dhost, ipv6multicast, FIREWIREMCAST_V6_LEN)	== 0 )	)
+
+	if( bcmp(fwh->fw_dhost, fwbroadcastaddr, kIOFWAddressSize) == 0 )
 		status = txBroadcastIP(m, nodeID, busGeneration, ownMaxPayload, maxBroadcastPayload, speed, type, DEFAULT_BROADCAST_CHANNEL);
+	else if(	( bcmp(fwh->fw_dhost, ipv4multicast, FIREWIREMCAST_V4_LEN)	== 0 )
+			or	( bcmp(fwh->fw_dhost, ipv6multicast, FIREWIREMCAST_V6_LEN)	== 0 )	)
+		status = txMulticastIP(m, nodeID, busGeneration, ownMaxPayload, maxBroadcastPayload, speed, type);
 	else
 		status = txUnicastIP(m, nodeID, busGeneration, ownMaxPayload, speed, type);
 	
@@ -1507,1367 +2255,3216 @@ SInt32 IOFWIPBusInterface::txIP(mbuf_t m, UInt16 nodeID, UInt32 busGeneration, U
 }
 
 /*!
-	@function txMCAP
-	@abstract This procedure transmits either an MCAP solicitation or advertisement on the
-			  default broadcast channel, dependent upon whether or not an MCB is supplied.
-			  If more than one multicast address group is associated with a particular channel 
-			  that many multiple MCAP group descriptors are created.
-	@param mcb			- multicast control block.
-	@param groupAddress	- group address.
-	@result void.
+	@function checksumSum
+	@abstract Ones complement sum of a byte range in an mbuf chain, in network order words.
+	@param m - mbuf chain.
+	@param offset - offset of the first byte.
+	@param len - number of bytes to add.
+	@result UInt32 - unfolded sum.
 */
-void IOFWIPBusInterface::txMCAP(MCB *mcb, UInt32 groupAddress)
+static UInt32 checksumSum(mbuf_t m, UInt32 offset, UInt32 len)
 {
-	if(fAsyncStreamTxCmdPool == NULL)
-		initAsyncStreamCmdPool();
-	
-	// Get an async command from the command pool
-	IOFWIPAsyncStreamTxCommand	*asyncStreamCmd = (IOFWIPAsyncStreamTxCommand*)fAsyncStreamTxCmdPool->getCommand(false);
-		
-	// Lets not block to get a command, IP may retry soon ..:)
-	if(asyncStreamCmd == NULL)
-	{
-		fIPLocalNode->fIPoFWDiagnostics.fNoBCastCommands++;
-		return;
-	}
+	UInt32	sum = 0;
+	bool	odd = false;		// previous mbuf ended in the middle of a word
 
-	fIPLocalNode->fIPoFWDiagnostics.fActiveBcastCmds++;
-			
-	// Get the buffer pointer from the command pool
-	struct mcap_packet	*packet	= (struct mcap_packet*)asyncStreamCmd->getBufferFromDesc();
-	
-	memset(packet, 0, sizeof(*packet));
-	packet->gaspHdr.sourceID		= htons(fLcb->ownNodeID);
-	
-	memcpy(&packet->gaspHdr.gaspID, &gaspVal, sizeof(GASP_ID));
-	packet->ip1394Hdr.etherType		= htons(ETHER_TYPE_MCAP);
-	packet->mcap.length				= sizeof(*packet);          
-	MCAST_DESCR	*groupDescriptor	= packet->mcap.groupDescr;
-	
-	if (mcb != NULL) 
+	for( ; (m != NULL) and (len != 0); m = mbuf_next(m) )
 	{
-		MARB	*arb = NULL;
+		UInt32 mlen = mbuf_len(m);
 
-		packet->mcap.opcode = MCAP_ADVERTISE;
+		if( offset >= mlen )
+		{
+			offset -= mlen;
+			continue;
+		}
 
-		IORecursiveLockLock(fIPLock);
+		UInt8	*p		= (UInt8*)mbuf_data(m) + offset;
+		UInt32	chunk	= MIN(len, mlen - offset);
+		UInt32	i		= 0;
 
-		OSCollectionIterator * iterator = OSCollectionIterator::withCollection( multicastArb );
-		if( iterator )
+		offset	= 0;
+		len		-= chunk;
+
+		if( odd )
 		{
-			while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
-			{
-				if (arb->handle.multicast.channel == mcb->channel) 
-				{
-					memset(groupDescriptor, 0, sizeof(MCAST_DESCR));
-					groupDescriptor->length			= sizeof(MCAST_DESCR);
-					groupDescriptor->type			= MCAST_TYPE;
-					groupDescriptor->expiration		= mcb->expiration;
-					groupDescriptor->channel		= mcb->channel;
-					groupDescriptor->speed			= arb->handle.multicast.spd;
-					groupDescriptor->groupAddress	= arb->handle.multicast.groupAddress;
-					
-					groupDescriptor					= (MCAST_DESCR*)((UInt64)groupDescriptor + sizeof(MCAST_DESCR));
-					packet->mcap.length				+= sizeof(MCAST_DESCR);
-				}
-			}
-			iterator->release();
+			sum += p[i++];
+			odd = false;
 		}
-		
-	    IORecursiveLockUnlock(fIPLock);
-	}
-	else 
-	{
-		memset(groupDescriptor, 0, sizeof(MCAST_DESCR));
-		packet->mcap.opcode				= MCAP_SOLICIT;
-		packet->mcap.length				+= sizeof(MCAST_DESCR);
-		groupDescriptor->length			= sizeof(MCAST_DESCR);
-		groupDescriptor->type			= MCAST_TYPE;
-		groupDescriptor->groupAddress	= groupAddress;
-	}
 
-	UInt32 cmdLen		= packet->mcap.length;		// In CPU byte order 
-	packet->mcap.length	= htons(cmdLen);			// Serial Bus order
+		for( ; i + 1 < chunk; i += 2 )
+			sum += ((UInt32)p[i] << 8) | p[i+1];
 
-	// Initialize the command with new values of device object
-	IOReturn status = asyncStreamCmd->reinit (	fLcb->busGeneration, 
-												DEFAULT_BROADCAST_CHANNEL, 
-												cmdLen,
-												fLcb->maxBroadcastSpeed,
-												txCompleteAsyncStream, 
-												this);
-					  
-	if(status == kIOReturnSuccess)
-		status = asyncStreamCmd->submit();
-	else
-	{
-		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
-		fAsyncStreamTxCmdPool->returnCommand(asyncStreamCmd);
-		fIPLocalNode->fIPoFWDiagnostics.fInActiveBcastCmds++;
+		if( i < chunk )
+		{
+			sum += (UInt32)p[i] << 8;
+			odd = true;
+		}
 	}
 
-	if(status != kIOReturnSuccess)
-		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+	return sum;
+}
+
+static UInt16 checksumFold(UInt32 sum)
+{
+	while( sum >> 16 )
+		sum = (sum & 0xFFFF) + (sum >> 16);
+
+	return htons((UInt16)~sum);
 }
 
 /*!
-	@function rxUnicastFlush
-	@abstract Starts the batch processing of the packets, its
-	          already on its own workloop.
+	@function checksumAdjust
+	@abstract Updates a checksum for changed data without summing the rest, RFC 1624 eqn. 3.
+	@param cksum - checksum in network order.
+	@param oldSum - unfolded sum of the words as they were, from checksumSum.
+	@param newSum - unfolded sum of the words as they are now.
+	@result UInt16 - new checksum in network order.
 */
-void IOFWIPBusInterface::rxUnicastFlush()
+static UInt16 checksumAdjust(UInt16 cksum, UInt32 oldSum, UInt32 newSum)
 {
-	UInt32 count = 0;
+	while( oldSum >> 16 )
+		oldSum = (oldSum & 0xFFFF) + (oldSum >> 16);
 
-    IORecursiveLockLock(fIPLock);
-	
-	if(fIPLocalNode->fPacketsQueued == true)
-	{
-		count = fIPLocalNode->networkInterface->flushInputQueue();
-        if(count > fIPLocalNode->fIPoFWDiagnostics.fMaxInputCount)
-            fIPLocalNode->fIPoFWDiagnostics.fMaxInputCount = count; 
-
-		fIPLocalNode->fPacketsQueued = false;
-	}
-
-    IORecursiveLockUnlock(fIPLock);
-
-	return;
+	// HC' = ~(~HC + ~m + m')
+	return checksumFold((UInt16)~ntohs(cksum) + (UInt16)~oldSum + newSum);
 }
 
 /*!
-	@function rxUnicastComplete
-	@abstract triggers the indication workloop to do batch processing
-				of incoming packets.
+	@function copyMbufToMbuf
+	@abstract Copies len bytes of one mbuf chain into another, at the given offsets.
+	@result void.
 */
-void IOFWIPBusInterface::rxUnicastComplete(void *refcon)
+static void copyMbufToMbuf(mbuf_t src, UInt32 srcOffset, mbuf_t dst, UInt32 dstOffset, UInt32 len)
 {
-	IOFWIPBusInterface *fwIPPriv = (IOFWIPBusInterface*)refcon;
+	for( ; (dst != NULL) and (len != 0); dst = mbuf_next(dst) )
+	{
+		UInt32 dlen = mbuf_len(dst);
 
-	fwIPPriv->rxUnicastFlush();
+		if( dstOffset >= dlen )
+		{
+			dstOffset -= dlen;
+			continue;
+		}
 
-	return;
+		UInt32 chunk = MIN(len, dlen - dstOffset);
+
+		mbuf_copydata(src, srcOffset, chunk, (UInt8*)mbuf_data(dst) + dstOffset);
+
+		srcOffset	+= chunk;
+		len			-= chunk;
+		dstOffset	= 0;
+	}
 }
 
 /*!
-	@function rxUnicast
-	@abstract block write handler. Handles both ARP and IP packet.
+	@function txLargeSend
+	@abstract Transmit a TCP/IPv4 super-packet handed down by the stack with MBUF_TSO_IPV4.
+	@discussion The packet, up to 64 KB, is split into TCP segments that each fit the
+				destination's unfragmented block write payload, so no segment needs link
+				fragmentation. Every segment gets its own IP length, id and checksum, the
+				sequence number of its payload and a TCP checksum over the segment. FIN and
+				PSH are kept for the last segment only and CWR for the first. The segments
+				are queued in order and drained straight into block writes, whatever does
+				not go out for lack of transaction labels is sent from txCompleteFlush.
+	@param m - mbuf containing the super-packet, always consumed.
+	@param mss - maximum segment size requested by the stack.
+	@result SInt32 - kIOReturnSuccess.
 */
-UInt32 IOFWIPBusInterface::rxUnicast( void		*refcon,
-								UInt16		nodeID,
-                                IOFWSpeed	&speed,
-                                FWAddress	addr,
-                                UInt32		len,
-								const void	*buf,
-								IOFWRequestRefCon requestRefcon)
+SInt32 IOFWIPBusInterface::txLargeSend(mbuf_t m, UInt32 mss)
 {
-	IOFWIPBusInterface		*fwIPPriv = (IOFWIPBusInterface*)refcon;
-	IOFireWireIP			*fwIPObject	= OSDynamicCast(IOFireWireIP, fwIPPriv->fIPLocalNode);
-	IP1394_UNFRAG_HDR		*ip1394Hdr	= (IP1394_UNFRAG_HDR *)buf;
+	struct firewire_header	*fwh		= (struct firewire_header *)mbuf_data(m);
+	UInt32					fwHdrLen	= sizeof(struct firewire_header);
+	UInt32					totalLen	= mbuf_pkthdr_len(m);
+	struct ip				ip;
+	struct tcphdr			th;
 
-	if(not fwIPPriv->fStarted)
-		return kIOReturnSuccess;
-   
-	UInt8	lf = (htons(ip1394Hdr->reserved) >> 14);
-	// Handle the unfragmented packet
-	if (lf == UNFRAGMENTED) 
-	{
-		void	*datagram		= (void *) ((UInt64) ip1394Hdr + sizeof(IP1394_UNFRAG_HDR));
-		UInt16	datagramSize	= len - sizeof(IP1394_UNFRAG_HDR);
-		UInt16	type			= ntohs(ip1394Hdr->etherType);
+	if( (totalLen < fwHdrLen + sizeof(ip))
+		or (mbuf_copydata(m, fwHdrLen, sizeof(ip), &ip) != 0)
+		or (ip.ip_p != IPPROTO_TCP) )
+		return txIP(m, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, FWTYPE_IP);
 
-		switch (type) 
-		{
-			case FWTYPE_IPV6:
-			case FWTYPE_IP:
-				if (datagramSize >= IPV4_HDR_SIZE && datagramSize <= FIREWIRE_MTU)
-					fwIPPriv->rxIP(datagram, datagramSize, FW_M_UCAST, type);
-				break;
+	UInt32 ipHdrLen = ip.ip_hl << 2;
 
-			case FWTYPE_ARP:
-				if (datagramSize >= sizeof(IP1394_ARP) && datagramSize <= FIREWIRE_MTU)
-					fwIPPriv->rxARP((IP1394_ARP*)datagram, FW_M_UCAST);
-				break;
-			
-			default :
-				// Unknown packet type
-				fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
-				break;
-		}
-	}
-	else
-	{     
-		fwIPObject->fIPoFWDiagnostics.fRxFragmentPkts++;
-  
-		if(fwIPPriv->rxFragmentedUnicast(nodeID, (IP1394_FRAG_HDR*)ip1394Hdr, len) == kIOReturnError)
-			fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
-	}
+	if( (ipHdrLen < sizeof(ip))
+		or (totalLen < fwHdrLen + ipHdrLen + sizeof(th))
+		or (mbuf_copydata(m, fwHdrLen + ipHdrLen, sizeof(th), &th) != 0) )
+		return txIP(m, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, FWTYPE_IP);
 
-	fwIPObject->fIPoFWDiagnostics.fRxUni++;
-	
-	return kIOReturnSuccess;
-}
-	
-IOReturn IOFWIPBusInterface::rxFragmentedUnicast(UInt16 nodeID, IP1394_FRAG_HDR *pkt, UInt32 len)
-{
-	IP1394_FRAG_HDR *fragmentHdr	= (IP1394_FRAG_HDR*) pkt;  // Different header layout
-	void			*fragment		= (void *) ((UInt64) fragmentHdr + sizeof(IP1394_FRAG_HDR));
-	UInt16			fragmentSize	= len - sizeof(IP1394_FRAG_HDR);
-	
-	UInt8	lf				= htons(fragmentHdr->datagramSize) >> 14;
-	UInt16	datagramSize	= (htons(fragmentHdr->datagramSize) & 0x3FFF) + 1;
-	UInt16	label			= htons(fragmentHdr->dgl);
+	UInt32 tcpHdrLen	= th.th_off << 2;
+	UInt32 hdrLen		= fwHdrLen + ipHdrLen + tcpHdrLen;
 
-	if(datagramSize > FIREWIRE_MTU)
-		return kIOReturnError;
+	if( (tcpHdrLen < sizeof(th)) or (totalLen <= hdrLen) or (mss == 0) )
+		return txIP(m, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, FWTYPE_IP);
 
-	recursiveScopeLock lock(fIPLock);
-	
-	IOReturn result			= kIOReturnSuccess;
-	UInt16	 fragmentOffset = htons(fragmentHdr->fragmentOffset);
+	UInt32 payloadLen	= totalLen - hdrLen;
+	UInt32 segSize		= mss;
 
-	RCB *rcb = getRcb(nodeID, label);
+	IORecursiveLockLock(fIPLock);
 
-	if (rcb == NULL) 
+	// Size the segments for the destination's effective payload, as txUnicastIP computes it
+	ARB *arb = getArbFromFwAddr(fwh->fw_dhost);
+	IOFireWireNub *device = (arb != NULL) ? OSDynamicCast(IOFireWireNub, (IOFireWireNub*)arb->handle.unicast.deviceID) : NULL;
+
+	if( device != NULL )
 	{
-		if (lf == FIRST_FRAGMENT) 
-		{
-			mbuf_t rxMBuf = (mbuf_t)allocateMbuf(datagramSize + sizeof(firewire_header));
+		FWAddress addr;
+		addr.addressHi   = arb->handle.unicast.unicastFifoHi;
+		addr.addressLo   = arb->handle.unicast.unicastFifoLo;
 
-			if (rxMBuf == NULL)
-			{
-				fIPLocalNode->fIPoFWDiagnostics.fNoMbufs++;
-				return kIOReturnError;
-			}
-			
-			if ((rcb = getRCBCommand( nodeID, label, fragmentOffset, datagramSize, rxMBuf )) == NULL) 
-			{
-				fIPLocalNode->fIPoFWDiagnostics.fNoRCBCommands++;
-				cleanRCBCache();
-				fIPLocalNode->freePacket(rxMBuf, 0);
-				return kIOReturnError;
-			}
-		 
-			// Make space for the firewire header to be helpfull in firewire_demux
-			struct firewire_header *fwh = (struct firewire_header *)mbuf_data(rxMBuf);
-			bzero(fwh, sizeof(struct firewire_header));
-			// when indicating to the top layer
-			// JLIU - fragmentHdr already in network order, do not swap fragmentOffset
-			fwh->fw_type  = fragmentHdr->fragmentOffset;
-			rcb->residual = rcb->datagramSize;
+		UInt32 maxPayload = MIN((UInt32)1 << (arb->handle.unicast.maxRec+1), (UInt32)1 << fLcb->ownMaxPayload);
+		maxPayload = MIN((UInt32)1 << device->maxPackLog(true, addr), maxPayload);
 
-			activeRcb->setObject(rcb);
-			fragmentOffset = 0;
-		}
-		else 
-			result = kIOReturnError;
+		if( maxPayload > sizeof(IP1394_UNFRAG_HDR) + ipHdrLen + tcpHdrLen )
+			segSize = MIN(segSize, maxPayload - sizeof(IP1394_UNFRAG_HDR) - ipHdrLen - tcpHdrLen);
 	}
 
-	if( result == kIOReturnSuccess )
+	UInt32	seq		= ntohl(th.th_seq);
+	UInt16	ipID	= ntohs(ip.ip_id);
+	UInt32	segLen	= 0;
+
+	for( UInt32 offset = 0; offset < payloadLen; offset += segLen, ipID++ )
 	{
-		UInt16 amountToCopy = MIN(fragmentSize, rcb->datagramSize - fragmentOffset);
-		
-		if(amountToCopy > rcb->residual)
+		segLen = MIN(segSize, payloadLen - offset);
+
+		mbuf_t seg = allocateMbuf(hdrLen + segLen);
+
+		if( (seg == NULL) or (mbuf_len(seg) < hdrLen) )
 		{
-			fIPLocalNode->fIPoFWDiagnostics.fRxFragmentPktsDropped++;
-			result = kIOReturnError;
+			if( seg != NULL )
+				fIPLocalNode->freePacket(seg);
+			// TCP retransmits the rest
+			fIPLocalNode->fIPoFWDiagnostics.fNoMbufs++;
+			fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+			break;
 		}
-		else
-		{
-			bufferToMbuf(rcb->mBuf, sizeof(struct firewire_header)+fragmentOffset, (vm_address_t*)fragment, amountToCopy);
-			
-			rcb->residual -= MIN(fragmentSize, rcb->residual); 
 
-			if ( rcb->residual == 0 ) 
-			{           
-				// Legitimate etherType ? this prevents corrupted etherType 
-				// being presented to the networking layer
-				if (rcb->etherType == FWTYPE_IP || rcb->etherType == FWTYPE_IPV6) 
-					fIPLocalNode->receivePackets (rcb->mBuf, mbuf_pkthdr_len(rcb->mBuf), false);
-				else
-				{
-					fIPLocalNode->freePacket(rcb->mBuf, 0); 
-					result = kIOReturnError;
-				}
+		copyMbufToMbuf(m, 0, seg, 0, hdrLen);
+		copyMbufToMbuf(m, hdrLen + offset, seg, hdrLen, segLen);
 
-				releaseRCB(rcb, false);
-			}
-		}
+		struct ip		*segIP	= (struct ip *)((UInt8*)mbuf_data(seg) + fwHdrLen);
+		struct tcphdr	*segTH	= (struct tcphdr *)((UInt8*)segIP + ipHdrLen);
+
+		segIP->ip_len	= htons(ipHdrLen + tcpHdrLen + segLen);
+		segIP->ip_id	= htons(ipID);
+		segIP->ip_sum	= 0;
+		segIP->ip_sum	= checksumFold(checksumSum(seg, fwHdrLen, ipHdrLen));
+
+		segTH->th_seq	= htonl(seq + offset);
+		if( offset + segLen < payloadLen )
+			segTH->th_flags &= ~(TH_FIN | TH_PUSH);
+		if( offset != 0 )
+			segTH->th_flags &= ~TH_CWR;
+
+		// Pseudo header is source and destination address, protocol and TCP length
+		UInt32 sum = checksumSum(seg, fwHdrLen + ((UInt8*)&segIP->ip_src - (UInt8*)segIP), 2 * sizeof(struct in_addr));
+		sum += IPPROTO_TCP + tcpHdrLen + segLen;
+		segTH->th_sum	= 0;
+		sum += checksumSum(seg, fwHdrLen + ipHdrLen, tcpHdrLen + segLen);
+		segTH->th_sum	= checksumFold(sum);
+
+		if( fLargeSendTail != NULL )
+			mbuf_setnextpkt(fLargeSendTail, seg);
+		else
+			fLargeSendQueue = seg;
+		fLargeSendTail = seg;
 	}
-	
-	return result;
+
+	fIPLocalNode->fIPoFWDiagnostics.fTxLargeSendPkts++;
+
+	fIPLocalNode->freePacket(m);
+
+	txLargeSendDrain();
+
+	IORecursiveLockUnlock(fIPLock);
+
+	return kIOReturnSuccess;
 }
 
 /*!
-	@function rxAsyncStream
-	@abstract callback for an Asyncstream packet, can be both IP or ARP packet.
-			This procedure receives an indication when an asynchronous stream
-			packet arrives on the default broadcast channel. The packet "should" be GASP,
-			but we perform a few checks to make sure. Once we know these are OK, we check
-			the etherType field in the unfragmented encapsulation header. This is necessary
-			to dispatch the three types of packet that RFC 2734 permits on the default
-			broadcast channel: an IPv4 datagram, and ARP request or response or a multi-
-			channel allocation protocol (MCAP) message. The only remaining check, for each
-			of these three cases, is to make sure that the packet is large enough to hold
-			meaningful data. If so, send the packet to another procedure for further
-			processing.  
-	@param DCLCommandStruct *callProc.
-	@result void.
+	@function txLargeSendDrain
+	@abstract Sends the queued segments of large sends, in order.
+	@result SInt32 - kIOFireWireOutOfTLabels if segments are left on the queue.
 */
-void IOFWIPBusInterface::rxAsyncStream(void	*refCon, const void	*buffer)
+SInt32 IOFWIPBusInterface::txLargeSendDrain()
 {
-	IOFWIPBusInterface			*fwIPPriv = (IOFWIPBusInterface*)refCon;
-	IOFireWireIP				*fwIPObject	= OSDynamicCast(IOFireWireIP, fwIPPriv->fIPLocalNode);
-
-	void			*datagram;
-	UInt16			datagramSize;
-	GASP			*gasp = (GASP*)buffer;
-	LCB 			*lcb = fwIPPriv->fLcb;
-	ISOC_DATA_PKT	*pkt = (ISOC_DATA_PKT*)buffer; 
-	UInt16 			type = 0;
-
-	if(not fwIPPriv->fStarted)
-		return;
+	SInt32 status = kIOReturnSuccess;
 
-	if(pkt->tag != GASP_TAG){
-		// Error, so we touch the error output packets
-		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
-		fwIPObject->fIPoFWDiagnostics.fGaspTagError++;
-		return;
-    }
-	
-	// Minimum size requirement
-	if (gasp->dataLength < sizeof(GASP_HDR) + sizeof(IP1394_UNFRAG_HDR)) {
-		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
-		fwIPObject->fIPoFWDiagnostics.fGaspHeaderError++;
-		return;
-    }
+	recursiveScopeLock lock(fIPLock);
 
-	// Ignore GASP if not specified by RFC 2734
-	if (memcmp(&gasp->gaspHdr.gaspID, &gaspVal, sizeof(GASP_ID)) != 0) {
-		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
-		fwIPObject->fIPoFWDiagnostics.fNonRFC2734Gasp++;
-		return;
-    }
+	while( fLargeSendQueue != NULL )
+	{
+		mbuf_t seg	= fLargeSendQueue;
+		mbuf_t next	= mbuf_nextpkt(seg);
 
-	// Also ignore GASP if not from the local bus
-	if ((htons(gasp->gaspHdr.sourceID) >> 6) != LOCAL_BUS_ID) {
-		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
-		fwIPObject->fIPoFWDiagnostics.fRemoteGaspError++;
-		return;
-    }
-   
-	// Broadcast fragmentation not supported
-	if (gasp->ip1394Hdr.reserved != htons(UNFRAGMENTED)) {
-		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
-		fwIPObject->fIPoFWDiagnostics.fEncapsulationHeaderError++;
-		return;
-    }
-   
-   datagram = (void *) ((UInt64) buffer + sizeof(GASP));
-   datagramSize = gasp->dataLength - (sizeof(GASP_HDR) + sizeof(IP1394_UNFRAG_HDR));
-   type = ntohs(gasp->ip1394Hdr.etherType);
+		mbuf_setnextpkt(seg, NULL);
 
-   //IOLog("   Ether type 0x%04X (data length %d)\n\r",htons(gasp->ip1394Hdr.etherType), datagramSize);
+		status = txUnicastIP(seg, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastSpeed, FWTYPE_IP);
 
-	switch (type) {
-		case FWTYPE_IPV6:
-		case FWTYPE_IP:
-			if (datagramSize >= IPV4_HDR_SIZE && datagramSize <= FIREWIRE_MTU)
-				fwIPPriv->rxIP(datagram, datagramSize, FW_M_BCAST, type);
+		if( status == kIOFireWireOutOfTLabels )
+		{
+			// Still ours, retried once a completion frees a label
+			mbuf_setnextpkt(seg, next);
 			break;
+		}
 
-		case FWTYPE_ARP:
-			if (datagramSize >= sizeof(IP1394_ARP) && datagramSize <= FIREWIRE_MTU)
-				fwIPPriv->rxARP((IP1394_ARP*)datagram, FW_M_BCAST);
-			break;
-			
-		case ETHER_TYPE_MCAP:
-			if (datagramSize >= sizeof(IP1394_MCAP) && datagramSize <= FIREWIRE_MTU)
-				fwIPPriv->rxMCAP(lcb, htons(gasp->gaspHdr.sourceID), 
-									(IP1394_MCAP*)datagram, datagramSize - sizeof(IP1394_MCAP));
-			break;
+		fIPLocalNode->fIPoFWDiagnostics.fTxLargeSendSegments++;
+		fLargeSendQueue = next;
 	}
 
-	fwIPObject->fIPoFWDiagnostics.fRxBcast++;
+	if( fLargeSendQueue == NULL )
+		fLargeSendTail = NULL;
 
-	return;
+	return status;
 }
 
-IOReturn IOFWIPBusInterface::createAsyncStreamRxClient(UInt8 speed, UInt32 channel, MCB *mcb)
+/*!
+	@function isControlFrame
+	@abstract ARP and IPv6 Neighbor Discovery (RFC 3146) keep the link working,
+			  they get the control reserve and are held rather than dropped on a stall.
+			  MCAP is built in txMCAP and never passes through here.
+	@param m - mbuf with the firewire header.
+	@param type - ether type of the frame.
+	@result bool - true for link control frames.
+*/
+bool IOFWIPBusInterface::isControlFrame(mbuf_t m, UInt16 type)
 {
-	IOReturn	status = kIOReturnNoMemory;
+	IP1394_PKT_INFO			info;
+	const IP1394_PKT_INFO	*pi = &fTxInfo;
 
-	if(channel != DEFAULT_BROADCAST_CHANNEL)
-	{
-		IOFWAsyncStreamListener	*newAsyncStreamRxClient = fControl->createAsyncStreamListener( channel, rxAsyncStream, this );
-		if( newAsyncStreamRxClient != NULL) 
-		{
-			newAsyncStreamRxClient->retain();
-			mcb->asyncStreamID = (OSObject*)newAsyncStreamRxClient;
-			status = kIOReturnSuccess;
-		}
-	}
-	else
+	if( type == FWTYPE_ARP )
+		return true;
+
+	if( type != FWTYPE_IPV6 )
+		return false;
+
+	// Only the packet in outputPacket is classified already
+	if( (m == NULL) or (m != fTxInfo.m) )
 	{
-		if(fBroadcastReceiveClient != NULL)
-		{
-			fBroadcastReceiveClient->retain();
-			mcb->asyncStreamID = (OSObject*)fBroadcastReceiveClient;
-			status = kIOReturnSuccess;
-		}
+		classifyPacket(m, type, &info);
+		pi = &info;
 	}
-	
-	return status;
-}
 
+	return (pi->protocol == IPPROTO_ICMPV6) 
+			and (pi->icmp6Type >= ND_ROUTER_SOLICIT) and (pi->icmp6Type <= ND_REDIRECT);
+}
 
 /*!
-	@function rxMCAP
-	@abstract called from rxAsyncstream for processing MCAP advertisement.
-			When an MCAP advertisement is received, parse all of its descriptors 
-			looking for any that match group addreses in our MCAP cache. For those that 
-			match, update  the channel number (it may have changed from the default
-			broadcast channel or since the last advertisement), update the speed 
-			(the MCAP owner may have changed the speed requirements as nodes joined or 
-			left the group) and refresh the expiration timer so that the MCAP 
-			channel is valid for another number of seconds into the future. 
-	@param lcb - the firewire link control block for this interface.
-    @param mcapSourceID - source nodeid which generated the multicast advertisement packet.
-    @param mcap - mulitcast advertisment packet without the GASP header.
-	@param dataSize - size of the packet.
+	@function classifyHeaders
+	@abstract Reads the protocol, and for ICMPv6 the message type, from an IP header.
+			  IPv6 extension headers are not walked, protocol is then the first of them.
+	@param ip - start of the IP header.
+	@param len - bytes available at ip.
+	@param type - ether type of the frame.
+	@param info - filled in, offsets relative to ip.
 	@result void.
 */
-void IOFWIPBusInterface::rxMCAP(LCB *lcb, UInt16 mcapSourceID, IP1394_MCAP *mcap, UInt32 dataSize)
+static void classifyHeaders(const UInt8 *ip, UInt32 len, UInt16 type, IP1394_PKT_INFO *info)
 {
+	bzero(info, sizeof(*info));
+	info->etherType = type;
 
-	MARB						*arb;
-	UInt32						currentChannel;
-	MCAST_DESCR					*groupDescr = mcap->groupDescr;
-	MCB							*mcb,	*priorMcb;
-	IOFWAsyncStreamListener		*asyncStreamRxClient;
-
-	if ((mcap->opcode != MCAP_ADVERTISE) && (mcap->opcode != MCAP_SOLICIT))
-		return;        // Ignore reserved MCAP opcodes
-	  
-	dataSize = MIN(dataSize, htons(mcap->length) - sizeof(IP1394_MCAP));
-   
-	while (dataSize >= sizeof(MCAST_DESCR)) 
+	if( (type == FWTYPE_IP) and (len >= sizeof(struct ip)) and ((ip[0] >> 4) == IPVERSION) )
 	{
-		recursiveScopeLock lock(fIPLock);
-	
-		if (groupDescr->length != sizeof(MCAST_DESCR))
-			fIPLocalNode->fIPoFWDiagnostics.fInCorrectMCAPDesc++;		// Skip over malformed MCAP group address descriptors
-		else if (groupDescr->type != MCAST_TYPE)
-			fIPLocalNode->fIPoFWDiagnostics.fUnknownMCAPDesc++;		// Skip over unrecognized descriptor types
-		else if ((arb = getMulticastArb(groupDescr->groupAddress)) == NULL)
-			fIPLocalNode->fIPoFWDiagnostics.fUnknownGroupAddress++;      // Ignore if not in our multicast cache
-		else if (mcap->opcode == MCAP_SOLICIT) 
-		{
-			mcb = OSDynamicCast(MCB, mcapState->getObject(arb->handle.multicast.channel));
-			if(mcb)
-			{
-				if (mcb->ownerNodeID == lcb->ownNodeID)   // Do we own the channel?
-					txMCAP(mcb, 0);                       // OK, respond to solicitation
-			}
-		} 
-		else if ((groupDescr->channel != DEFAULT_BROADCAST_CHANNEL) && (groupDescr->channel < kMaxChannels)) 
-		{
-			mcb = OSDynamicCast(MCB, mcapState->getObject(groupDescr->channel));
-			if(not mcb)
-				break;
-			
-			if ( (groupDescr->expiration < 60) and (mcb->ownerNodeID == mcapSourceID) ) 
-			{
-					currentChannel = groupDescr->channel;
-					// mcb->ownerNodeID = lcb->ownNodeID;  // Take channel ownership
-					// mcb->nextTransmit = 1;              // Transmit advertisement ASAP
-			} 
-			else if (mcb->ownerNodeID == mcapSourceID) 
-			{
-				mcb->expiration = groupDescr->expiration;
-			}
-			else if ( (mcb->ownerNodeID < mcapSourceID) or (mcb->expiration < 60) ) 
-			{
-				mcb->ownerNodeID = mcapSourceID;
-				mcb->expiration = groupDescr->expiration;
-			}
-			currentChannel = arb->handle.multicast.channel;
+		const struct ip	*ip4	= (const struct ip*)ip;
+		UInt32			hlen	= ip4->ip_hl << 2;
 
-			if (currentChannel != groupDescr->channel) 
-			{
-				priorMcb = OSDynamicCast(MCB, mcapState->getObject(currentChannel));
-				if(not priorMcb)
-					break;
-				
-				if (priorMcb->groupCount == 1) // Are we the last user?
-				{   
-					asyncStreamRxClient = OSDynamicCast(IOFWAsyncStreamListener, mcb->asyncStreamID);
-					if(asyncStreamRxClient != NULL)
-					{
-						fControl->removeAsyncStreamListener( asyncStreamRxClient );
-						asyncStreamRxClient->release();
-					}
+		info->protocol = ip4->ip_p;
 
-					priorMcb->asyncStreamID = NULL;
-					priorMcb->groupCount = 0;
-				} 
-				else if (priorMcb->groupCount > 0)
-					priorMcb->groupCount--;
+		// Only the first fragment carries the transport header
+		if( (hlen >= sizeof(struct ip)) and ((ntohs(ip4->ip_off) & IP_OFFMASK) == 0) )
+			info->transportOffset = hlen;
+	}
+	else if( (type == FWTYPE_IPV6) and (len >= sizeof(struct ip6_hdr)) and ((ip[0] >> 4) == (IPV6_VERSION >> 4)) )
+	{
+		const struct ip6_hdr *ip6 = (const struct ip6_hdr*)ip;
 
-				if (mcb->asyncStreamID == NULL) 
-				{
-					if(createAsyncStreamRxClient(groupDescr->speed, groupDescr->channel, mcb) != kIOReturnSuccess)
-						break;
-				}
-				
-				arb->handle.multicast.channel = groupDescr->channel;
-				mcb->groupCount++;
-			}
-		}
-		dataSize -= MIN(groupDescr->length, dataSize);
-		groupDescr = (MCAST_DESCR*)((UInt64)groupDescr + groupDescr->length);
+		info->protocol			= ip6->ip6_nxt;
+		info->transportOffset	= sizeof(struct ip6_hdr);
+
+		if( (info->protocol == IPPROTO_ICMPV6) and (len > sizeof(struct ip6_hdr)) )
+			info->icmp6Type = ip[sizeof(struct ip6_hdr)];
 	}
 }
 
+void IOFWIPBusInterface::classifyPacket(mbuf_t m, UInt16 type, IP1394_PKT_INFO *info)
+{
+	UInt8	hdr[sizeof(struct ip6_hdr) + 1];	// IPv6 header and ICMPv6 type, covers IPv4 without options
+	UInt32	offset	= sizeof(struct firewire_header);
+	UInt32	len		= 0;
+
+	if( m != NULL )
+	{
+		len = MIN(sizeof(hdr), mbuf_pkthdr_len(m) > offset ? mbuf_pkthdr_len(m) - offset : 0);
+
+		if( mbuf_copydata(m, offset, len, hdr) != 0 )
+			len = 0;
+	}
+
+	classifyHeaders(hdr, len, type, info);
+
+	info->m			= m;
+	info->ipOffset	= offset;
+	if( info->transportOffset != 0 )
+		info->transportOffset += offset;
+}
 
 /*!
-	@function rxIP
-	@abstract Receive IP packet.
-	@param pkt - points to the IP packet without the header.
-	@param len - length of the packet.
-	@params flags - indicates broadcast or unicast	
-	@params type - indicates type of the packet IPv4 or IPv6	
-	@result IOReturn.
+	@function txControlDrain
+	@abstract Sends the control frames outputPacket held back over a stall, in order.
+			  The head is unlinked before each send, so a completion that drains
+			  from inside the send can't see it twice.
+	@result SInt32 - kIOFireWireOutOfTLabels if frames are still held.
 */
-IOReturn IOFWIPBusInterface::rxIP(void *pkt, UInt32 len, UInt32 flags, UInt16 type)
+SInt32 IOFWIPBusInterface::txControlDrain()
 {
-	mbuf_t	rxMBuf = NULL;
-	struct	firewire_header *fwh = NULL;
-	bool	queuePkt = false; 
-	IOReturn ret = kIOReturnSuccess;
+	SInt32 status = kIOReturnSuccess;
 
-    IORecursiveLockLock(fIPLock);
-    
-	if ((rxMBuf = (mbuf_t)allocateMbuf(len  + sizeof(firewire_header))) != NULL) 
+	recursiveScopeLock lock(fIPLock);
+
+	while( fControlQueue != NULL )
 	{
-        bufferToMbuf(rxMBuf, sizeof(struct firewire_header), (vm_address_t*)pkt, len); 			
+		mbuf_t pkt = fControlQueue;
 
-        if (rxMBuf != NULL)
-        {
-			fwh = (struct firewire_header *)mbuf_data(rxMBuf);
-            bzero(fwh, sizeof(struct firewire_header));
-            fwh->fw_type = htons(type);
-			
-			queuePkt = (flags == FW_M_UCAST);
-			
-            if(queuePkt)
-				bcopy(fIPLocalNode->macAddr, fwh->fw_dhost, kIOFWAddressSize);
-			else
-				bcopy(fwbroadcastaddr, fwh->fw_dhost, kIOFWAddressSize);
+		fControlQueue = mbuf_nextpkt(pkt);
+		if( fControlQueue == NULL )
+			fControlTail = NULL;
+		fControlQueueLength--;
+		mbuf_setnextpkt(pkt, NULL);
 
-			if(FWTYPE_IPV6 == type)
-			{
-				if( updateNDPCache(rxMBuf) == true ) 
-				{
-					mbuf_prepend(&rxMBuf, sizeof(struct firewire_header), MBUF_DONTWAIT);
-				}
-			}
-        }
-        else
+		struct firewire_header *fwh = (struct firewire_header*)mbuf_data(pkt);
+
+		if( htons(fwh->fw_type) == FWTYPE_ARP )
+			status = txARP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->maxBroadcastSpeed);
+		else
+			status = txIP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, FWTYPE_IPV6);
+
+		if( status == kIOFireWireOutOfTLabels )
 		{
-			fIPLocalNode->fIPoFWDiagnostics.fNoMbufs++;
-            ret = kIOReturnNoMemory;
+			// Still ours, back at the head
+			mbuf_setnextpkt(pkt, fControlQueue);
+			fControlQueue = pkt;
+			if( fControlTail == NULL )
+				fControlTail = pkt;
+			fControlQueueLength++;
+			break;
 		}
-		
-        if(ret == kIOReturnSuccess)
-        {
-            fIPLocalNode->receivePackets(rxMBuf, mbuf_pkthdr_len(rxMBuf), queuePkt);
-        }
-        else
-        {
-            if(rxMBuf != NULL)
-                fIPLocalNode->freePacket(rxMBuf, 0);
-
-            fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->inputErrors);
-        }
 	}
 
-    IORecursiveLockUnlock(fIPLock);
-
-	return ret;
+	return status;
 }
 
 /*!
-	@function rxARP
-	@abstract ARP processing routine called from both Asynstream path and Async path.
-	@param fwIPObj - IOFireWireIP object.
-	@param arp - 1394 arp packet without the GASP or Async header.
-	@params flags - indicates broadcast or unicast	
-	@result IOReturn.
+	@function txHoldPacket
+	@abstract Parks a unicast packet that failed against the old bus generation,
+			  either unresolved in txUnicastIP or failed by the reset in a block
+			  write. Only packets caught inside the hold window opened on suspend
+			  are kept, everything else is an output error as before.
+	@param m - mbuf with the firewire header, always consumed.
+	@result void.
 */
-IOReturn IOFWIPBusInterface::rxARP(IP1394_ARP *arp, UInt32 flags){
+void IOFWIPBusInterface::txHoldPacket(mbuf_t m)
+{
+	recursiveScopeLock lock(fIPLock);
 
-	mbuf_t rxMBuf;
-	struct firewire_header *fwh = NULL;
-	void	*datagram = NULL;
-	
-	if (arp->hardwareType != htons(ARP_HDW_TYPE)
-		|| arp->protocolType != htons(FWTYPE_IP)
-		|| arp->hwAddrLen != sizeof(IP1394_HDW_ADDR)
-		|| arp->ipAddrLen != IPV4_ADDR_SIZE)
-	{
-		IOLog("IOFireWireIP: rxARP ERROR in packet header\n");
-		return kIOReturnError;
-	}
+	UInt64 now = 0;
 
-    IORecursiveLockLock(fIPLock);
+	if( fTxHoldDeadline != 0 )
+		clock_get_uptime(&now);
 
-	if ((rxMBuf = (mbuf_t)allocateMbuf(sizeof(*arp) + sizeof(struct firewire_header))) != NULL) 
+	if( (fTxHoldDeadline == 0) or (now >= fTxHoldDeadline) or (fTxHoldQueueLength >= kMaxTxHoldQueue) )
 	{
-		fwh = (struct firewire_header *)mbuf_data(rxMBuf);
-		datagram = ((UInt8*)mbuf_data(rxMBuf)) + sizeof(struct firewire_header);
-		bzero(fwh, sizeof(struct firewire_header));
-		fwh->fw_type = htons(FWTYPE_ARP);
-		// Copy the data
-		memcpy(datagram, arp, sizeof(*arp));
-		
-        fIPLocalNode->receivePackets(rxMBuf, mbuf_pkthdr_len(rxMBuf), 0);
+		fIPLocalNode->freePacket(m);
+		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+		return;
 	}
+
+	mbuf_setnextpkt(m, NULL);
+
+	if( fTxHoldTail != NULL )
+		mbuf_setnextpkt(fTxHoldTail, m);
 	else
-		fIPLocalNode->fIPoFWDiagnostics.fNoMbufs++;
-	
-    IORecursiveLockUnlock(fIPLock);
-   
- 	return kIOReturnSuccess;
+		fTxHoldQueue = m;
+	fTxHoldTail = m;
+	fTxHoldQueueLength++;
+	fIPLocalNode->fIPoFWDiagnostics.fTxHeldPkts++;
 }
 
 /*!
-	@function watchdog
-	@abstract cleans the Link control block's stale drb's and rcb's.
-			The cleanCache's job is to age (and eventually discard) device objects 
-			for FireWireIP devices that have come unplugged. If they do reappear after  
-			they have been discarded from the caches, all that is required is a new ARP. 
-			The IP network stack handles that automatically
-	@param lcb - the firewire link control block for this interface.
+	@function txHoldDrain
+	@abstract Resubmits the packets held across a bus reset through txIP, so
+			  they resolve against the new generation. The queue is detached
+			  first, packets whose node isn't back yet are held again behind it
+			  and retried by the watchdog. Once the window closes, what is left
+			  is dropped, so no packet is held longer than kTxHoldMS.
 	@result void.
 */
-void watchdog(OSObject *obj, IOTimerEventSource *src)
-{	
-	IOFWIPBusInterface *FWIPPriv = (IOFWIPBusInterface*)obj;
-
-	FWIPPriv->processWatchDogTimeout();
-}
-
-void IOFWIPBusInterface::processWatchDogTimeout()
+void IOFWIPBusInterface::txHoldDrain()
 {
 	recursiveScopeLock lock(fIPLock);
 
-	updateMcapState();
-	
-	cleanRCBCache();
-	
-	fIPLocalNode->fIPoFWDiagnostics.fMaxQueueSize = max(fIPLocalNode->fIPoFWDiagnostics.fTxUni - fPrevTransmitCount, TRANSMIT_QUEUE_SIZE);
-	
-	fPrevTransmitCount = fIPLocalNode->fIPoFWDiagnostics.fTxUni;
+	if( fTxHoldDeadline == 0 )
+		return;
 
-	fIPLocalNode->fIPoFWDiagnostics.fLastStarted++;
+	UInt64 now;
+	clock_get_uptime(&now);
 
-	// Tuning segment for optimum performance, if too many Busy Acks
-	if( not fIPLocalNode->fIPoFWDiagnostics.fDoFastRetry )
-	{
-		fIPLocalNode->fIPoFWDiagnostics.fDoFastRetry	= ((fIPLocalNode->fIPoFWDiagnostics.fBusyAcks - fPrevBusyAcks) > kMaxBusyXAcksPerSecond);
-		fPrevBusyAcks				= fIPLocalNode->fIPoFWDiagnostics.fBusyAcks;
-		fFastRetryUnsetTimer		= fPrevFastRetryBusyAcks = fIPLocalNode->fIPoFWDiagnostics.fFastRetryBusyAcks = 0;
-	}
-	else
-	{
-		fFastRetryUnsetTimer = (fIPLocalNode->fIPoFWDiagnostics.fFastRetryBusyAcks - fPrevFastRetryBusyAcks) ? 0 : fFastRetryUnsetTimer + 1;
-		
-		// Fast retry BusyX acks absent for last 60 seconds, so turn it off
-		fIPLocalNode->fIPoFWDiagnostics.fDoFastRetry	= not (fFastRetryUnsetTimer > kMaxSecondsToTurnOffFastRetry);
-		fPrevBusyAcks				= fIPLocalNode->fIPoFWDiagnostics.fBusyAcks;
-		fPrevFastRetryBusyAcks		= fIPLocalNode->fIPoFWDiagnostics.fFastRetryBusyAcks;
-	}
-	
-	// Restart the watchdog timer
-	timerSource->setTimeoutMS(kWatchDogTimerMS);
-}
+	bool expired = (now >= fTxHoldDeadline);
 
-#pragma mark -
-#pragma mark  IPv6 NDP routines  
+	// Nothing to resolve against until the reset settles
+	if( fBusSuspended and (not expired) )
+		return;
 
-const int ipv6fwoffset = 8;
+	if( expired )
+		fTxHoldDeadline = 0;
 
-bool IOFWIPBusInterface::addNDPOptions(mbuf_t m)
-{
-	bool ret = false;
+	mbuf_t pkt = fTxHoldQueue;
 
-	if(not (mbuf_flags(m) & MBUF_PKTHDR))
-		return ret;
+	fTxHoldQueue		= NULL;
+	fTxHoldTail			= NULL;
+	fTxHoldQueueLength	= 0;
 
-	vm_address_t src = (vm_offset_t)mbuf_data(m);
-	if(src == 0)
-		return ret;
+	while( pkt != NULL )
+	{
+		mbuf_t next = mbuf_nextpkt(pkt);
+		mbuf_setnextpkt(pkt, NULL);
 
-	UInt32	fwhdrlen	= sizeof(firewire_header);
-	mbuf_t	ipv6Mbuf	= m;
-	int		pkthdrlen	= 0;
+		if( expired )
+		{
+			fIPLocalNode->freePacket(pkt);
+			fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+			fIPLocalNode->fIPoFWDiagnostics.fTxHeldExpired++;
+			pkt = next;
+			continue;
+		}
 
-	// check whether len equals ether header
-	if(mbuf_len(m) == sizeof(firewire_header))
-	{
-		ipv6Mbuf = mbuf_next(m);
-		if(ipv6Mbuf == NULL)
-			return ret;
+		// Block writes leave fw_dhost and fw_type as they were, the encapsulation header only covers fw_shost's tail
+		struct firewire_header *fwh = (struct firewire_header*)mbuf_data(pkt);
 
-		src = (vm_offset_t)mbuf_data(ipv6Mbuf);
-		
-		fwhdrlen	= 0;
-        pkthdrlen	= mbuf_pkthdr_len(ipv6Mbuf);
+		if( txIP(pkt, fLcb->ownNodeID, fLcb->busGeneration, fLcb->ownMaxPayload, fLcb->maxBroadcastPayload, fLcb->maxBroadcastSpeed, htons(fwh->fw_type)) == kIOFireWireOutOfTLabels )
+		{
+			// Still ours, back at the head with the rest, ahead of those held again
+			mbuf_setnextpkt(pkt, next);
+
+			mbuf_t tail = pkt;
+			fTxHoldQueueLength++;
+			while( mbuf_nextpkt(tail) != NULL )
+			{
+				tail = mbuf_nextpkt(tail);
+				fTxHoldQueueLength++;
+			}
+
+			mbuf_setnextpkt(tail, fTxHoldQueue);
+			if( fTxHoldQueue == NULL )
+				fTxHoldTail = tail;
+			fTxHoldQueue = pkt;
+			break;
+		}
+
+		fIPLocalNode->fIPoFWDiagnostics.fTxHeldReplayed++;
+		pkt = next;
 	}
+}
 
-	if(mbuf_len(ipv6Mbuf) < (fwhdrlen + sizeof(struct ip6_hdr)))
-		return ret; 
+void IOFWIPBusInterface::initAQM()
+{
+	UInt32 targetUS		= kAQMTargetUS;
+	UInt32 intervalUS	= kAQMIntervalUS;
 
-	// no space in mbuf
-	if(mbuf_trailingspace(ipv6Mbuf) < (int)sizeof(IP1394_NDP))
-		return ret;
+	OSNumber *number = OSDynamicCast(OSNumber, fIPLocalNode->getProperty("AQMTargetUS"));
+	if( number != NULL )
+		targetUS = number->unsigned32BitValue();
 
-	UInt8	*bufPtr = (UInt8*)(src + fwhdrlen);
+	number = OSDynamicCast(OSNumber, fIPLocalNode->getProperty("AQMIntervalUS"));
+	if( (number != NULL) and (number->unsigned32BitValue() != 0) )
+		intervalUS = number->unsigned32BitValue();
 
-	// show type of ICMPV6 packets being sent
-	struct ip6_hdr				*ip6	= (struct ip6_hdr*)bufPtr;
-	struct icmp6_hdr			*icp	= (struct icmp6_hdr*)(ip6 + 1);
-	struct nd_neighbor_advert	*nd_na	= (struct nd_neighbor_advert*)icp;
-	struct nd_neighbor_solicit	*nd_ns	= (struct nd_neighbor_solicit*)icp;
+	nanoseconds_to_absolutetime((UInt64)targetUS * 1000, &fAQMTarget);
+	nanoseconds_to_absolutetime((UInt64)intervalUS * 1000, &fAQMInterval);
 
-    int	offset	= sizeof(*ip6) + fwhdrlen;
+	fAQMFirstAbove	= 0;
+	fAQMDropNext	= 0;
+	fAQMCount		= 0;
+	fAQMLastCount	= 0;
+	fAQMDropping	= false;
+}
 
-	bool		modify		 = false;
-	IP1394_NDP	*fwndp		 = NULL;
-	u_int16_t	*icmp6_cksum = NULL;
+UInt64 IOFWIPBusInterface::aqmControlLaw(UInt64 t)
+{
+	UInt32 root = 1;
 
-	if(nd_ns->nd_ns_type == ND_NEIGHBOR_SOLICIT)
-	{		
-		// neighbor solicitation
-		fwndp = (IP1394_NDP*)((UInt8*)nd_ns + sizeof(struct nd_neighbor_solicit));
-		if(fwndp->type == 1)
-		{
-			modify = true;
-            icmp6_cksum = &nd_ns->nd_ns_cksum;
-		}
-	}
-	
-	if(nd_na->nd_na_type == ND_NEIGHBOR_ADVERT)
+	// Integer square root of the signal count, it stays small
+	while( (root + 1) * (root + 1) <= fAQMCount )
+		root++;
+
+	return t + fAQMInterval / root;
+}
+
+#if VERSION_MAJOR >= 16
+/*!
+	@function aqmMarkECN
+	@abstract Sets Congestion Experienced on an ECN capable IPv4 or IPv6 packet,
+			  patching the IPv4 header checksum as in RFC 1624.
+	@param m - mbuf with the firewire header.
+	@result bool - false if the packet isn't ECN capable and has to be dropped.
+*/
+static bool aqmMarkECN(mbuf_t m)
+{
+	struct firewire_header	*fwh	= (struct firewire_header*)mbuf_data(m);
+	UInt32					offset	= sizeof(struct firewire_header);
+
+	if( htons(fwh->fw_type) == FWTYPE_IP )
 	{
-		// neighbor advertisment
-		fwndp =  (IP1394_NDP*)((UInt8*)nd_na + sizeof(struct nd_neighbor_advert));
-		
-		if(fwndp->type == 2)
-		{
-			modify = true;
-            icmp6_cksum = &nd_na->nd_na_cksum;
-		}
+		UInt8	word[2];		// version and header length, type of service
+		UInt16	sum;
+
+		if( (mbuf_copydata(m, offset, sizeof(word), word) != 0)
+			or (mbuf_copydata(m, offset + offsetof(struct ip, ip_sum), sizeof(sum), &sum) != 0) )
+			return false;
+
+		if( (word[1] & IPTOS_ECN_MASK) == IPTOS_ECN_NOTECT )
+			return false;
+
+		UInt16 oldWord = (word[0] << 8) | word[1];
+		word[1] |= IPTOS_ECN_CE;
+		UInt16 newWord = (word[0] << 8) | word[1];
+
+		sum = checksumFold((UInt16)~ntohs(sum) + (UInt16)~oldWord + newWord);
+
+		mbuf_copyback(m, offset, sizeof(word), word, MBUF_DONTWAIT);
+		mbuf_copyback(m, offset + offsetof(struct ip, ip_sum), sizeof(sum), &sum, MBUF_DONTWAIT);
+
+		return true;
 	}
-	
-	if(modify)
+
+	if( htons(fwh->fw_type) == FWTYPE_IPV6 )
 	{
-		fwndp->len = 3;       									// len in units of 8 octets
-		bzero(fwndp->reserved, 6);								// reserved by the RFC 3146
-		fwndp->senderMaxRec = fLcb->ownHardwareAddress.maxRec;	// Maximum payload (2 ** senderMaxRec)
-		fwndp->sspd = fLcb->ownHardwareAddress.spd;				// Maximum speed
-		fwndp->senderUnicastFifoHi = htons(fLcb->ownHardwareAddress.unicastFifoHi);	// Most significant 16 bits of FIFO address
-		fwndp->senderUnicastFifoLo = htonl(fLcb->ownHardwareAddress.unicastFifoLo);	// Least significant 32 bits of FIFO address
-		
-        // current mbuf length IPv6+ICMP6
-		mbuf_setlen(ipv6Mbuf, mbuf_len(ipv6Mbuf)+ipv6fwoffset);
-		
-        // main mbuf header length of FW+IPv6+ICMP6
-		mbuf_pkthdr_setlen(m, mbuf_pkthdr_len(m)+ipv6fwoffset);
-        
-        // fix for <rdar://problem/3483512>: Developer: FireWire IPv6 header payload legnth value 0x28 may be incorrect
-        // mbuf header length of IPv6+ICMP6
-        if(pkthdrlen != 0)
-            mbuf_pkthdr_setlen(ipv6Mbuf, pkthdrlen+ipv6fwoffset);
+		UInt32 flow;
 
-        int	icmp6len = ntohs(ip6->ip6_plen) + ipv6fwoffset;
+		if( mbuf_copydata(m, offset, sizeof(flow), &flow) != 0 )
+			return false;
 
-        ip6->ip6_plen = htons(icmp6len);
-        
-        mbuf_inet6_cksum(ipv6Mbuf, IPPROTO_ICMPV6, offset, icmp6len, icmp6_cksum);
+		// ECN is the low two bits of the traffic class
+		if( (ntohl(flow) & (IPTOS_ECN_MASK << 20)) == 0 )
+			return false;
+
+		flow = htonl(ntohl(flow) | (IPTOS_ECN_CE << 20));
+
+		mbuf_copyback(m, offset, sizeof(flow), &flow, MBUF_DONTWAIT);
+
+		return true;
 	}
-	
-	return ret;
+
+	return false;
 }
+#endif
 
-bool IOFWIPBusInterface::updateNDPCache(mbuf_t m)
+/*!
+	@function aqmShouldDrop
+	@abstract CoDel (RFC 8289) run as packets leave transmitQueue. Once the sojourn time
+			  has stayed above fAQMTarget for fAQMInterval, packets are signalled at a rate
+			  that grows with the square root of the signal count, until the delay drops
+			  back under target. ECN capable packets are marked rather than dropped.
+			  Packets without an enqueue time, and an AQMTargetUS of 0, turn it off.
+	@param pkt - mbuf leaving the output queue.
+	@result bool - true if the packet should be dropped.
+*/
+bool IOFWIPBusInterface::aqmShouldDrop(mbuf_t pkt)
 {
-	bool result = false;
+#if VERSION_MAJOR >= 16
+	u_int64_t	enqueued	= 0;
+	boolean_t	valid		= FALSE;
+	UInt64		now;
 
-	if(not (mbuf_flags(m) & MBUF_PKTHDR))
-	{
-		return result;
-	}
-	
-	mbuf_t ipv6Mbuf = m;
-	int fwhdrlen	= sizeof(firewire_header);
-    int pkthdrlen	= 0;
-	
-	// check whether len equals ether header
-	if(mbuf_len(m) == sizeof(firewire_header))
+	if( (fAQMTarget == 0) or (mbuf_get_timestamp(pkt, &enqueued, &valid) != 0) or (not valid) )
+		return false;
+
+	clock_get_uptime(&now);
+
+	bool okToSignal = false;
+
+	if( (now - enqueued < fAQMTarget) or (fIPLocalNode->transmitQueue->getSize() == 0) )
+		fAQMFirstAbove = 0;
+	else if( fAQMFirstAbove == 0 )
+		fAQMFirstAbove = now + fAQMInterval;
+	else if( now >= fAQMFirstAbove )
+		okToSignal = true;
+
+	bool signal = false;
+
+	if( fAQMDropping )
 	{
-		ipv6Mbuf = mbuf_next(m);
-		if(ipv6Mbuf == NULL)
+		if( not okToSignal )
+			fAQMDropping = false;
+		else if( now >= fAQMDropNext )
 		{
-			return result ;
+			signal = true;
+			fAQMCount++;
+			fAQMDropNext = aqmControlLaw(fAQMDropNext);
 		}
-
-		fwhdrlen = 0;
-        pkthdrlen	= mbuf_pkthdr_len(ipv6Mbuf);
 	}
-
-	vm_address_t src = (vm_offset_t)mbuf_data(ipv6Mbuf);
-	if(src == 0)
+	else if( okToSignal )
 	{
-		return result;
+		signal			= true;
+		fAQMDropping	= true;
+
+		// Pick up near the last rate if the previous episode ended recently
+		UInt32 delta = fAQMCount - fAQMLastCount;
+		fAQMCount		= ((delta > 1) and (now - fAQMDropNext < 16 * fAQMInterval)) ? delta : 1;
+		fAQMLastCount	= fAQMCount;
+		fAQMDropNext	= aqmControlLaw(now);
 	}
 
-	if(mbuf_len(ipv6Mbuf) < (sizeof(struct ip6_hdr) + fwhdrlen))
+	if( not signal )
+		return false;
+
+	if( aqmMarkECN(pkt) )
 	{
-		return result;
+		fIPLocalNode->fIPoFWDiagnostics.fAQMMarks++;
+		return false;
 	}
 
-	// no space in mbuf
-	if(mbuf_trailingspace(ipv6Mbuf) < (int)sizeof(IP1394_NDP))
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*!
+	@function txMCAP
+	@abstract This procedure transmits either an MCAP solicitation or advertisement on the
+			  default broadcast channel, dependent upon whether or not an MCB is supplied.
+			  If more than one multicast address group is associated with a particular channel 
+			  that many multiple MCAP group descriptors are created.
+	@param mcb			- multicast control block.
+	@param groupAddress	- group address.
+	@result void.
+*/
+void IOFWIPBusInterface::txMCAP(MCB *mcb, MARB *arb)
+{
+	if (mcb != NULL) 
 	{
-		return result;
+		txMCAPAdvertise(1ULL << mcb->channel);
+		return;
 	}
 
-	// show type of ICMPV6 packets being sent
-	struct ip6_hdr		*ip6		= (struct ip6_hdr*)((UInt8*)src + fwhdrlen);
-	struct icmp6_hdr	*icp		= (struct icmp6_hdr*)(ip6 + 1);
-	struct nd_neighbor_advert	*nd_na	= (struct nd_neighbor_advert*)icp;
-	struct nd_neighbor_solicit	*nd_ns	= (struct nd_neighbor_solicit*)icp;
+	// Nothing to describe an IPv6 group with until its whole address is known
+	if( (arb->groupType == MCAST_TYPE_IPV6) and (not arb->group6Known) )
+		return;
 
-	int		offset	= sizeof(*ip6);
+	struct mcap_packet			*packet			= NULL;
+	IOFWIPAsyncStreamTxCommand	*asyncStreamCmd = txMCAPCommand(MCAP_SOLICIT, &packet);
 
-	IP1394_NDP	*fwndp	= NULL;
-	bool		modify  = false;
+	if(asyncStreamCmd == NULL)
+		return;
 
-    u_int16_t	*icmp6_cksum = NULL;
+	packet->mcap.length	+= mcapDescriptor(arb, packet->mcap.groupDescr);
 
-	if(nd_ns->nd_ns_type == ND_NEIGHBOR_SOLICIT)
-	{		
-		// neighbor solicitation
-		fwndp = (IP1394_NDP*)((UInt8*)nd_ns + sizeof(struct nd_neighbor_solicit));
-		if(fwndp->type == 1)
+	txMCAPSubmit(asyncStreamCmd, packet);
+}
+
+/*!
+	@function txMCAPAdvertise
+	@abstract Advertises the groups of the given owned channels, packing the 
+			  cached descriptors of several channels into each GASP packet up
+			  to the broadcast payload. A packet that fills up is sent and the
+			  rest follow in another.
+	@param channels	- owned channels to advertise, one bit per channel.
+	@result void.
+*/
+void IOFWIPBusInterface::txMCAPAdvertise(UInt64 channels)
+{
+	recursiveScopeLock lock(fIPLock);
+
+	struct mcap_packet			*packet			= NULL;
+	IOFWIPAsyncStreamTxCommand	*asyncStreamCmd = NULL;
+	UInt32						maxPayload		= MIN((UInt32)1 << fLcb->maxBroadcastPayload, fMaxTxAsyncDoubleBuffer);
+
+	if( maxPayload < sizeof(struct mcap_packet) + sizeof(MCAST_DESCR_IPV6) )
+		return;
+
+	while( channels != 0 )
+	{
+		UInt32 channel = __builtin_ctzll(channels);
+		channels &= channels - 1;
+
+		MCB *mcb = OSDynamicCast(MCB, mcapState->getObject(channel));
+		if( (mcb == NULL) or (not mcb->owned) )
+			continue;
+
+		OSData *advert = mcapAdvertisement(mcb);
+		if( advert == NULL )
+			continue;
+
+		// IPv4 and IPv6 descriptors differ in length, each carries its own
+		const UInt8	*descr		= (const UInt8*)advert->getBytesNoCopy();
+		UInt32		remaining	= advert->getLength();
+
+		while( remaining >= sizeof(MCAST_DESCR) )
 		{
-			modify = true;
-            icmp6_cksum = &nd_ns->nd_ns_cksum;
+			UInt32 descrLength = ((const MCAST_DESCR*)descr)->length;
+
+			if( (asyncStreamCmd != NULL) and (packet->mcap.length + descrLength > maxPayload) )
+			{
+				txMCAPSubmit(asyncStreamCmd, packet);
+				asyncStreamCmd = NULL;
+			}
+
+			if( asyncStreamCmd == NULL )
+			{
+				asyncStreamCmd = txMCAPCommand(MCAP_ADVERTISE, &packet);
+				if( asyncStreamCmd == NULL )
+					return;
+			}
+
+			// Only the lifespan changes between advertisements
+			MCAST_DESCR *groupDescriptor = (MCAST_DESCR*)((UInt8*)packet + packet->mcap.length);
+
+			memcpy(groupDescriptor, descr, descrLength);
+			groupDescriptor->expiration	= mcb->expiration;
+			packet->mcap.length			+= descrLength;
+
+			descr		+= descrLength;
+			remaining	-= descrLength;
 		}
 	}
-	
-	if(nd_na->nd_na_type == ND_NEIGHBOR_ADVERT)
+
+	if( asyncStreamCmd != NULL )
+		txMCAPSubmit(asyncStreamCmd, packet);
+}
+
+/*!
+	@function mcapAdvertisement
+	@abstract Returns the group descriptors of an owned channel. They are
+			  built from multicastArb only when the groups changed since the
+			  last advertisement, the expiration is filled in when sending.
+	@param mcb	- owned channel.
+	@result OSData with the channel's MCAST_DESCRs, NULL when out of memory.
+*/
+OSData *IOFWIPBusInterface::mcapAdvertisement(MCB *mcb)
+{
+	recursiveScopeLock lock(fIPLock);
+
+	if( (mcb->advert != NULL) and (mcb->advertGen == fMCAPGroupGen) )
+		return mcb->advert;
+
+	if( mcb->advert != NULL )
+		mcb->advert->release();
+
+	mcb->advert = OSData::withCapacity( MAX(mcb->groupCount, 1) * sizeof(MCAST_DESCR) );
+	if( mcb->advert == NULL )
+		return NULL;
+
+	MARB *arb = NULL;
+	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( multicastArb );
+	if( iterator )
 	{
-		// neighbor advertisment
-		fwndp =  (IP1394_NDP*)((UInt8*)nd_na + sizeof(struct nd_neighbor_advert));
-		
-		if(fwndp->type == 2)
+		while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
 		{
-			modify = true;
-            icmp6_cksum = &nd_na->nd_na_cksum;
+			if (arb->handle.multicast.channel == mcb->channel) 
+			{
+				MCAST_DESCR_IPV6	groupDescriptor;
+				UInt32				length = mcapDescriptor(arb, (MCAST_DESCR*)&groupDescriptor);
+
+				if( length == 0 )
+					continue;
+
+				groupDescriptor.channel			= mcb->channel;
+				groupDescriptor.speed			= arb->handle.multicast.spd;
+
+				mcb->advert->appendBytes(&groupDescriptor, length);
+			}
 		}
+		iterator->release();
 	}
-    
-	ARB			*arb	= NULL;
-	
-	if(modify && fwndp != NULL && fwndp->len > 2)
-	{
-		arb = getArbFromFwAddr(fwndp->lladdr);
-		
-		if(arb != NULL)
-		{
-			bcopy(fwndp->lladdr, &arb->eui64, kIOFWAddressSize);
-			arb->eui64.hi = OSSwapHostToBigInt32(arb->eui64.hi);
-			arb->eui64.lo = OSSwapHostToBigInt32(arb->eui64.lo);            
-			bcopy(fwndp->lladdr, arb->fwaddr, kIOFWAddressSize);
-			arb->handle.unicast.maxRec = fwndp->senderMaxRec;
-			arb->handle.unicast.spd = fwndp->sspd;
-			arb->handle.unicast.unicastFifoHi = htons(fwndp->senderUnicastFifoHi);
-			arb->handle.unicast.unicastFifoLo = htonl(fwndp->senderUnicastFifoLo); 
-			arb->handle.unicast.deviceID = getDeviceID(arb->eui64, &arb->itsMac);
 
-			// Reset the packet
-			fwndp->len = 2;       	// len in units of 8 octets
-			fwndp->senderMaxRec = 0;
-			fwndp->sspd = 0;
-			fwndp->senderUnicastFifoHi = 0;
-			fwndp->senderUnicastFifoLo = 0;
-            			
-			// Adjust header, so the checksum becomes right.
-			mbuf_adj(ipv6Mbuf, fwhdrlen);
-			
-            // current mbuf length IPv6+ICMP6
-			mbuf_setlen(ipv6Mbuf, mbuf_len(ipv6Mbuf)-8);
-			
-            // main mbuf header length of FW+IPv6+ICMP6
-            mbuf_pkthdr_setlen(m, mbuf_pkthdr_len(m)-8);
-            
-            // fix for <rdar://problem/3483512>: Developer: FireWire IPv6 header payload legnth value 0x28 may be incorrect
-            // mbuf header length of IPv6+ICMP6
-            if(pkthdrlen != 0)
-				mbuf_pkthdr_setlen(ipv6Mbuf, mbuf_pkthdr_len(ipv6Mbuf)-8);
-    
-			int	icmp6len = ntohs(ip6->ip6_plen) - 8;
-    
-            ip6->ip6_plen = htons(icmp6len);
-            
-            *icmp6_cksum = 0xFFFF;
-            mbuf_inet6_cksum(ipv6Mbuf, IPPROTO_ICMPV6, offset, icmp6len, icmp6_cksum);
-			result = true;							
-		}
+	mcb->advertGen = fMCAPGroupGen;
+	fIPLocalNode->fIPoFWDiagnostics.fMCAPAdvertBuilds++;
+
+	return mcb->advert;
+}
+
+UInt32 IOFWIPBusInterface::mcapDescriptor(MARB *arb, MCAST_DESCR *descr)
+{
+	if( arb->groupType == MCAST_TYPE_IPV6 )
+	{
+		MCAST_DESCR_IPV6 *descr6 = (MCAST_DESCR_IPV6*)descr;
+
+		if( not arb->group6Known )
+			return 0;
+
+		memset(descr6, 0, sizeof(MCAST_DESCR_IPV6));
+		descr6->length	= sizeof(MCAST_DESCR_IPV6);
+		descr6->type	= MCAST_TYPE_IPV6;
+		memcpy(descr6->groupAddress, arb->group6, sizeof(descr6->groupAddress));
+
+		return sizeof(MCAST_DESCR_IPV6);
 	}
-	
-	return result;
+
+	memset(descr, 0, sizeof(MCAST_DESCR));
+	descr->length		= sizeof(MCAST_DESCR);
+	descr->type			= MCAST_TYPE;
+	descr->groupAddress	= arb->handle.multicast.groupAddress;
+
+	return sizeof(MCAST_DESCR);
 }
 
-void IOFWIPBusInterface::updateNDPCache(void *buf, UInt16	*len)
+void IOFWIPBusInterface::mcapGroup6(const UInt8 *fwaddr, UInt8 *group6)
 {
-	struct icmp6_hdr			*icp	= NULL;
-	struct ip6_hdr				*ip6;
-	struct nd_neighbor_advert	*nd_na	= NULL;
-	struct nd_neighbor_solicit	*nd_ns	= NULL;
+	memset(group6, 0, 16);
+	group6[0] = fwaddr[0];
+	group6[1] = fwaddr[1];
+	memcpy(&group6[10], &fwaddr[2], 6);
+}
+
+/*!
+	@function txMCAPCommand
+	@abstract Gets an async stream command and fills in the GASP, encapsulation
+			  and MCAP headers of an empty MCAP message.
+	@param opcode	- MCAP_ADVERTISE or MCAP_SOLICIT.
+	@param packet	- returns the packet in the command's buffer.
+	@result the command, NULL when none is available.
+*/
+IOFWIPAsyncStreamTxCommand *IOFWIPBusInterface::txMCAPCommand(UInt8 opcode, struct mcap_packet **packet)
+{
+	// Get an async command from the command pool
+	IOFWIPAsyncStreamTxCommand	*asyncStreamCmd = getAsyncStreamCommand(true);
+		
+	// Lets not block to get a command, IP may retry soon ..:)
+	if(asyncStreamCmd == NULL)
+	{
+		fIPLocalNode->fIPoFWDiagnostics.fNoBCastCommands++;
+		return NULL;
+	}
+
+	fIPLocalNode->fIPoFWDiagnostics.fActiveBcastCmds++;
+			
+	// Get the buffer pointer from the command pool
+	*packet	= (struct mcap_packet*)asyncStreamCmd->getBufferFromDesc();
 	
-	ARB			*arb	= NULL;
-	IP1394_NDP	*fwndp	= NULL;
-	bool		update  = false;
+	memset(*packet, 0, sizeof(**packet));
+	(*packet)->gaspHdr.sourceID		= htons(fLcb->ownNodeID);
 	
-	ip6		= (struct ip6_hdr*)buf;
-	icp		= (struct icmp6_hdr*)(ip6 + 1);
-	nd_na	= (struct nd_neighbor_advert*)icp;
-	nd_ns	= (struct nd_neighbor_solicit*)icp;
+	memcpy(&(*packet)->gaspHdr.gaspID, &gaspVal, sizeof(GASP_ID));
+	(*packet)->ip1394Hdr.etherType	= htons(ETHER_TYPE_MCAP);
+	(*packet)->mcap.length			= sizeof(**packet);          
+	(*packet)->mcap.opcode			= opcode;
 
-	if(nd_ns->nd_ns_type == ND_NEIGHBOR_SOLICIT)
-	{		
-		// neighbor solicitation
-		fwndp = (IP1394_NDP*)((UInt8*)nd_ns + sizeof(struct nd_neighbor_solicit));
-		if(fwndp->type == 1)
-		{
-			update = true;
-		}
+	return asyncStreamCmd;
+}
+
+/*!
+	@function txMCAPSubmit
+	@abstract Sends an MCAP message built by txMCAPCommand on the default broadcast channel.
+	@param asyncStreamCmd	- command from txMCAPCommand.
+	@param packet			- its packet, mcap.length still in CPU byte order.
+	@result void.
+*/
+void IOFWIPBusInterface::txMCAPSubmit(IOFWIPAsyncStreamTxCommand *asyncStreamCmd, struct mcap_packet *packet)
+{
+	UInt32 cmdLen		= packet->mcap.length;		// In CPU byte order 
+	packet->mcap.length	= htons(cmdLen);			// Serial Bus order
+
+	// Initialize the command with new values of device object
+	IOReturn status = asyncStreamCmd->reinit (	fLcb->busGeneration, 
+												DEFAULT_BROADCAST_CHANNEL, 
+												cmdLen,
+												fLcb->maxBroadcastSpeed,
+												txCompleteAsyncStream, 
+												this);
+					  
+	if(status == kIOReturnSuccess)
+		status = asyncStreamCmd->submit();
+	else
+	{
+		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+		returnAsyncStreamCommand(asyncStreamCmd);
 	}
+
+	if(status != kIOReturnSuccess)
+		fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->outputErrors);
+}
+
+/*!
+	@function rxUnicastFlush
+	@abstract Starts the batch processing of the packets, its
+	          already on its own workloop. The lanes and the queued flag are
+			  taken under the lock, the stack runs the batch without it.
+			  Lanes are served one packet at a time in turn, so a busy peer
+			  can't hold the others behind a whole batch of its own packets,
+			  while packets from any one peer keep their order.
+*/
+void IOFWIPBusInterface::rxUnicastFlush()
+{
+	mbuf_t	lane[kRxSteerLanes];
+	UInt32	first	= 0;
+	UInt32	count	= 0;
+	bool	queued	= false;
+	bool	pending	= false;
+
+    IORecursiveLockLock(fIPLock);
 	
-	if(nd_na->nd_na_type == ND_NEIGHBOR_ADVERT)
+	for( UInt32 i = 0; i < kRxSteerLanes; i++ )
 	{
-		// neighbor advertisment
-		fwndp =  (IP1394_NDP*)((UInt8*)nd_na + sizeof(struct nd_neighbor_advert));
-		if(fwndp->type == 2)
-		{
-			update = true;
-		}
+		lane[i]			= fRxLaneHead[i];
+		fRxLaneHead[i]	= NULL;
+		fRxLaneTail[i]	= NULL;
 	}
-	
-	if(update && fwndp != NULL && fwndp->len > 2)
+	first = fRxLaneNext++ % kRxSteerLanes;
+
+	queued = fIPLocalNode->fPacketsQueued;
+	fIPLocalNode->fPacketsQueued = false;
+	fRxQueuedCount = 0;
+
+    IORecursiveLockUnlock(fIPLock);
+
+	for( UInt32 i = 0; i < kRxSteerLanes; i++ )
+		lane[i] = rxCoalesce(lane[i]);
+
+	do
 	{
-		arb = getArbFromFwAddr(fwndp->lladdr);
-		
-		if(arb != NULL)
+		pending = false;
+
+		for( UInt32 i = 0; i < kRxSteerLanes; i++ )
 		{
-			bcopy(fwndp->lladdr, &arb->eui64, kIOFWAddressSize);
-			arb->eui64.hi = OSSwapHostToBigInt32(arb->eui64.hi);
-			arb->eui64.lo = OSSwapHostToBigInt32(arb->eui64.lo);            
-			bcopy(fwndp->lladdr, arb->fwaddr, kIOFWAddressSize);
-			arb->handle.unicast.maxRec = fwndp->senderMaxRec;
-			arb->handle.unicast.spd = fwndp->sspd;
-			arb->handle.unicast.unicastFifoHi = htons(fwndp->senderUnicastFifoHi);
-			arb->handle.unicast.unicastFifoLo = htonl(fwndp->senderUnicastFifoLo); 
-			arb->handle.unicast.deviceID = getDeviceID(arb->eui64, &arb->itsMac);
+			UInt32	index	= (first + i) % kRxSteerLanes;
+			mbuf_t	m		= lane[index];
 
-			// Reset the packet
-			*len -= 8;
-			fwndp->len = 2;       	// len in units of 8 octets
-			fwndp->senderMaxRec = 0;
-			fwndp->sspd = 0;
-			fwndp->senderUnicastFifoHi = 0;
-			fwndp->senderUnicastFifoLo = 0;
+			if( m == NULL )
+				continue;
+
+			lane[index] = mbuf_nextpkt(m);
+			mbuf_setnextpkt(m, NULL);
+
+			fIPLocalNode->receivePackets(m, mbuf_pkthdr_len(m), true);
+			queued	= true;
+			pending	= true;
 		}
+	} while( pending );
+
+	if(queued == true)
+	{
+		count = fIPLocalNode->networkInterface->flushInputQueue();
+        if(count > fIPLocalNode->fIPoFWDiagnostics.fMaxInputCount)
+            fIPLocalNode->fIPoFWDiagnostics.fMaxInputCount = count; 
 	}
 
 	return;
 }
 
-#pragma mark -
-#pragma mark  IOFWIPBusInterface utility routines  
-
-bool IOFWIPBusInterface::staticUpdateARPCache(void *refcon, IP1394_ARP *fwa)
+/*!
+	@function rxScheduleFlush
+	@abstract Broadcast, multicast and ARP packets are queued like unicast ones and go
+			  to the stack on the next workloop pass. The async stream callbacks are
+			  not on the workloop, so they never flush themselves; the first packet
+			  queued since the last flush kicks the event source, the rest ride along.
+*/
+void IOFWIPBusInterface::rxScheduleFlush()
 {
-	return ((IOFWIPBusInterface*)refcon)->updateARPCache(fwa);
+	bool kick = false;
+
+	IORecursiveLockLock(fIPLock);
+
+	kick = (fRxQueuedCount++ == 0);
+
+	IORecursiveLockUnlock(fIPLock);
+
+	if( kick and (fRxFlushSource != NULL) )
+		fRxFlushSource->interruptOccurred(NULL, NULL, 0);
 }
 
-bool IOFWIPBusInterface::staticUpdateMulticastCache(void *refcon, IOFWAddress *addrs, UInt32 count)
+/*!
+	@function rxSteer
+	@abstract Chains the packet on the lane picked by the sender's physical ID.
+			  All of one node's packets, reassembled or not, share a lane.
+*/
+void IOFWIPBusInterface::rxSteer(mbuf_t m, UInt16 sourceID)
 {
-	return ((IOFWIPBusInterface*)refcon)->updateMulticastCache(addrs, count);
+	UInt32 index = (sourceID & 0x3F) % kRxSteerLanes;
+
+	recursiveScopeLock lock(fIPLock);
+
+	mbuf_setnextpkt(m, NULL);
+
+	if( fRxLaneTail[index] == NULL )
+		fRxLaneHead[index] = m;
+	else
+		mbuf_setnextpkt(fRxLaneTail[index], m);
+
+	fRxLaneTail[index] = m;
 }
 
-UInt32	IOFWIPBusInterface::staticOutputPacket(mbuf_t pkt, void * param)
+/*!
+	@function rxCoalesceHeaders
+	@abstract Checks that a received packet is an unfragmented TCP/IPv4 segment carrying
+			  data, with its headers in the first mbuf and a correct TCP checksum.
+	@param m - packet with its firewire header.
+	@param ip - set to the IP header.
+	@param th - set to the TCP header.
+	@param payloadLen - set to the TCP payload length.
+	@result bool - true if the segment can take part in coalescing.
+*/
+static bool rxCoalesceHeaders(mbuf_t m, struct ip **ip, struct tcphdr **th, UInt32 *payloadLen)
 {
-	return ((IOFWIPBusInterface*)param)->outputPacket(pkt,param);
+	UInt32					fwHdrLen	= sizeof(struct firewire_header);
+	struct firewire_header	*fwh		= (struct firewire_header *)mbuf_data(m);
+
+	if( (mbuf_len(m) < fwHdrLen + sizeof(struct ip) + sizeof(struct tcphdr))
+		or (fwh->fw_type != htons(FWTYPE_IP)) )
+		return false;
+
+	*ip = (struct ip *)((UInt8*)fwh + fwHdrLen);
+
+	if( ((*ip)->ip_v != IPVERSION) 
+		or ((*ip)->ip_hl != (sizeof(struct ip) >> 2))
+		or ((*ip)->ip_p != IPPROTO_TCP)
+		or ((ntohs((*ip)->ip_off) & (IP_MF | IP_OFFMASK)) != 0) )
+		return false;
+
+	*th = (struct tcphdr *)((UInt8*)*ip + sizeof(struct ip));
+
+	UInt32 ipLen		= ntohs((*ip)->ip_len);
+	UInt32 tcpHdrLen	= (*th)->th_off << 2;
+
+	if( (tcpHdrLen < sizeof(struct tcphdr))
+		or (mbuf_len(m) < fwHdrLen + sizeof(struct ip) + tcpHdrLen)
+		or (ipLen + fwHdrLen != mbuf_pkthdr_len(m))
+		or (ipLen <= sizeof(struct ip) + tcpHdrLen) )
+		return false;
+
+	*payloadLen = ipLen - sizeof(struct ip) - tcpHdrLen;
+
+	// Pseudo header is source and destination address, protocol and TCP length
+	UInt32 sum = checksumSum(m, fwHdrLen + ((UInt8*)&(*ip)->ip_src - (UInt8*)*ip), 2 * sizeof(struct in_addr));
+	sum += IPPROTO_TCP + tcpHdrLen + *payloadLen;
+	sum += checksumSum(m, fwHdrLen + sizeof(struct ip), tcpHdrLen + *payloadLen);
+
+	if( checksumFold(sum) != 0 )
+		return false;
+
+	// Checked here, the stack needn't check it again
+	mbuf_set_csum_performed(m, MBUF_CSUM_DID_DATA | MBUF_CSUM_PSEUDO_HDR, 0xFFFF);
+
+	return true;
 }
 
-bool IOFWIPBusInterface::wellKnownMulticastAddress(IOFWAddress *addr)
+/*!
+	@function rxCoalesce
+	@abstract Receive side segment coalescing, run by rxUnicastFlush on each lane.
+	@discussion A segment is appended to the one before it when both belong to the same
+				TCP/IPv4 flow, it starts at the next expected sequence number, and the two
+				have the same ack, window, TOS, TTL and TCP options. Both may carry only ACK,
+				the later one may also carry PSH. The segment's payload is chained onto the
+				merged packet, whose IP length and header checksum are rewritten. A merge ends
+				at the end of the lane (the batch boundary), on PSH, on any gap or header
+				mismatch, or at IP_MAXPACKET. Segments were checksummed by rxCoalesceHeaders,
+				so the merged packet is marked as verified.
+	@param chain - packets of one lane, linked with mbuf_nextpkt.
+	@result mbuf_t - the chain after merging, in the original order.
+*/
+mbuf_t IOFWIPBusInterface::rxCoalesce(mbuf_t chain)
 {
-	// if well know IPv4 multicast address then return true
-	bool found = (memcmp(addr->bytes, IPv4KnownMcastAddresses, sizeof(IPv4KnownMcastAddresses)) == 0) ? true : false;
-
-	if(not found)
+	UInt32			fwHdrLen	= sizeof(struct firewire_header);
+	mbuf_t			head		= NULL;
+	mbuf_t			tail		= NULL;
+	mbuf_t			merge		= NULL;		// packet segments are being appended to
+	struct ip		*mergeIP	= NULL;
+	struct tcphdr	*mergeTH	= NULL;
+	UInt32			nextSeq		= 0;
+	UInt32			segments	= 0;
+
+	while( chain != NULL )
 	{
-		if(addr->bytes[0] == 0xff) // check if its a IPv6 multicast address
+		mbuf_t			m			= chain;
+		struct ip		*ip			= NULL;
+		struct tcphdr	*th			= NULL;
+		UInt32			payloadLen	= 0;
+
+		chain = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, NULL);
+
+		bool candidate = rxCoalesceHeaders(m, &ip, &th, &payloadLen);
+
+		if( candidate and (merge != NULL)
+			and (ip->ip_src.s_addr == mergeIP->ip_src.s_addr)
+			and (ip->ip_dst.s_addr == mergeIP->ip_dst.s_addr)
+			and (th->th_sport == mergeTH->th_sport)
+			and (th->th_dport == mergeTH->th_dport)
+			and (ntohl(th->th_seq) == nextSeq)
+			and (th->th_ack == mergeTH->th_ack)
+			and (th->th_win == mergeTH->th_win)
+			and (ip->ip_tos == mergeIP->ip_tos)
+			and (ip->ip_ttl == mergeIP->ip_ttl)
+			and (th->th_off == mergeTH->th_off)
+			and ((th->th_flags & ~TH_PUSH) == TH_ACK)
+			and (ntohs(mergeIP->ip_len) + payloadLen <= IP_MAXPACKET)
+			and (memcmp(th + 1, mergeTH + 1, (th->th_off << 2) - sizeof(struct tcphdr)) == 0) )
 		{
-			found = true;
+			mbuf_adj(m, fwHdrLen + sizeof(struct ip) + (th->th_off << 2));
 
-			if(addr->bytes[1] & BIT_SET(4))
-				found = false;
-			else 		// if Transient Flag not set then well known IPv6 multicast address
-				found = true;
+			if( th->th_flags & TH_PUSH )
+				mergeTH->th_flags |= TH_PUSH;
+
+			mbuf_concatenate(merge, m);
+			mbuf_pkthdr_setlen(merge, mbuf_pkthdr_len(merge) + payloadLen);
+
+			mergeIP->ip_len = htons(ntohs(mergeIP->ip_len) + payloadLen);
+			mergeIP->ip_sum = 0;
+			mergeIP->ip_sum = checksumFold(checksumSum(merge, fwHdrLen, sizeof(struct ip)));
+
+			nextSeq += payloadLen;
+			segments++;
+
+			fIPLocalNode->fIPoFWDiagnostics.fRxCoalescedSegments++;
 		}
+		else
+		{
+			if( segments > 1 )
+				fIPLocalNode->fIPoFWDiagnostics.fRxCoalescedPkts++;
+
+			if( tail != NULL )
+				mbuf_setnextpkt(tail, m);
+			else
+				head = m;
+			tail = m;
+
+			merge		= NULL;
+			segments	= 0;
+
+			if( candidate and (th->th_flags == TH_ACK) )
+			{
+				merge		= m;
+				mergeIP		= ip;
+				mergeTH		= th;
+				nextSeq		= ntohl(th->th_seq) + payloadLen;
+				segments	= 1;
+			}
+		}
+
+		// PSH closes the merged packet
+		if( (merge != NULL) and (mergeTH->th_flags & TH_PUSH) )
+		{
+			if( segments > 1 )
+				fIPLocalNode->fIPoFWDiagnostics.fRxCoalescedPkts++;
+
+			merge		= NULL;
+			segments	= 0;
+		}
+	}
+
+	if( segments > 1 )
+		fIPLocalNode->fIPoFWDiagnostics.fRxCoalescedPkts++;
+
+	return head;
+}
+
+void rxFlushDeferred(OSObject *owner, IOInterruptEventSource *src, int count)
+{
+	IOFWIPBusInterface *fwIPPriv = OSDynamicCast(IOFWIPBusInterface, owner);
+
+	if( fwIPPriv != NULL )
+	{
+		fwIPPriv->rxUnicastFlush();
+		fwIPPriv->rxCacheRefill();
+	}
+}
+
+/*!
+	@function rxUnicastComplete
+	@abstract triggers the indication workloop to do batch processing
+				of incoming packets.
+*/
+void IOFWIPBusInterface::rxUnicastComplete(void *refcon)
+{
+	IOFWIPBusInterface *fwIPPriv = (IOFWIPBusInterface*)refcon;
+
+	fwIPPriv->rxUnicastFlush();
+
+	return;
+}
+
+/*!
+	@function rxUnicast
+	@abstract block write handler. Handles both ARP and IP packet.
+*/
+UInt32 IOFWIPBusInterface::rxUnicast( void		*refcon,
+								UInt16		nodeID,
+                                IOFWSpeed	&speed,
+                                FWAddress	addr,
+                                UInt32		len,
+								const void	*buf,
+								IOFWRequestRefCon requestRefcon)
+{
+	IOFWIPBusInterface		*fwIPPriv = (IOFWIPBusInterface*)refcon;
+	IOFireWireIP			*fwIPObject	= OSDynamicCast(IOFireWireIP, fwIPPriv->fIPLocalNode);
+	IP1394_UNFRAG_HDR		*ip1394Hdr	= (IP1394_UNFRAG_HDR *)buf;
+
+	if(not fwIPPriv->fStarted)
+		return kIOReturnSuccess;
+   
+	UInt8	lf = (htons(ip1394Hdr->reserved) >> 14);
+	// Handle the unfragmented packet
+	if (lf == UNFRAGMENTED) 
+	{
+		void	*datagram		= (void *) ((UInt64) ip1394Hdr + sizeof(IP1394_UNFRAG_HDR));
+		UInt16	datagramSize	= len - sizeof(IP1394_UNFRAG_HDR);
+		UInt16	type			= ntohs(ip1394Hdr->etherType);
+
+		switch (type) 
+		{
+			case FWTYPE_IPV6:
+			case FWTYPE_IP:
+				if (datagramSize >= IPV4_HDR_SIZE && datagramSize <= fwIPObject->fMaxDatagramSize)
+					fwIPPriv->rxIP(datagram, datagramSize, FW_M_UCAST, type, nodeID);
+				break;
+
+			case FWTYPE_ARP:
+				if (datagramSize >= sizeof(IP1394_ARP) && datagramSize <= FIREWIRE_MTU)
+					fwIPPriv->rxARP((IP1394_ARP*)datagram, FW_M_UCAST, nodeID);
+				break;
+			
+			default :
+				// Unknown packet type
+				fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
+				break;
+		}
+	}
+	else
+	{     
+		fwIPObject->fIPoFWDiagnostics.fRxFragmentPkts++;
+  
+		if(fwIPPriv->rxFragmentedUnicast(nodeID, (IP1394_FRAG_HDR*)ip1394Hdr, len) == kIOReturnError)
+			fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
+	}
+
+	fwIPObject->fIPoFWDiagnostics.fRxUni++;
+	
+	return kIOReturnSuccess;
+}
+	
+IOReturn IOFWIPBusInterface::rxFragmentedUnicast(UInt16 nodeID, IP1394_FRAG_HDR *pkt, UInt32 len)
+{
+	IP1394_FRAG_HDR *fragmentHdr	= (IP1394_FRAG_HDR*) pkt;  // Different header layout
+	void			*fragment		= (void *) ((UInt64) fragmentHdr + sizeof(IP1394_FRAG_HDR));
+	UInt16			fragmentSize	= len - sizeof(IP1394_FRAG_HDR);
+	
+	UInt8	lf				= htons(fragmentHdr->datagramSize) >> 14;
+	// RFC 2734 defines 12 bits, the two reserved bits above carry Apple jumbo datagrams
+	UInt16	datagramSize	= (htons(fragmentHdr->datagramSize) & 0x3FFF) + 1;
+	UInt16	label			= htons(fragmentHdr->dgl);
+
+	if(datagramSize > fIPLocalNode->fMaxDatagramSize)
+		return kIOReturnError;
+
+	recursiveScopeLock lock(fIPLock);
+	
+	IOReturn result			= kIOReturnSuccess;
+	UInt16	 fragmentOffset = htons(fragmentHdr->fragmentOffset);
+
+	RCB *rcb = getRcb(nodeID, label);
+
+	if (rcb == NULL) 
+	{
+		if (lf == FIRST_FRAGMENT) 
+		{
+			mbuf_t rxMBuf = (mbuf_t)rxAllocateMbuf(datagramSize + sizeof(firewire_header));
+
+			if (rxMBuf == NULL)
+			{
+				fIPLocalNode->fIPoFWDiagnostics.fNoMbufs++;
+				return kIOReturnError;
+			}
+			
+			if ((rcb = getRCBCommand( nodeID, label, fragmentOffset, datagramSize, rxMBuf )) == NULL) 
+			{
+				fIPLocalNode->fIPoFWDiagnostics.fNoRCBCommands++;
+				cleanRCBCache();
+				fIPLocalNode->freePacket(rxMBuf, 0);
+				return kIOReturnError;
+			}
+		 
+			// Make space for the firewire header to be helpfull in firewire_demux
+			struct firewire_header *fwh = (struct firewire_header *)mbuf_data(rxMBuf);
+			bzero(fwh, sizeof(struct firewire_header));
+			// when indicating to the top layer
+			// JLIU - fragmentHdr already in network order, do not swap fragmentOffset
+			fwh->fw_type  = fragmentHdr->fragmentOffset;
+			rcb->residual = rcb->datagramSize;
+
+			activeRcb->setObject(rcb);
+			fragmentOffset = 0;
+		}
+		else 
+			result = kIOReturnError;
+	}
+
+	if( result == kIOReturnSuccess )
+	{
+		UInt16 amountToCopy = MIN(fragmentSize, rcb->datagramSize - fragmentOffset);
+		
+		if(amountToCopy > rcb->residual)
+		{
+			fIPLocalNode->fIPoFWDiagnostics.fRxFragmentPktsDropped++;
+			result = kIOReturnError;
+		}
+		else
+		{
+			bufferToMbuf(rcb->mBuf, sizeof(struct firewire_header)+fragmentOffset, (vm_address_t*)fragment, amountToCopy);
+			
+			rcb->residual -= MIN(fragmentSize, rcb->residual); 
+
+			if ( rcb->residual == 0 ) 
+			{           
+				// Legitimate etherType ? this prevents corrupted etherType 
+				// being presented to the networking layer
+				if (rcb->etherType == FWTYPE_IP || rcb->etherType == FWTYPE_IPV6) 
+					rxSteer(rcb->mBuf, nodeID);
+				else
+				{
+					fIPLocalNode->freePacket(rcb->mBuf, 0); 
+					result = kIOReturnError;
+				}
+
+				releaseRCB(rcb, false);
+			}
+		}
+	}
+	
+	return result;
+}
+
+/*!
+	@function rxAsyncStream
+	@abstract callback for an Asyncstream packet, can be both IP or ARP packet.
+			This procedure receives an indication when an asynchronous stream
+			packet arrives on the default broadcast channel. The packet "should" be GASP,
+			but we perform a few checks to make sure. Once we know these are OK, we check
+			the etherType field in the unfragmented encapsulation header. This is necessary
+			to dispatch the three types of packet that RFC 2734 permits on the default
+			broadcast channel: an IPv4 datagram, and ARP request or response or a multi-
+			channel allocation protocol (MCAP) message. The only remaining check, for each
+			of these three cases, is to make sure that the packet is large enough to hold
+			meaningful data. If so, send the packet to another procedure for further
+			processing.  
+	@param DCLCommandStruct *callProc.
+	@result void.
+*/
+void IOFWIPBusInterface::rxAsyncStream(void	*refCon, const void	*buffer)
+{
+	IOFWIPBusInterface			*fwIPPriv = (IOFWIPBusInterface*)refCon;
+	IOFireWireIP				*fwIPObject	= OSDynamicCast(IOFireWireIP, fwIPPriv->fIPLocalNode);
+
+	void			*datagram;
+	UInt16			datagramSize;
+	GASP			*gasp = (GASP*)buffer;
+	LCB 			*lcb = fwIPPriv->fLcb;
+	ISOC_DATA_PKT	*pkt = (ISOC_DATA_PKT*)buffer; 
+	UInt16 			type = 0;
+
+	if(not fwIPPriv->fStarted)
+		return;
+
+	if(pkt->tag != GASP_TAG){
+		// Error, so we touch the error output packets
+		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
+		fwIPObject->fIPoFWDiagnostics.fGaspTagError++;
+		return;
+    }
+	
+	// Minimum size requirement
+	if (gasp->dataLength < sizeof(GASP_HDR) + sizeof(IP1394_UNFRAG_HDR)) {
+		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
+		fwIPObject->fIPoFWDiagnostics.fGaspHeaderError++;
+		return;
+    }
+
+	// Ignore GASP if not specified by RFC 2734
+	if (memcmp(&gasp->gaspHdr.gaspID, &gaspVal, sizeof(GASP_ID)) != 0) {
+		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
+		fwIPObject->fIPoFWDiagnostics.fNonRFC2734Gasp++;
+		return;
+    }
+
+	// Also ignore GASP if not from the local bus
+	if ((htons(gasp->gaspHdr.sourceID) >> 6) != LOCAL_BUS_ID) {
+		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
+		fwIPObject->fIPoFWDiagnostics.fRemoteGaspError++;
+		return;
+    }
+   
+	// Broadcast fragmentation not supported
+	if (gasp->ip1394Hdr.reserved != htons(UNFRAGMENTED)) {
+		fwIPObject->networkStatAdd(&(fwIPObject->getNetStats())->inputErrors);
+		fwIPObject->fIPoFWDiagnostics.fEncapsulationHeaderError++;
+		return;
+    }
+   
+   datagram = (void *) ((UInt64) buffer + sizeof(GASP));
+   datagramSize = gasp->dataLength - (sizeof(GASP_HDR) + sizeof(IP1394_UNFRAG_HDR));
+   type = ntohs(gasp->ip1394Hdr.etherType);
+
+   //IOLog("   Ether type 0x%04X (data length %d)\n\r",htons(gasp->ip1394Hdr.etherType), datagramSize);
+
+	switch (type) {
+		case FWTYPE_IPV6:
+		case FWTYPE_IP:
+			if (not fwIPPriv->rxMcastFilter(datagram, datagramSize, type))
+				fwIPObject->fIPoFWDiagnostics.fRxMcastFiltered++;		// Group we never joined
+			else if (datagramSize >= IPV4_HDR_SIZE && datagramSize <= fwIPObject->fMaxDatagramSize)
+				fwIPPriv->rxIP(datagram, datagramSize, FW_M_BCAST, type, htons(gasp->gaspHdr.sourceID));
+			break;
+
+		case FWTYPE_ARP:
+			if (datagramSize >= sizeof(IP1394_ARP) && datagramSize <= FIREWIRE_MTU)
+				fwIPPriv->rxARP((IP1394_ARP*)datagram, FW_M_BCAST, htons(gasp->gaspHdr.sourceID));
+			break;
+			
+		case ETHER_TYPE_MCAP:
+			if (datagramSize >= sizeof(IP1394_MCAP) && datagramSize <= FIREWIRE_MTU)
+				fwIPPriv->rxMCAP(lcb, htons(gasp->gaspHdr.sourceID), 
+									(IP1394_MCAP*)datagram, datagramSize - sizeof(IP1394_MCAP));
+			break;
+	}
+
+	fwIPObject->fIPoFWDiagnostics.fRxBcast++;
+
+	return;
+}
+
+IOReturn IOFWIPBusInterface::createAsyncStreamRxClient(UInt8 speed, UInt32 channel, MCB *mcb)
+{
+	IOReturn	status = kIOReturnNoMemory;
+
+	if(channel != DEFAULT_BROADCAST_CHANNEL)
+	{
+		IOFWAsyncStreamListener	*newAsyncStreamRxClient = fControl->createAsyncStreamListener( channel, rxAsyncStream, this );
+		if( newAsyncStreamRxClient != NULL) 
+		{
+			newAsyncStreamRxClient->retain();
+			mcb->asyncStreamID = (OSObject*)newAsyncStreamRxClient;
+			status = kIOReturnSuccess;
+		}
+	}
+	else
+	{
+		if(fBroadcastReceiveClient != NULL)
+		{
+			fBroadcastReceiveClient->retain();
+			mcb->asyncStreamID = (OSObject*)fBroadcastReceiveClient;
+			status = kIOReturnSuccess;
+		}
+	}
+	
+	return status;
+}
+
+
+/*!
+	@function rxMCAP
+	@abstract called from rxAsyncstream for processing MCAP advertisement.
+			When an MCAP advertisement is received, parse all of its descriptors 
+			looking for any that match group addreses in our MCAP cache. For those that 
+			match, update  the channel number (it may have changed from the default
+			broadcast channel or since the last advertisement), update the speed 
+			(the MCAP owner may have changed the speed requirements as nodes joined or 
+			left the group) and refresh the expiration timer so that the MCAP 
+			channel is valid for another number of seconds into the future. 
+			If the owner lets a channel expire while we still send to its
+			groups, we take the channel over and advertise it ourselves.
+	@param lcb - the firewire link control block for this interface.
+    @param mcapSourceID - source nodeid which generated the multicast advertisement packet.
+    @param mcap - mulitcast advertisment packet without the GASP header.
+	@param dataSize - size of the packet.
+	@result void.
+*/
+void IOFWIPBusInterface::rxMCAP(LCB *lcb, UInt16 mcapSourceID, IP1394_MCAP *mcap, UInt32 dataSize)
+{
+
+	MARB						*arb;
+	UInt32						currentChannel;
+	MCAST_DESCR					*groupDescr = mcap->groupDescr;
+	MCB							*mcb,	*priorMcb;
+	IOFWAsyncStreamListener		*asyncStreamRxClient;
+	UInt64						reply = 0;
+
+	if ((mcap->opcode != MCAP_ADVERTISE) && (mcap->opcode != MCAP_SOLICIT))
+		return;        // Ignore reserved MCAP opcodes
+	  
+	dataSize = MIN(dataSize, htons(mcap->length) - sizeof(IP1394_MCAP));
+   
+	while (dataSize >= sizeof(MCAST_DESCR)) 
+	{
+		recursiveScopeLock lock(fIPLock);
+	
+		UInt32 descrLength = (groupDescr->type == MCAST_TYPE_IPV6) ? sizeof(MCAST_DESCR_IPV6) : sizeof(MCAST_DESCR);
+
+		if (groupDescr->length == 0)
+		{
+			fIPLocalNode->fIPoFWDiagnostics.fInCorrectMCAPDesc++;		// Can't step over it, drop the rest
+			break;
+		}
+		else if ((groupDescr->length != descrLength) or (groupDescr->length > dataSize))
+			fIPLocalNode->fIPoFWDiagnostics.fInCorrectMCAPDesc++;		// Skip over malformed MCAP group address descriptors
+		else if ((groupDescr->type != MCAST_TYPE) and (groupDescr->type != MCAST_TYPE_IPV6))
+			fIPLocalNode->fIPoFWDiagnostics.fUnknownMCAPDesc++;		// Skip over unrecognized descriptor types
+		else if ((arb = getMcapGroupArb(groupDescr)) == NULL)
+			fIPLocalNode->fIPoFWDiagnostics.fUnknownGroupAddress++;      // Ignore if not in our multicast cache
+		else if (mcap->opcode == MCAP_SOLICIT) 
+		{
+			mcb = OSDynamicCast(MCB, mcapState->getObject(arb->handle.multicast.channel));
+			if(mcb)
+			{
+				if (mcb->owned and (fMCAPReplied & (1ULL << mcb->channel)))
+					fIPLocalNode->fIPoFWDiagnostics.fMCAPRepliesLimited++;	// Already advertised this second
+				else if (mcb->owned)                      // Do we own the channel?
+					reply |= (1ULL << mcb->channel);     // OK, respond to solicitation
+			}
+		} 
+		else if ((groupDescr->channel != DEFAULT_BROADCAST_CHANNEL) && (groupDescr->channel < kMaxChannels)) 
+		{
+			mcb = OSDynamicCast(MCB, mcapState->getObject(groupDescr->channel));
+			if(not mcb)
+				break;
+			
+			if ( (groupDescr->expiration < kMCAPExpiration) and (mcb->ownerNodeID == mcapSourceID) ) 
+			{
+				// Owner is letting the channel go, keep it if we still send to the group
+				if ( (not mcb->owned) and (mcb->groupCount > 0) and (mcb->txIdle < kMCAPExpiration) )
+				{
+					mcb->ownerNodeID	= lcb->ownNodeID;	// Take channel ownership
+					mcb->owned			= true;
+					mcb->expiration		= kMCAPExpiration;
+					mcb->finalWarning	= 0;
+					mcb->nextTransmit	= 1;				// Transmit advertisement ASAP
+					mcb->irmRetries		= kMCAPReclaimRetries;
+					fIPLocalNode->fIPoFWDiagnostics.fMCAPTakeovers++;
+
+					// The IRM allocation is the old owner's until it lets go, allocate ours once it has
+					if (groupDescr->expiration == 0)
+					{
+						mcb->irmHoldoff	= 0;
+						mcb->irmReclaim	= true;
+						mcapSchedule();
+					}
+					else
+						mcb->irmHoldoff	= groupDescr->expiration;
+				}
+			} 
+			else if (mcb->ownerNodeID == mcapSourceID) 
+			{
+				mcb->expiration = groupDescr->expiration;
+			}
+			else if ( (mcb->ownerNodeID < mcapSourceID) or (mcb->expiration < kMCAPExpiration) ) 
+			{
+				if (mcb->owned)
+					mcapDisown(mcb);				// Taken over, the channel is theirs at the IRM now
+
+				mcb->ownerNodeID = mcapSourceID;
+				mcb->expiration = groupDescr->expiration;
+			}
+
+			if (mcb->expiration > 0)
+				mcapArmChannel(mcb);			// Age the advertisement from now on
+
+			currentChannel = arb->handle.multicast.channel;
+
+			// Owner may have changed the speed as nodes joined or left, txMulticastIP sends at this speed
+			if (arb->handle.multicast.spd != groupDescr->speed)
+				fMCAPGroupGen++;					// Our advertisements carry the speed too
+			arb->handle.multicast.spd = groupDescr->speed;
+
+			if (currentChannel != groupDescr->channel)
+			{
+				priorMcb = OSDynamicCast(MCB, mcapState->getObject(currentChannel));
+				if(not priorMcb)
+					break;
+				
+				if (priorMcb->groupCount == 1) // Are we the last user?
+				{   
+					// Stop listening on the channel the group leaves, the new one keeps its listener
+					asyncStreamRxClient = OSDynamicCast(IOFWAsyncStreamListener, priorMcb->asyncStreamID);
+					if(asyncStreamRxClient != NULL)
+					{
+						fControl->removeAsyncStreamListener( asyncStreamRxClient );
+						asyncStreamRxClient->release();
+					}
+
+					priorMcb->asyncStreamID = NULL;
+					priorMcb->groupCount = 0;
+				} 
+				else if (priorMcb->groupCount > 0)
+					priorMcb->groupCount--;
+
+				if (mcb->asyncStreamID == NULL) 
+				{
+					if(createAsyncStreamRxClient(groupDescr->speed, groupDescr->channel, mcb) != kIOReturnSuccess)
+						break;
+				}
+				
+				arb->handle.multicast.channel = groupDescr->channel;
+				mcb->groupCount++;
+				fMCAPGroupGen++;
+			}
+		}
+		dataSize -= MIN(groupDescr->length, dataSize);
+		groupDescr = (MCAST_DESCR*)((UInt64)groupDescr + groupDescr->length);
+	}
+
+	// One advertisement answers every solicit for our channels in this message
+	if (reply != 0)
+	{
+		recursiveScopeLock lock(fIPLock);
+
+		fMCAPReplied |= reply;
+		txMCAPAdvertise(reply);
+	}
+}
+
+
+/*!
+	@function rxIP
+	@abstract Receive IP packet. Only the NDP cache update touches shared
+			  tables and holds fIPLock; allocation, copy and handoff do not.
+	@param pkt - points to the IP packet without the header.
+	@param len - length of the packet.
+	@params flags - indicates broadcast or unicast	
+	@params type - indicates type of the packet IPv4 or IPv6	
+	@params sourceID - node ID of the sender, selects the receive lane
+	@result IOReturn.
+*/
+IOReturn IOFWIPBusInterface::rxIP(void *pkt, UInt32 len, UInt32 flags, UInt16 type, UInt16 sourceID)
+{
+	mbuf_t	rxMBuf = NULL;
+	struct	firewire_header *fwh = NULL;
+	bool	unicast = (flags == FW_M_UCAST);
+	IOReturn ret = kIOReturnSuccess;
+	IP1394_PKT_INFO info;
+
+	// Only a Neighbor Solicitation or Advertisement needs its option rewritten
+	classifyHeaders((const UInt8*)pkt, len, type, &info);
+
+	if ((rxMBuf = (mbuf_t)rxAllocateMbuf(len  + sizeof(firewire_header))) != NULL) 
+	{
+        bufferToMbuf(rxMBuf, sizeof(struct firewire_header), (vm_address_t*)pkt, len); 			
+
+        if (rxMBuf != NULL)
+        {
+			fwh = (struct firewire_header *)mbuf_data(rxMBuf);
+            bzero(fwh, sizeof(struct firewire_header));
+            fwh->fw_type = htons(type);
+			
+            if(unicast)
+				bcopy(fIPLocalNode->macAddr, fwh->fw_dhost, kIOFWAddressSize);
+			else
+				bcopy(fwbroadcastaddr, fwh->fw_dhost, kIOFWAddressSize);
+
+			if( (info.protocol == IPPROTO_ICMPV6)
+				and ((info.icmp6Type == ND_NEIGHBOR_SOLICIT) or (info.icmp6Type == ND_NEIGHBOR_ADVERT)) )
+			{
+				bool updated = false;
+
+				IORecursiveLockLock(fIPLock);
+				updated = updateNDPCache(rxMBuf);
+				IORecursiveLockUnlock(fIPLock);
+
+				if( updated == true ) 
+				{
+					mbuf_prepend(&rxMBuf, sizeof(struct firewire_header), MBUF_DONTWAIT);
+				}
+			}
+        }
+        else
+		{
+			fIPLocalNode->fIPoFWDiagnostics.fNoMbufs++;
+            ret = kIOReturnNoMemory;
+		}
+		
+        if(ret == kIOReturnSuccess)
+        {
+            // Every path queues, unicast is flushed by rxUnicastComplete
+            rxSteer(rxMBuf, sourceID);
+
+            if(not unicast)
+                rxScheduleFlush();
+        }
+        else
+        {
+            if(rxMBuf != NULL)
+                fIPLocalNode->freePacket(rxMBuf, 0);
+
+            fIPLocalNode->networkStatAdd(&(fIPLocalNode->getNetStats())->inputErrors);
+        }
+	}
+
+	return ret;
+}
+
+/*!
+	@function rxARP
+	@abstract ARP processing routine called from both Asynstream path and Async path.
+			  The ARB cache is updated here, the stack gets the ARP packet in a plain
+			  header mbuf only for inet_arp_handle_input.
+	@param fwIPObj - IOFireWireIP object.
+	@param arp - 1394 arp packet without the GASP or Async header.
+	@params flags - indicates broadcast or unicast	
+	@params sourceID - node ID of the sender, selects the receive lane
+	@result IOReturn.
+*/
+IOReturn IOFWIPBusInterface::rxARP(IP1394_ARP *arp, UInt32 flags, UInt16 sourceID){
+
+	mbuf_t rxMBuf = NULL;
+	struct firewire_header *fwh = NULL;
+	void	*datagram = NULL;
+	UInt32	size = sizeof(*arp) + sizeof(struct firewire_header);
+	
+	if (arp->hardwareType != htons(ARP_HDW_TYPE)
+		|| arp->protocolType != htons(FWTYPE_IP)
+		|| arp->hwAddrLen != sizeof(IP1394_HDW_ADDR)
+		|| arp->ipAddrLen != IPV4_ADDR_SIZE)
+	{
+		IOLog("IOFireWireIP: rxARP ERROR in packet header\n");
+		return kIOReturnError;
+	}
+
+	updateARPCache(arp);
+
+	// Small enough for the mbuf itself, leave the cluster cache to IP
+	if (mbuf_gethdr(MBUF_DONTWAIT, MBUF_TYPE_DATA, &rxMBuf) == 0) 
+	{
+		mbuf_setlen(rxMBuf, size);
+		mbuf_pkthdr_setlen(rxMBuf, size);
+
+		fwh = (struct firewire_header *)mbuf_data(rxMBuf);
+		datagram = ((UInt8*)mbuf_data(rxMBuf)) + sizeof(struct firewire_header);
+		bzero(fwh, sizeof(struct firewire_header));
+		fwh->fw_type = htons(FWTYPE_ARP);
+		// Copy the data
+		memcpy(datagram, arp, sizeof(*arp));
+		
+        rxSteer(rxMBuf, sourceID);
+
+        if(flags != FW_M_UCAST)
+            rxScheduleFlush();
+	}
+	else
+		fIPLocalNode->fIPoFWDiagnostics.fNoMbufs++;
+   
+ 	return kIOReturnSuccess;
+}
+
+/*!
+	@function watchdog
+	@abstract cleans the Link control block's stale drb's and rcb's.
+			The cleanCache's job is to age (and eventually discard) device objects 
+			for FireWireIP devices that have come unplugged. If they do reappear after  
+			they have been discarded from the caches, all that is required is a new ARP. 
+			The IP network stack handles that automatically
+	@param lcb - the firewire link control block for this interface.
+	@result void.
+*/
+void watchdog(OSObject *obj, IOTimerEventSource *src)
+{	
+	IOFWIPBusInterface *FWIPPriv = (IOFWIPBusInterface*)obj;
+
+	FWIPPriv->processWatchDogTimeout();
+}
+
+/*!
+	@function mcapTimeout
+	@abstract runs the MCAP state machine once a second while it has work.
+	@param obj - IOFWIPBusInterface.
+	@result void.
+*/
+void mcapTimeout(OSObject *obj, IOTimerEventSource *src)
+{
+	IOFWIPBusInterface *FWIPPriv = (IOFWIPBusInterface*)obj;
+
+	FWIPPriv->processMCAPTimeout();
+}
+
+/*!
+	@function linkTimeout
+	@abstract updates the link status for the DRB changes collected since it was armed.
+	@param obj - IOFWIPBusInterface.
+	@result void.
+*/
+void linkTimeout(OSObject *obj, IOTimerEventSource *src)
+{
+	IOFWIPBusInterface *FWIPPriv = (IOFWIPBusInterface*)obj;
+
+	FWIPPriv->processLinkTimeout();
+}
+
+void IOFWIPBusInterface::processLinkTimeout()
+{
+	recursiveScopeLock lock(fIPLock);
+
+	fLinkUpdatePending = false;
+
+	updateLinkStatus();
+}
+
+void IOFWIPBusInterface::processMCAPTimeout()
+{
+	recursiveScopeLock lock(fIPLock);
+
+	fMCAPTimerArmed = false;
+	fMCAPReplied	= 0;		// Solicits may be answered again
+
+	updateMcapState();
+
+	// Idle once nothing is left to age, advertise or wait on
+	if( (fMCAPActive != 0) or fMCAPArbTimers )
+		mcapArmTimer();
+}
+
+void IOFWIPBusInterface::mcapArmTimer()
+{
+	recursiveScopeLock lock(fIPLock);
+
+	if( (not fMCAPTimerArmed) and (fMCAPTimerSource != NULL) )
+	{
+		fMCAPTimerArmed = true;
+		fMCAPTimerSource->setTimeoutMS(kWatchDogTimerMS);
+	}
+}
+
+void IOFWIPBusInterface::mcapArmChannel(MCB *mcb)
+{
+	recursiveScopeLock lock(fIPLock);
+
+	UInt64 bit = 1ULL << mcb->channel;
+
+	if( not (fMCAPActive & bit) )
+	{
+		fMCAPActive |= bit;
+		mcb->txIdle = kMCAPExpiration;		// Not ticked while the channel was inactive
+	}
+
+	mcapArmTimer();
+}
+
+void IOFWIPBusInterface::mcapArmGroups()
+{
+	recursiveScopeLock lock(fIPLock);
+
+	fMCAPArbTimers = true;
+
+	mcapArmTimer();
+}
+
+void IOFWIPBusInterface::processWatchDogTimeout()
+{
+	recursiveScopeLock lock(fIPLock);
+
+	// Account the tail of the last transmit burst before sampling fTxUni
+	txCompleteFlush(true);
+
+	// Nothing in flight to complete, so retry held control frames and leftover large send segments here
+	if( fControlQueue != NULL )
+		txControlDrain();
+
+	if( fLargeSendQueue != NULL )
+		txLargeSendDrain();
+
+	// Packets held over a reset whose node came back late, or whose window has closed
+	if( fTxHoldDeadline != 0 )
+		txHoldDrain();
+
+	// In case the receive paths drained the caches without scheduling a refill
+	rxCacheRefill();
+
+	cleanRCBCache();
+	
+	fIPLocalNode->fIPoFWDiagnostics.fMaxQueueSize = max(fIPLocalNode->fIPoFWDiagnostics.fTxUni - fPrevTransmitCount, TRANSMIT_QUEUE_SIZE);
+	
+	fPrevTransmitCount = fIPLocalNode->fIPoFWDiagnostics.fTxUni;
+
+	fIPLocalNode->fIPoFWDiagnostics.fLastStarted++;
+
+	// Tuning segment for optimum performance, if too many Busy Acks
+	if( not fIPLocalNode->fIPoFWDiagnostics.fDoFastRetry )
+	{
+		fIPLocalNode->fIPoFWDiagnostics.fDoFastRetry	= ((fIPLocalNode->fIPoFWDiagnostics.fBusyAcks - fPrevBusyAcks) > kMaxBusyXAcksPerSecond);
+		fPrevBusyAcks				= fIPLocalNode->fIPoFWDiagnostics.fBusyAcks;
+		fFastRetryUnsetTimer		= fPrevFastRetryBusyAcks = fIPLocalNode->fIPoFWDiagnostics.fFastRetryBusyAcks = 0;
+	}
+	else
+	{
+		fFastRetryUnsetTimer = (fIPLocalNode->fIPoFWDiagnostics.fFastRetryBusyAcks - fPrevFastRetryBusyAcks) ? 0 : fFastRetryUnsetTimer + 1;
+		
+		// Fast retry BusyX acks absent for last 60 seconds, so turn it off
+		fIPLocalNode->fIPoFWDiagnostics.fDoFastRetry	= not (fFastRetryUnsetTimer > kMaxSecondsToTurnOffFastRetry);
+		fPrevBusyAcks				= fIPLocalNode->fIPoFWDiagnostics.fBusyAcks;
+		fPrevFastRetryBusyAcks		= fIPLocalNode->fIPoFWDiagnostics.fFastRetryBusyAcks;
+	}
+	
+	// Restart the watchdog timer
+	timerSource->setTimeoutMS(kWatchDogTimerMS);
+}
+
+#pragma mark -
+#pragma mark  IPv6 NDP routines  
+
+const int ipv6fwoffset = 8;
+
+bool IOFWIPBusInterface::addNDPOptions(mbuf_t m)
+{
+	bool ret = false;
+
+	if(not (mbuf_flags(m) & MBUF_PKTHDR))
+		return ret;
+
+	vm_address_t src = (vm_offset_t)mbuf_data(m);
+	if(src == 0)
+		return ret;
+
+	UInt32	fwhdrlen	= sizeof(firewire_header);
+	mbuf_t	ipv6Mbuf	= m;
+	int		pkthdrlen	= 0;
+
+	// check whether len equals ether header
+	if(mbuf_len(m) == sizeof(firewire_header))
+	{
+		ipv6Mbuf = mbuf_next(m);
+		if(ipv6Mbuf == NULL)
+			return ret;
+
+		src = (vm_offset_t)mbuf_data(ipv6Mbuf);
+		
+		fwhdrlen	= 0;
+        pkthdrlen	= mbuf_pkthdr_len(ipv6Mbuf);
+	}
+
+	if(mbuf_len(ipv6Mbuf) < (fwhdrlen + sizeof(struct ip6_hdr)))
+		return ret; 
+
+	// no space in mbuf
+	if(mbuf_trailingspace(ipv6Mbuf) < (int)sizeof(IP1394_NDP))
+		return ret;
+
+	UInt8	*bufPtr = (UInt8*)(src + fwhdrlen);
+
+	// show type of ICMPV6 packets being sent
+	struct ip6_hdr				*ip6	= (struct ip6_hdr*)bufPtr;
+	struct icmp6_hdr			*icp	= (struct icmp6_hdr*)(ip6 + 1);
+	struct nd_neighbor_advert	*nd_na	= (struct nd_neighbor_advert*)icp;
+	struct nd_neighbor_solicit	*nd_ns	= (struct nd_neighbor_solicit*)icp;
+
+    int	offset	= sizeof(*ip6) + fwhdrlen;
+
+	bool		modify		 = false;
+	IP1394_NDP	*fwndp		 = NULL;
+	u_int16_t	*icmp6_cksum = NULL;
+
+	if(nd_ns->nd_ns_type == ND_NEIGHBOR_SOLICIT)
+	{		
+		// neighbor solicitation
+		fwndp = (IP1394_NDP*)((UInt8*)nd_ns + sizeof(struct nd_neighbor_solicit));
+		if(fwndp->type == 1)
+		{
+			modify = true;
+            icmp6_cksum = &nd_ns->nd_ns_cksum;
+		}
+	}
+	
+	if(nd_na->nd_na_type == ND_NEIGHBOR_ADVERT)
+	{
+		// neighbor advertisment
+		fwndp =  (IP1394_NDP*)((UInt8*)nd_na + sizeof(struct nd_neighbor_advert));
+		
+		if(fwndp->type == 2)
+		{
+			modify = true;
+            icmp6_cksum = &nd_na->nd_na_cksum;
+		}
+	}
+	
+	if(modify)
+	{
+		UInt32	optOffset	= (UInt8*)fwndp - (UInt8*)src;
+		UInt32	optLen		= fwndp->len * 8;
+		UInt32	oldSum		= 0;
+		int		icmp6len	= ntohs(ip6->ip6_plen) + ipv6fwoffset;
+
+		// The checksum is patched when the option is the end of the packet, the usual case
+		bool incremental = (optOffset + optLen == fwhdrlen + sizeof(*ip6) + ntohs(ip6->ip6_plen))
+							and (optLen + ipv6fwoffset == sizeof(IP1394_NDP));
+
+		if(incremental)
+			oldSum = checksumSum(ipv6Mbuf, optOffset, optLen) + ntohs(ip6->ip6_plen);
+
+		fwndp->len = 3;       									// len in units of 8 octets
+		bzero(fwndp->reserved, 6);								// reserved by the RFC 3146
+		fwndp->senderMaxRec = fLcb->ownHardwareAddress.maxRec;	// Maximum payload (2 ** senderMaxRec)
+		fwndp->sspd = fLcb->ownHardwareAddress.spd;				// Maximum speed
+		fwndp->senderUnicastFifoHi = htons(fLcb->ownHardwareAddress.unicastFifoHi);	// Most significant 16 bits of FIFO address
+		fwndp->senderUnicastFifoLo = htonl(fLcb->ownHardwareAddress.unicastFifoLo);	// Least significant 32 bits of FIFO address
+		
+        // current mbuf length IPv6+ICMP6
+		mbuf_setlen(ipv6Mbuf, mbuf_len(ipv6Mbuf)+ipv6fwoffset);
+		
+        // main mbuf header length of FW+IPv6+ICMP6
+		mbuf_pkthdr_setlen(m, mbuf_pkthdr_len(m)+ipv6fwoffset);
+        
+        // fix for <rdar://problem/3483512>: Developer: FireWire IPv6 header payload legnth value 0x28 may be incorrect
+        // mbuf header length of IPv6+ICMP6
+        if(pkthdrlen != 0)
+            mbuf_pkthdr_setlen(ipv6Mbuf, pkthdrlen+ipv6fwoffset);
+
+        ip6->ip6_plen = htons(icmp6len);
+        
+		if(incremental)
+			*icmp6_cksum = checksumAdjust(*icmp6_cksum, oldSum, checksumSum(ipv6Mbuf, optOffset, sizeof(IP1394_NDP)) + icmp6len);
+		else
+			mbuf_inet6_cksum(ipv6Mbuf, IPPROTO_ICMPV6, offset, icmp6len, icmp6_cksum);
+	}
+	
+	return ret;
+}
+
+bool IOFWIPBusInterface::updateNDPCache(mbuf_t m)
+{
+	bool result = false;
+
+	if(not (mbuf_flags(m) & MBUF_PKTHDR))
+	{
+		return result;
+	}
+	
+	mbuf_t ipv6Mbuf = m;
+	int fwhdrlen	= sizeof(firewire_header);
+    int pkthdrlen	= 0;
+	
+	// check whether len equals ether header
+	if(mbuf_len(m) == sizeof(firewire_header))
+	{
+		ipv6Mbuf = mbuf_next(m);
+		if(ipv6Mbuf == NULL)
+		{
+			return result ;
+		}
+
+		fwhdrlen = 0;
+        pkthdrlen	= mbuf_pkthdr_len(ipv6Mbuf);
+	}
+
+	vm_address_t src = (vm_offset_t)mbuf_data(ipv6Mbuf);
+	if(src == 0)
+	{
+		return result;
+	}
+
+	if(mbuf_len(ipv6Mbuf) < (sizeof(struct ip6_hdr) + fwhdrlen))
+	{
+		return result;
+	}
+
+	// no space in mbuf
+	if(mbuf_trailingspace(ipv6Mbuf) < (int)sizeof(IP1394_NDP))
+	{
+		return result;
+	}
+
+	// show type of ICMPV6 packets being sent
+	struct ip6_hdr		*ip6		= (struct ip6_hdr*)((UInt8*)src + fwhdrlen);
+	struct icmp6_hdr	*icp		= (struct icmp6_hdr*)(ip6 + 1);
+	struct nd_neighbor_advert	*nd_na	= (struct nd_neighbor_advert*)icp;
+	struct nd_neighbor_solicit	*nd_ns	= (struct nd_neighbor_solicit*)icp;
+
+	int		offset	= sizeof(*ip6);
+
+	IP1394_NDP	*fwndp	= NULL;
+	bool		modify  = false;
+
+    u_int16_t	*icmp6_cksum = NULL;
+
+	if(nd_ns->nd_ns_type == ND_NEIGHBOR_SOLICIT)
+	{		
+		// neighbor solicitation
+		fwndp = (IP1394_NDP*)((UInt8*)nd_ns + sizeof(struct nd_neighbor_solicit));
+		if(fwndp->type == 1)
+		{
+			modify = true;
+            icmp6_cksum = &nd_ns->nd_ns_cksum;
+		}
+	}
+	
+	if(nd_na->nd_na_type == ND_NEIGHBOR_ADVERT)
+	{
+		// neighbor advertisment
+		fwndp =  (IP1394_NDP*)((UInt8*)nd_na + sizeof(struct nd_neighbor_advert));
+		
+		if(fwndp->type == 2)
+		{
+			modify = true;
+            icmp6_cksum = &nd_na->nd_na_cksum;
+		}
+	}
+    
+	ARB			*arb	= NULL;
+	
+	if(modify && fwndp != NULL && fwndp->len > 2)
+	{
+		arb = getArbFromFwAddr(fwndp->lladdr);
+		
+		if(arb != NULL)
+		{
+			bcopy(fwndp->lladdr, &arb->eui64, kIOFWAddressSize);
+			arb->eui64.hi = OSSwapHostToBigInt32(arb->eui64.hi);
+			arb->eui64.lo = OSSwapHostToBigInt32(arb->eui64.lo);            
+			bcopy(fwndp->lladdr, arb->fwaddr, kIOFWAddressSize);
+			arb->handle.unicast.maxRec = fwndp->senderMaxRec;
+			arb->handle.unicast.spd = fwndp->sspd;
+			arb->handle.unicast.unicastFifoHi = htons(fwndp->senderUnicastFifoHi);
+			arb->handle.unicast.unicastFifoLo = htonl(fwndp->senderUnicastFifoLo); 
+			arb->handle.unicast.deviceID = getDeviceID(arb->eui64, &arb->itsMac);
+
+			UInt32	optOffset	= (UInt8*)fwndp - (UInt8*)src;
+			UInt32	optLen		= fwndp->len * 8;
+			UInt32	oldSum		= 0;
+
+			// The checksum is patched when the 8 bytes trimmed are the option's, the usual case
+			bool incremental = (optOffset + optLen == fwhdrlen + sizeof(*ip6) + ntohs(ip6->ip6_plen))
+								and (optLen == sizeof(IP1394_NDP));
+
+			if(incremental)
+				oldSum = checksumSum(ipv6Mbuf, optOffset, optLen) + ntohs(ip6->ip6_plen);
+
+			// Reset the packet
+			fwndp->len = 2;       	// len in units of 8 octets
+			fwndp->senderMaxRec = 0;
+			fwndp->sspd = 0;
+			fwndp->senderUnicastFifoHi = 0;
+			fwndp->senderUnicastFifoLo = 0;
+            			
+			// Adjust header, so the checksum becomes right.
+			mbuf_adj(ipv6Mbuf, fwhdrlen);
+			
+            // current mbuf length IPv6+ICMP6
+			mbuf_setlen(ipv6Mbuf, mbuf_len(ipv6Mbuf)-8);
+			
+            // main mbuf header length of FW+IPv6+ICMP6
+            mbuf_pkthdr_setlen(m, mbuf_pkthdr_len(m)-8);
+            
+            // fix for <rdar://problem/3483512>: Developer: FireWire IPv6 header payload legnth value 0x28 may be incorrect
+            // mbuf header length of IPv6+ICMP6
+            if(pkthdrlen != 0)
+				mbuf_pkthdr_setlen(ipv6Mbuf, mbuf_pkthdr_len(ipv6Mbuf)-8);
+    
+			int	icmp6len = ntohs(ip6->ip6_plen) - 8;
+    
+            ip6->ip6_plen = htons(icmp6len);
+            
+			// A corrupted packet stays corrupted, unlike with a full recompute
+			if(incremental)
+				*icmp6_cksum = checksumAdjust(*icmp6_cksum, oldSum, checksumSum(ipv6Mbuf, optOffset - fwhdrlen, optLen - 8) + icmp6len);
+			else
+			{
+				*icmp6_cksum = 0xFFFF;
+				mbuf_inet6_cksum(ipv6Mbuf, IPPROTO_ICMPV6, offset, icmp6len, icmp6_cksum);
+			}
+			result = true;							
+		}
+	}
+	
+	return result;
+}
+
+void IOFWIPBusInterface::updateNDPCache(void *buf, UInt16	*len)
+{
+	struct icmp6_hdr			*icp	= NULL;
+	struct ip6_hdr				*ip6;
+	struct nd_neighbor_advert	*nd_na	= NULL;
+	struct nd_neighbor_solicit	*nd_ns	= NULL;
+	
+	ARB			*arb	= NULL;
+	IP1394_NDP	*fwndp	= NULL;
+	bool		update  = false;
+	
+	ip6		= (struct ip6_hdr*)buf;
+	icp		= (struct icmp6_hdr*)(ip6 + 1);
+	nd_na	= (struct nd_neighbor_advert*)icp;
+	nd_ns	= (struct nd_neighbor_solicit*)icp;
+
+	if(nd_ns->nd_ns_type == ND_NEIGHBOR_SOLICIT)
+	{		
+		// neighbor solicitation
+		fwndp = (IP1394_NDP*)((UInt8*)nd_ns + sizeof(struct nd_neighbor_solicit));
+		if(fwndp->type == 1)
+		{
+			update = true;
+		}
+	}
+	
+	if(nd_na->nd_na_type == ND_NEIGHBOR_ADVERT)
+	{
+		// neighbor advertisment
+		fwndp =  (IP1394_NDP*)((UInt8*)nd_na + sizeof(struct nd_neighbor_advert));
+		if(fwndp->type == 2)
+		{
+			update = true;
+		}
+	}
+	
+	if(update && fwndp != NULL && fwndp->len > 2)
+	{
+		arb = getArbFromFwAddr(fwndp->lladdr);
+		
+		if(arb != NULL)
+		{
+			bcopy(fwndp->lladdr, &arb->eui64, kIOFWAddressSize);
+			arb->eui64.hi = OSSwapHostToBigInt32(arb->eui64.hi);
+			arb->eui64.lo = OSSwapHostToBigInt32(arb->eui64.lo);            
+			bcopy(fwndp->lladdr, arb->fwaddr, kIOFWAddressSize);
+			arb->handle.unicast.maxRec = fwndp->senderMaxRec;
+			arb->handle.unicast.spd = fwndp->sspd;
+			arb->handle.unicast.unicastFifoHi = htons(fwndp->senderUnicastFifoHi);
+			arb->handle.unicast.unicastFifoLo = htonl(fwndp->senderUnicastFifoLo); 
+			arb->handle.unicast.deviceID = getDeviceID(arb->eui64, &arb->itsMac);
+
+			// Reset the packet
+			*len -= 8;
+			fwndp->len = 2;       	// len in units of 8 octets
+			fwndp->senderMaxRec = 0;
+			fwndp->sspd = 0;
+			fwndp->senderUnicastFifoHi = 0;
+			fwndp->senderUnicastFifoLo = 0;
+		}
+	}
+
+	return;
+}
+
+#pragma mark -
+#pragma mark  IOFWIPBusInterface utility routines  
+
+bool IOFWIPBusInterface::staticUpdateMulticastCache(void *refcon, IOFWAddress *addrs, UInt32 count)
+{
+	return ((IOFWIPBusInterface*)refcon)->updateMulticastCache(addrs, count);
+}
+
+UInt32	IOFWIPBusInterface::staticOutputPacket(mbuf_t pkt, void * param)
+{
+	return ((IOFWIPBusInterface*)param)->outputPacket(pkt,param);
+}
+
+bool IOFWIPBusInterface::wellKnownMulticastAddress(IOFWAddress *addr)
+{
+	// if well know IPv4 multicast address then return true
+	bool found = (memcmp(addr->bytes, IPv4KnownMcastAddresses, sizeof(IPv4KnownMcastAddresses)) == 0) ? true : false;
+
+	if(not found)
+	{
+		if(addr->bytes[0] == 0xff) // check if its a IPv6 multicast address
+		{
+			found = true;
+
+			if(addr->bytes[1] & BIT_SET(4))
+				found = false;
+			else 		// if Transient Flag not set then well known IPv6 multicast address
+				found = true;
+
+			// Solicited node groups are permanent too and stay on channel 31, a single
+			// DAD or ND packet would otherwise cost an isochronous channel at the IRM
+		}
+	}
+
+	return found;
+}
+
+bool IOFWIPBusInterface::updateMulticastCache(IOFWAddress *addrs, UInt32 count)
+{
+	OSSet	*newMulticastAddresses 	= OSSet::withCapacity(kMulticastArbs);
+	
+	if(newMulticastAddresses == 0)
+		return false;
+
+	// Find if the addresses are in mulicast ARB cache
+    IORecursiveLockLock(fIPLock);
+
+	mcastFilterUpdate(addrs, count);
+	
+	IOFWAddress	*tempAddresses	= addrs;
+	UInt32		tempCount		= count;
+	
+	MARB *arb = NULL;
+	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( multicastArb );
+	bool found = false;
+
+	if ( iterator ) 
+	{
+		while(tempCount)
+		{
+			found = false;
+
+			// IPv6 groups keep the link address bytes in place, matched through FIREWIRE_MAP_IPV6_MULTICAST
+			UInt8	newGroup6[16];
+			UInt8	newGroupType = (tempAddresses->bytes[0] == ipv6multicast[0]) ? MCAST_TYPE_IPV6 : MCAST_TYPE;
+
+			if( newGroupType == MCAST_TYPE_IPV6 )
+				mcapGroup6(tempAddresses->bytes, newGroup6);
+			
+			while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
+			{
+				UInt32 newGroupAddress = 0;
+				
+				memcpy(&newGroupAddress, &tempAddresses->bytes[4], sizeof(newGroupAddress));
+				
+				found = ( arb->handle.multicast.groupAddress == newGroupAddress )  ? true : false;
+
+				if( found and (newGroupType != arb->groupType) )
+					found = false;
+				else if( found and (newGroupType == MCAST_TYPE_IPV6) )
+				{
+					UInt8 fwaddr[FIREWIRE_ADDR_LEN];
+					FIREWIRE_MAP_IPV6_MULTICAST(arb->group6, fwaddr);
+					found = (memcmp(fwaddr, tempAddresses->bytes, sizeof(fwaddr)) == 0);
+				}
+				
+				if(found) break;
+			}
+
+			iterator->reset();
+
+			 // if not found, its a new address and not a well known multicast group address
+			if( (not found) and  (not wellKnownMulticastAddress(tempAddresses)) )
+			{
+				MARB *tempArb = new MARB;
+				
+				if(tempArb)
+				{
+					tempArb->handle.multicast.deviceID		= 0;								// Always zero
+					tempArb->handle.multicast.maxRec		= fLcb->ownHardwareAddress.maxRec;	// Maximum asynchronous payload
+					tempArb->handle.multicast.spd			= fLcb->ownHardwareAddress.spd;		// Maximum speed
+					tempArb->handle.multicast.reserved		= 0;
+					tempArb->handle.multicast.channel		= DEFAULT_BROADCAST_CHANNEL;		// Channel number for GASP transmit / receive
+					memcpy(&tempArb->handle.multicast.groupAddress, &tempAddresses->bytes[4], 
+								sizeof(tempArb->handle.multicast.groupAddress));
+					tempArb->groupType						= newGroupType;
+					tempArb->group6Known					= false;		// Learned when we send to it or it is advertised
+					if( newGroupType == MCAST_TYPE_IPV6 )
+						memcpy(tempArb->group6, newGroup6, sizeof(tempArb->group6));
+					
+					newMulticastAddresses->setObject(tempArb);  
+				}
+			}
+			
+			tempAddresses++;
+			tempCount--;
+		}
+		
+		iterator->release();
+	}
+	
+
+	// Add from newMulticastAddresses to original cache
+	iterator = OSCollectionIterator::withCollection( newMulticastAddresses );
+	
+	if ( iterator )
+	{
+		while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
+		{
+			newMulticastAddresses->removeObject(arb);
+			multicastArb->setObject(arb);
+			
+			// If its a new multicast address, then send a solicitation request.
+			txMCAP(0, arb);
+		}
+		iterator->release();
+	}
+	
+	newMulticastAddresses->flushCollection();
+	newMulticastAddresses->free();
+	
+    IORecursiveLockUnlock(fIPLock);
+
+	return true;
+}
+
+/*!
+	@function mcastFilterHash
+	@abstract FNV-1a of a multicast link address, two filter bits come from it.
+*/
+static UInt32 mcastFilterHash(const UInt8 *fwaddr)
+{
+	UInt32 hash = 2166136261U;
+
+	for( UInt32 i = 0; i < kIOFWAddressSize; i++ )
+		hash = (hash ^ fwaddr[i]) * 16777619U;
+
+	return hash;
+}
+
+void IOFWIPBusInterface::mcastFilterUpdate(IOFWAddress *addrs, UInt32 count)
+{
+	recursiveScopeLock lock(fIPLock);
+
+	// The stack hands over its whole list each time, so start from empty
+	memset(fMcastFilter, 0, sizeof(fMcastFilter));
+
+	for( UInt32 i = 0; i < count; i++ )
+	{
+		UInt32 hash = mcastFilterHash(addrs[i].bytes);
+
+		fMcastFilter[(hash & 0xFF) >> 5]		|= 1 << (hash & 0x1F);
+		fMcastFilter[((hash >> 8) & 0xFF) >> 5]	|= 1 << ((hash >> 8) & 0x1F);
+	}
+
+	fMcastFilterValid = true;
+}
+
+bool IOFWIPBusInterface::rxMcastFilter(const void *datagram, UInt32 len, UInt16 type)
+{
+	const UInt8	*ip = (const UInt8*)datagram;
+	UInt8		fwaddr[kIOFWAddressSize];
+
+	if( (not fMcastFilterValid) or fIPLocalNode->isPromiscuous )
+		return true;
+
+	// Same link address the stack resolved the group to when joining
+	if( (type == FWTYPE_IP) and (len >= sizeof(struct ip)) and IN_MULTICAST(ntohl(((const struct ip*)ip)->ip_dst.s_addr)) )
+	{
+		FIREWIRE_MAP_IP_MULTICAST(&((const struct ip*)ip)->ip_dst, fwaddr);
+	}
+	else if( (type == FWTYPE_IPV6) and (len >= sizeof(struct ip6_hdr)) and IN6_IS_ADDR_MULTICAST(&((const struct ip6_hdr*)ip)->ip6_dst) )
+	{
+		FIREWIRE_MAP_IPV6_MULTICAST(&((const struct ip6_hdr*)ip)->ip6_dst, fwaddr);
+	}
+	else
+		return true;		// Broadcast and malformed datagrams go on as before
+
+	UInt32 hash = mcastFilterHash(fwaddr);
+
+	return ( (fMcastFilter[(hash & 0xFF) >> 5] & (1 << (hash & 0x1F))) and
+			 (fMcastFilter[((hash >> 8) & 0xFF) >> 5] & (1 << ((hash >> 8) & 0x1F))) );
+}
+
+/*!
+	@function updateARPCache
+	@abstract updates IPv4 ARP cache from the incoming ARP packet 
+	@param fwa - firewire ARP packet.
+	@result void.
+*/
+bool IOFWIPBusInterface::updateARPCache(IP1394_ARP *fwa)
+{
+    ARB		*fwarb	= NULL;
+	UWIDE	eui64;
+	
+    IORecursiveLockLock(fIPLock);
+
+	eui64.hi = htonl(fwa->senderUniqueID.hi);	
+	eui64.lo = htonl(fwa->senderUniqueID.lo);
+
+	// Get the arb pointer from sdl->data
+	fwarb = getARBFromEui64(eui64);
+
+	if(fwarb)
+	{
+		fwarb->handle.unicast.maxRec = fwa->senderMaxRec; // Volatile fields
+		fwarb->handle.unicast.spd = fwa->sspd;
+		fwarb->handle.unicast.unicastFifoHi = htons(fwa->senderUnicastFifoHi);
+		fwarb->handle.unicast.unicastFifoLo = htonl(fwa->senderUnicastFifoLo);
+		fwarb->eui64.hi = eui64.hi;	
+		fwarb->eui64.lo = eui64.lo;
+		fwarb->handle.unicast.deviceID = getDeviceID(fwarb->eui64, &fwarb->itsMac);    
+
+		fIPLocalNode->getBytesFromGUID(&fwarb->eui64, fwarb->fwaddr, 0);
+	}
+	
+	IORecursiveLockUnlock(fIPLock);
+	
+	return true;
+}
+
+ARB *IOFWIPBusInterface::updateARBwithDevice(IOFireWireNub *device, UWIDE eui64)
+{
+    IORecursiveLockLock(fIPLock);
+
+	// Create the arb if we recognise a IP unit.
+	ARB *arb = getARBFromEui64(eui64);
+
+	// Update the device object in the address resolution block used in the ARP resolve routine
+	if(arb != NULL)
+	{
+		arb->handle.unicast.deviceID	= device;
+		arb->handle.unicast.maxRec		= device->maxPackLog(true); 
+		arb->handle.unicast.spd			= device->FWSpeed();
+		arb->itsMac = false;
+		arb->eui64.hi = eui64.hi;	
+		arb->eui64.lo = eui64.lo;
+		fIPLocalNode->getBytesFromGUID(&eui64, arb->fwaddr, 0);
+	}
+
+	IORecursiveLockUnlock(fIPLock);
+
+	return arb;
+}
+
+/*!
+	@function cleanFWRcbCache
+	@abstract cleans the Link control block's stale rcb's. UnAssembled RCB's
+				are returned to the free CBLKs
+	@param none.
+	@result void.
+*/
+void IOFWIPBusInterface::cleanRCBCache()
+{
+    IORecursiveLockLock(fIPLock);
+
+	RCB *rcb = 0;
+	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( activeRcb );
+	if( iterator )
+	{
+		while( NULL != (rcb = OSDynamicCast(RCB, iterator->getNextObject())) )
+		{
+			if(rcb->timer > 1)
+				rcb->timer--; // still reassembling packets
+			else if (rcb->timer == 1) 
+				releaseRCB(rcb);
+		}
+		iterator->release();
+	}
+	
+    IORecursiveLockUnlock(fIPLock);
+}
+
+/*!
+	@function getDeviceID
+	@abstract returns a fireWire device object for the GUID
+	@param lcb - the firewire link control block for this interface.
+    @param eui64 - global unique id of a device on the bus.
+    @param itsMac - destination is Mac or not.
+	@result Returns IOFireWireNub if successfull else 0.
+*/
+void* IOFWIPBusInterface::getDeviceID(UWIDE eui64, bool *itsMac) {  
+
+    // Returns DRB if EUI-64 matches
+    DRB *drb = getDrbFromEui64(eui64);   
+
+    // Device reference ID already created
+    if (drb != NULL) 
+	{              
+		*itsMac = drb->itsMac;
+        // Just return it to caller
+        return(drb->deviceID);        
+    }
+    else 
+	{
+		*itsMac = false;
+        // Get an empty DRB
+        return(NULL);
+    }
+}
+
+void IOFWIPBusInterface::releaseDRB(UInt8 *fwaddr)
+{
+    IORecursiveLockLock(fIPLock);
+
+	DRB *drb = NULL;
+	bool released = false;
+	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( activeDrb );
+	if( iterator )
+	{
+		while( NULL != (drb = OSDynamicCast(DRB, iterator->getNextObject())) )
+		{
+			if (bcmp(fwaddr, drb->fwaddr, kIOFWAddressSize) == 0)
+			{
+				drbAccount(drb, false);
+				drb->deviceID = NULL;  // Don't notify in future
+				activeDrb->removeObject(drb);			// time to clean up
+				drb->release();
+				released = true;
+			}
+		}
+		iterator->release();
+	}
+
+	// The slowest device may have left
+	if( released )
+		updateBroadcastValues(false);
+	
+    IORecursiveLockUnlock(fIPLock);
+}
+
+void IOFWIPBusInterface::releaseARB(UInt8 *fwaddr)
+{
+    IORecursiveLockLock(fIPLock);
+
+	ARB *arb = NULL;
+	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( unicastArb );
+
+	if( iterator )
+	{
+		while( NULL != (arb = OSDynamicCast(ARB, iterator->getNextObject())) )
+		{
+			if (bcmp(fwaddr, arb->fwaddr, kIOFWAddressSize) == 0)
+			{
+				arb->handle.unicast.deviceID = NULL;
+				unicastArb->removeObject(arb);
+				arb->release();
+			}
+		}
+						
+		iterator->release();
+	}
+	
+    IORecursiveLockUnlock(fIPLock);
+}
+
+void IOFWIPBusInterface::releaseRCB(RCB *rcb, bool freeMbuf)
+{
+    IORecursiveLockLock(fIPLock);
+
+	if(freeMbuf && rcb->mBuf != NULL)
+	{
+		fIPLocalNode->freePacket(rcb->mBuf, 0);
+		rcb->mBuf = NULL;
 	}
+	activeRcb->removeObject(rcb);
+	fRCBCmdPool->returnCommand(rcb);
 
-	return found;
-}
+    IORecursiveLockUnlock(fIPLock);
+}   
 
-bool IOFWIPBusInterface::updateMulticastCache(IOFWAddress *addrs, UInt32 count)
+void IOFWIPBusInterface::updateMcapState()
 {
-	OSSet	*newMulticastAddresses 	= OSSet::withCapacity(kMulticastArbs);
-	
-	if(newMulticastAddresses == 0)
-		return false;
+	bool	schedule = false;
 
-	// Find if the addresses are in mulicast ARB cache
     IORecursiveLockLock(fIPLock);
-	
-	IOFWAddress	*tempAddresses	= addrs;
-	UInt32		tempCount		= count;
-	
-	MARB *arb = NULL;
-	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( multicastArb );
-	bool found = false;
 
-	if ( iterator ) 
+	MCB		*mcb		= NULL;
+	UInt64	active		= fMCAPActive;
+	UInt64	advertise	= 0;
+
+	// Only the channels with an advertisement to age or one of ours to send
+	while( active != 0 )
 	{
-		while(tempCount)
+		UInt32 channel = __builtin_ctzll(active);
+		active &= active - 1;
+
+		mcb = OSDynamicCast(MCB, mcapState->getObject(channel));
+		if( mcb == NULL )
 		{
-			found = false;
-			
-			while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
+			fMCAPActive &= ~(1ULL << channel);
+			continue;
+		}
+
+		if (mcb->txIdle < kMCAPExpiration)
+			mcb->txIdle++;				// Seconds since we last sent on this channel
+
+		// for active mcb's check and relinquich resources
+		if (mcb->expiration > 1)		// Life in this channel allocation yet?
+			mcb->expiration--;			// Yes, but the clock is ticking...
+		else if (mcb->expiration == 1)	// Dead in the water?
+		{ 
+			mcb->expiration = 0;        // Yes, mark it expired
+			if (mcb->owned)				// We own the channel?
+			{  
+				mcb->finalWarning = 4;  // Yes, four final advertisements, groups stay on it meanwhile
+				mcb->nextTransmit = 1;  // Starting right now... 
+			}
+			else
 			{
-				UInt32 newGroupAddress = 0;
-				
-				memcpy(&newGroupAddress, &tempAddresses->bytes[4], sizeof(newGroupAddress));
-				
-				found = ( arb->handle.multicast.groupAddress == newGroupAddress )  ? true : false;
-				
-				if(found) break;
+				if (mcb->groupCount > 0)
+					mcb->groupCount--;
+					
+				IOFWAsyncStreamListener *asyncStreamRxClient = OSDynamicCast(IOFWAsyncStreamListener, mcb->asyncStreamID);
+				if(asyncStreamRxClient != NULL)
+				{
+					fControl->removeAsyncStreamListener( asyncStreamRxClient );
+					asyncStreamRxClient->release();
+				}
+
+				mcb->asyncStreamID = NULL;
+				releaseMulticastARB(mcb);
 			}
+		}
+		
+		// If we own this channel, then proceed below
+		if (not mcb->owned)
+		{
+			if (mcb->expiration == 0)
+				fMCAPActive &= ~(1ULL << channel);	// Nothing left to age
+			continue;                     // Cycle to next active channel 
+		}
 
-			iterator->reset();
+		// Old owner's advertisement ran out or our last allocation attempt was early, try the IRM again
+		if ((mcb->irmHoldoff > 0) and (--mcb->irmHoldoff == 0))
+		{
+			mcb->irmReclaim = true;
+			schedule		= true;
+		}
 
-			 // if not found, its a new address and not a well known multicast group address
-			if( (not found) and  (not wellKnownMulticastAddress(tempAddresses)) )
+		if (mcb->nextTransmit > 1)  // Time left before next transmit? 
+			mcb->nextTransmit--;                         // Keep on ticking... 
+		else if (mcb->nextTransmit == 1) 
+		{              // Due to expire now? 
+			// Renew this channel's lease while we still send to its groups
+			if ((mcb->groupCount > 0) and (mcb->txIdle < kMCAPExpiration))
 			{
-				MARB *tempArb = new MARB;
+				mcb->expiration		= kMCAPExpiration;
+				mcb->finalWarning	= 0;
+			}
 				
-				if(tempArb)
+			advertise |= (1ULL << channel);	// Broadcast the MCAP advertisement, with the others due now
+			
+			if (mcb->expiration > 0)
+				mcb->nextTransmit = 10;    // Send MCAP again in ten seconds 
+			else if (--mcb->finalWarning > 0)
+				mcb->nextTransmit = 10;    // Channel deallocation warning 
+			else 
+			{
+				// Last warning has to go before the groups leave the channel
+				txMCAPAdvertise(1ULL << channel);
+				advertise &= ~(1ULL << channel);
+
+				if (mcapRelinquish(mcb))  // We're really, really done! 
+					schedule = true;
+			}
+		}
+	}
+
+	if (advertise != 0)
+	{
+		fMCAPReplied |= advertise;
+		txMCAPAdvertise(advertise);
+	}
+
+	// Groups waiting on a solicit or a failed allocation
+	if( fMCAPArbTimers )
+	{
+		MARB	*arb		= NULL;
+		bool	pending		= false;
+
+		OSCollectionIterator * iterator = OSCollectionIterator::withCollection( multicastArb );
+		if( iterator )
+		{
+			while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
+			{
+				if( (arb->mcapPhase == MCAP_PHASE_SOLICIT) and (arb->handle.multicast.channel != DEFAULT_BROADCAST_CHANNEL) )
+					arb->mcapPhase = MCAP_PHASE_IDLE;			// An owner answered
+				else if( (arb->mcapPhase == MCAP_PHASE_SOLICIT) and (--arb->mcapTimer == 0) )
 				{
-					tempArb->handle.multicast.deviceID		= 0;								// Always zero
-					tempArb->handle.multicast.maxRec		= fLcb->ownHardwareAddress.maxRec;	// Maximum asynchronous payload
-					tempArb->handle.multicast.spd			= fLcb->ownHardwareAddress.spd;		// Maximum speed
-					tempArb->handle.multicast.reserved		= 0;
-					tempArb->handle.multicast.channel		= DEFAULT_BROADCAST_CHANNEL;		// Channel number for GASP transmit / receive
-					memcpy(&tempArb->handle.multicast.groupAddress, &tempAddresses->bytes[4], 
-								sizeof(tempArb->handle.multicast.groupAddress));
-					
-					newMulticastAddresses->setObject(tempArb);  
+					arb->mcapPhase = MCAP_PHASE_ALLOCATE;		// Nobody did, allocate a channel ourselves
+					schedule = true;
 				}
+				else if( (arb->mcapPhase == MCAP_PHASE_HOLDOFF) and (--arb->mcapTimer == 0) )
+					arb->mcapPhase = MCAP_PHASE_IDLE;
+
+				pending |= (arb->mcapPhase == MCAP_PHASE_SOLICIT) or (arb->mcapPhase == MCAP_PHASE_HOLDOFF);
 			}
-			
-			tempAddresses++;
-			tempCount--;
+			iterator->release();
 		}
-		
-		iterator->release();
+
+		fMCAPArbTimers = pending;
 	}
 	
+    IORecursiveLockUnlock(fIPLock);
 
-	// Add from newMulticastAddresses to original cache
-	iterator = OSCollectionIterator::withCollection( newMulticastAddresses );
-	
-	if ( iterator )
+	if( schedule )
+		mcapSchedule();
+}
+
+bool IOFWIPBusInterface::mcapRelinquish(MCB *mcb)
+{
+	recursiveScopeLock lock(fIPLock);
+
+	MARB *arb = NULL;
+	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( multicastArb );
+	if( iterator )
 	{
 		while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
 		{
-			newMulticastAddresses->removeObject(arb);
-			multicastArb->setObject(arb);
-			
-			// If its a new multicast address, then send a solicitation request.
-			txMCAP(0, arb->handle.multicast.groupAddress);
+			if (arb->handle.multicast.channel == mcb->channel)
+			{
+				arb->handle.multicast.channel	= DEFAULT_BROADCAST_CHANNEL;
+				arb->mcapPhase					= MCAP_PHASE_IDLE;
+			}
 		}
 		iterator->release();
 	}
-	
-	newMulticastAddresses->flushCollection();
-	newMulticastAddresses->free();
-	
-    IORecursiveLockUnlock(fIPLock);
 
-	return true;
+	fMCAPGroupGen++;
+
+	if( mcb->advert != NULL )
+	{
+		mcb->advert->release();
+		mcb->advert = NULL;
+	}
+
+	IOFWAsyncStreamListener *asyncStreamRxClient = OSDynamicCast(IOFWAsyncStreamListener, mcb->asyncStreamID);
+	if(asyncStreamRxClient != NULL)
+	{
+		fControl->removeAsyncStreamListener( asyncStreamRxClient );
+		asyncStreamRxClient->release();
+	}
+
+	mcb->asyncStreamID	= NULL;
+	mcb->groupCount		= 0;
+	mcb->ownerNodeID	= MCAP_UNOWNED;		// Reliquish our ownership 
+	mcb->owned			= false;
+	mcb->irmReclaim		= false;
+	mcb->irmHoldoff		= 0;
+	mcb->irmRetries		= 0;
+	mcb->expiration		= 0;
+	mcb->nextTransmit	= 0;
+	mcb->finalWarning	= 0;
+	mcb->irmRelease		= (mcb->irmAllocation != NULL);
+
+	fMCAPActive &= ~(1ULL << mcb->channel);
+
+	return mcb->irmRelease;
 }
 
-/*!
-	@function updateARPCache
-	@abstract updates IPv4 ARP cache from the incoming ARP packet 
-	@param fwa - firewire ARP packet.
-	@result void.
-*/
-bool IOFWIPBusInterface::updateARPCache(IP1394_ARP *fwa)
+void IOFWIPBusInterface::mcapDisown(MCB *mcb)
 {
-    ARB		*fwarb	= NULL;
-	UWIDE	eui64;
-	
-    IORecursiveLockLock(fIPLock);
+	IOFireWireIRMAllocation *allocation = OSDynamicCast(IOFireWireIRMAllocation, mcb->irmAllocation);
+
+	mcb->irmAllocation	= NULL;
+	mcb->owned			= false;
+	mcb->irmRelease		= false;
+	mcb->irmReclaim		= false;
+	mcb->irmHoldoff		= 0;
+	mcb->irmRetries		= 0;
+	mcb->nextTransmit	= 0;
+	mcb->finalWarning	= 0;
+
+	if( mcb->advert != NULL )
+	{
+		mcb->advert->release();
+		mcb->advert = NULL;
+	}
 
-	eui64.hi = htonl(fwa->senderUniqueID.hi);	
-	eui64.lo = htonl(fwa->senderUniqueID.lo);
+	// Created not to release on free, the new owner keeps the channel
+	if( allocation != NULL )
+		allocation->release();
+}
 
-	// Get the arb pointer from sdl->data
-	fwarb = getARBFromEui64(eui64);
+void IOFWIPBusInterface::mcapBusReset()
+{
+	bool schedule = false;
 
-	if(fwarb)
+	IORecursiveLockLock(fIPLock);
+
+	MCB	*mcb = NULL;
+	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( mcapState );
+	if( iterator )
 	{
-		fwarb->handle.unicast.maxRec = fwa->senderMaxRec; // Volatile fields
-		fwarb->handle.unicast.spd = fwa->sspd;
-		fwarb->handle.unicast.unicastFifoHi = htons(fwa->senderUnicastFifoHi);
-		fwarb->handle.unicast.unicastFifoLo = htonl(fwa->senderUnicastFifoLo);
-		fwarb->eui64.hi = eui64.hi;	
-		fwarb->eui64.lo = eui64.lo;
-		fwarb->handle.unicast.deviceID = getDeviceID(fwarb->eui64, &fwarb->itsMac);    
+		while( NULL != (mcb = OSDynamicCast(MCB, iterator->getNextObject())) )
+		{
+			if( not mcb->owned )
+				continue;
 
-		fIPLocalNode->getBytesFromGUID(&fwarb->eui64, fwarb->fwaddr, 0);
+			mcb->ownerNodeID	= fLcb->ownNodeID;	// Node IDs change with the reset
+			mcb->nextTransmit	= 1;
+
+			if( mcb->irmAllocation == NULL )
+			{
+				mcb->irmHoldoff	= 0;				// The old owner's allocation went with the reset
+				mcb->irmRetries	= 0;
+				mcb->irmReclaim	= true;
+				schedule		= true;
+			}
+		}
+		iterator->release();
 	}
-	
+
 	IORecursiveLockUnlock(fIPLock);
-	
-	return true;
+
+	if( schedule )
+		mcapSchedule();
 }
 
-ARB *IOFWIPBusInterface::updateARBwithDevice(IOFireWireNub *device, UWIDE eui64)
+void IOFWIPBusInterface::mcapSchedule()
 {
-    IORecursiveLockLock(fIPLock);
+	recursiveScopeLock lock(fIPLock);
 
-	// Create the arb if we recognise a IP unit.
-	ARB *arb = getARBFromEui64(eui64);
+	if( fMCAPThreadCall == NULL )
+		return;
 
-	// Update the device object in the address resolution block used in the ARP resolve routine
-	if(arb != NULL)
-	{
-		arb->handle.unicast.deviceID	= device;
-		arb->handle.unicast.maxRec		= device->maxPackLog(true); 
-		arb->handle.unicast.spd			= device->FWSpeed();
-		arb->itsMac = false;
-		arb->eui64.hi = eui64.hi;	
-		arb->eui64.lo = eui64.lo;
-		fIPLocalNode->getBytesFromGUID(&eui64, arb->fwaddr, 0);
-	}
+	retain();
+	if( thread_call_enter( fMCAPThreadCall ) )
+		release();		// Already pending, that run picks this up
+}
 
-	IORecursiveLockUnlock(fIPLock);
+void IOFWIPBusInterface::mcapThread(thread_call_param_t param0, thread_call_param_t param1)
+{
+	IOFWIPBusInterface *fwIPPriv = (IOFWIPBusInterface*)param0;
 
-	return arb;
+	fwIPPriv->mcapReleaseChannels();
+
+	fwIPPriv->mcapReclaimChannels();
+
+	fwIPPriv->mcapAllocateChannels();
+
+	fwIPPriv->release();
 }
 
-/*!
-	@function cleanFWRcbCache
-	@abstract cleans the Link control block's stale rcb's. UnAssembled RCB's
-				are returned to the free CBLKs
-	@param none.
-	@result void.
-*/
-void IOFWIPBusInterface::cleanRCBCache()
+void IOFWIPBusInterface::mcapReleaseChannels()
 {
-    IORecursiveLockLock(fIPLock);
+	for ( int channel = 0; channel < kMaxChannels; channel++ )
+	{
+		IOFireWireIRMAllocation *allocation = NULL;
 
-	RCB *rcb = 0;
-	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( activeRcb );
-	if( iterator )
+		IORecursiveLockLock(fIPLock);
+
+		MCB *mcb = (mcapState != NULL) ? OSDynamicCast(MCB, mcapState->getObject(channel)) : NULL;
+		if( (mcb != NULL) and mcb->irmRelease )
+		{
+			allocation			= OSDynamicCast(IOFireWireIRMAllocation, mcb->irmAllocation);
+			mcb->irmAllocation	= NULL;
+			mcb->irmRelease		= false;
+		}
+
+		IORecursiveLockUnlock(fIPLock);
+
+		if( allocation != NULL )
+		{
+			allocation->deallocateIsochResources();
+			allocation->release();
+		}
+	}
+}
+
+void IOFWIPBusInterface::mcapReclaimChannels()
+{
+	for ( int channel = 0; channel < kMaxChannels; channel++ )
 	{
-		while( NULL != (rcb = OSDynamicCast(RCB, iterator->getNextObject())) )
+		IOReturn	status		= kIOReturnNoMemory;
+		bool		reclaim		= false;
+
+		IORecursiveLockLock(fIPLock);
+
+		MCB *mcb = (mcapState != NULL) ? OSDynamicCast(MCB, mcapState->getObject(channel)) : NULL;
+		if( (mcb != NULL) and mcb->irmReclaim )
 		{
-			if(rcb->timer > 1)
-				rcb->timer--; // still reassembling packets
-			else if (rcb->timer == 1) 
-				releaseRCB(rcb);
+			mcb->irmReclaim	= false;
+			reclaim			= mcb->owned and (mcb->irmAllocation == NULL);
+		}
+
+		IORecursiveLockUnlock(fIPLock);
+
+		if( not reclaim )
+			continue;
+
+		IOFireWireIRMAllocation *allocation = fControl->createIRMAllocation( false, mcapAllocationLost, this );
+		if( allocation != NULL )
+			status = allocation->allocateIsochResources( channel, 0 );
+
+		IORecursiveLockLock(fIPLock);
+
+		if( mcb->owned and (mcb->irmAllocation == NULL) )
+		{
+			if( status == kIOReturnSuccess )
+			{
+				mcb->irmAllocation	= allocation;
+				mcb->irmRetries		= 0;
+				allocation			= NULL;
+			}
+			else if( mcb->irmRetries > 0 )
+			{
+				mcb->irmRetries--;
+				mcb->irmHoldoff		= kMCAPReclaimHoldoff;	// Old owner may not have released it yet
+			}
+			else
+				mcapRelinquish(mcb);		// Someone else has it now, no allocation of ours to release
+		}
+
+		IORecursiveLockUnlock(fIPLock);
+
+		if( allocation != NULL )
+		{
+			if( status == kIOReturnSuccess )
+				allocation->deallocateIsochResources();
+			allocation->release();
 		}
-		iterator->release();
 	}
-	
-    IORecursiveLockUnlock(fIPLock);
 }
 
-/*!
-	@function getDeviceID
-	@abstract returns a fireWire device object for the GUID
-	@param lcb - the firewire link control block for this interface.
-    @param eui64 - global unique id of a device on the bus.
-    @param itsMac - destination is Mac or not.
-	@result Returns IOFireWireNub if successfull else 0.
-*/
-void* IOFWIPBusInterface::getDeviceID(UWIDE eui64, bool *itsMac) {  
+void IOFWIPBusInterface::mcapAllocateChannels()
+{
+	for(;;)
+	{
+		MARB		*arb		= NULL;
+		MCB			*mcb		= NULL;
+		UInt64		candidates	= 0;
+		UInt32		channel		= 0;
+		IOReturn	status		= kIOReturnNoResources;
 
-    // Returns DRB if EUI-64 matches
-    DRB *drb = getDrbFromEui64(eui64);   
+		IORecursiveLockLock(fIPLock);
 
-    // Device reference ID already created
-    if (drb != NULL) 
-	{              
-		*itsMac = drb->itsMac;
-        // Just return it to caller
-        return(drb->deviceID);        
-    }
-    else 
-	{
-		*itsMac = false;
-        // Get an empty DRB
-        return(NULL);
-    }
-}
+		if( (not fStarted) or (mcapState == NULL) or (multicastArb == NULL) )
+		{
+			IORecursiveLockUnlock(fIPLock);
+			return;
+		}
 
-void IOFWIPBusInterface::releaseDRB(UInt8 *fwaddr)
-{
-    IORecursiveLockLock(fIPLock);
+		OSCollectionIterator * iterator = OSCollectionIterator::withCollection( multicastArb );
+		if( iterator )
+		{
+			while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
+			{
+				if( arb->mcapPhase == MCAP_PHASE_ALLOCATE )
+					break;
+			}
+			iterator->release();
+		}
 
-	DRB *drb = NULL;
-	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( activeDrb );
-	if( iterator )
-	{
-		while( NULL != (drb = OSDynamicCast(DRB, iterator->getNextObject())) )
+		if( arb != NULL )
 		{
-			if (bcmp(fwaddr, drb->fwaddr, kIOFWAddressSize) == 0)
+			arb->retain();
+			arb->mcapPhase = MCAP_PHASE_HOLDOFF;		// Unless the allocation works out
+			arb->mcapTimer = kMCAPHoldoff;
+			mcapArmGroups();
+
+			// Channels with no MCAP owner we know of
+			for ( channel = 0; channel < (UInt32)kMaxChannels; channel++ )
 			{
-				drb->deviceID = NULL;  // Don't notify in future
-				activeDrb->removeObject(drb);			// time to clean up
-				drb->release();
+				mcb = OSDynamicCast(MCB, mcapState->getObject(channel));
+				if( (channel != DEFAULT_BROADCAST_CHANNEL) and (mcb != NULL) and (not mcb->owned) 
+					and (mcb->expiration == 0) and (mcb->asyncStreamID == NULL) and (mcb->irmAllocation == NULL) )
+					candidates |= (1ULL << channel);
 			}
 		}
-		iterator->release();
-	}
-	
-    IORecursiveLockUnlock(fIPLock);
-}
 
-void IOFWIPBusInterface::releaseARB(UInt8 *fwaddr)
-{
-    IORecursiveLockLock(fIPLock);
+		IORecursiveLockUnlock(fIPLock);
 
-	ARB *arb = NULL;
-	OSCollectionIterator * iterator = OSCollectionIterator::withCollection( unicastArb );
+		if( arb == NULL )
+			break;
 
-	if( iterator )
-	{
-		while( NULL != (arb = OSDynamicCast(ARB, iterator->getNextObject())) )
+		// The IRM has the last word, isochronous users hold channels MCAP doesn't see
+		IOFireWireIRMAllocation *allocation = fControl->createIRMAllocation( false, mcapAllocationLost, this );
+		for ( channel = kMaxChannels; (allocation != NULL) and (channel-- > 0); )
 		{
-			if (bcmp(fwaddr, arb->fwaddr, kIOFWAddressSize) == 0)
+			if( (candidates & (1ULL << channel)) and (allocation->allocateIsochResources( channel, 0 ) == kIOReturnSuccess) )
 			{
-				arb->handle.unicast.deviceID = NULL;
-				unicastArb->removeObject(arb);
-				arb->release();
+				status = kIOReturnSuccess;
+				break;
 			}
 		}
-						
-		iterator->release();
+
+		IORecursiveLockLock(fIPLock);
+
+		mcb = (status == kIOReturnSuccess) ? OSDynamicCast(MCB, mcapState->getObject(channel)) : NULL;
+
+		// An owner may have advertised the group meanwhile, or it was dropped
+		if( (mcb != NULL) and (not mcb->owned) and (mcb->expiration == 0)
+			and multicastArb->containsObject(arb) and (arb->handle.multicast.channel == DEFAULT_BROADCAST_CHANNEL) )
+		{
+			if( (mcb->asyncStreamID != NULL) or (createAsyncStreamRxClient( arb->handle.multicast.spd, channel, mcb ) == kIOReturnSuccess) )
+			{
+				mcapArmChannel(mcb);
+				mcb->irmAllocation	= allocation;
+				mcb->owned			= true;
+				mcb->ownerNodeID	= fLcb->ownNodeID;
+				mcb->expiration		= kMCAPExpiration;
+				mcb->nextTransmit	= 1;				// Advertise it right away
+				mcb->finalWarning	= 0;
+				mcb->txIdle			= 0;
+				mcb->groupCount++;
+
+				arb->handle.multicast.channel	= channel;
+				arb->mcapPhase					= MCAP_PHASE_IDLE;
+				fMCAPGroupGen++;
+
+				allocation = NULL;
+				fIPLocalNode->fIPoFWDiagnostics.fMCAPChannelsAllocated++;
+			}
+		}
+		else if( status != kIOReturnSuccess )
+			fIPLocalNode->fIPoFWDiagnostics.fMCAPAllocationFailures++;
+
+		IORecursiveLockUnlock(fIPLock);
+
+		// Not needed after all
+		if( allocation != NULL )
+		{
+			if( status == kIOReturnSuccess )
+				allocation->deallocateIsochResources();
+			allocation->release();
+		}
+
+		arb->release();
 	}
-	
-    IORecursiveLockUnlock(fIPLock);
 }
 
-void IOFWIPBusInterface::releaseRCB(RCB *rcb, bool freeMbuf)
+IOReturn IOFWIPBusInterface::mcapAllocationLost(void *refCon, IOFireWireIRMAllocation *allocation)
 {
-    IORecursiveLockLock(fIPLock);
+	IOFWIPBusInterface	*fwIPPriv = (IOFWIPBusInterface*)refCon;
+	bool				schedule = false;
 
-	if(freeMbuf && rcb->mBuf != NULL)
+	IORecursiveLockLock(fwIPPriv->fIPLock);
+
+	for ( int channel = 0; (fwIPPriv->mcapState != NULL) and (channel < kMaxChannels); channel++ )
 	{
-		fIPLocalNode->freePacket(rcb->mBuf, 0);
-		rcb->mBuf = NULL;
+		MCB *mcb = OSDynamicCast(MCB, fwIPPriv->mcapState->getObject(channel));
+		if( (mcb != NULL) and (mcb->irmAllocation == allocation) )
+		{
+			// Released on the thread, never from within its own callout
+			schedule = fwIPPriv->mcapRelinquish(mcb);
+			break;
+		}
 	}
-	activeRcb->removeObject(rcb);
-	fRCBCmdPool->returnCommand(rcb);
 
-    IORecursiveLockUnlock(fIPLock);
-}   
+	IORecursiveLockUnlock(fwIPPriv->fIPLock);
 
-void IOFWIPBusInterface::updateMcapState()
+	if( schedule )
+		fwIPPriv->mcapSchedule();
+
+	return kIOReturnSuccess;
+}
+
+void IOFWIPBusInterface::mcapStop()
 {
-    IORecursiveLockLock(fIPLock);
+	IORecursiveLockLock(fIPLock);
+	thread_call_t threadCall = fMCAPThreadCall;
+	fMCAPThreadCall = NULL;
+	fMCAPActive		= 0;
+	fMCAPArbTimers	= false;
+	if( fMCAPTimerSource != NULL )
+		fMCAPTimerSource->cancelTimeout();
+	IORecursiveLockUnlock(fIPLock);
 
-	MCB	*mcb = NULL;
-	OSCollectionIterator	*iterator = OSCollectionIterator::withCollection( mcapState );
-	
-	if( iterator )
+	if( threadCall != NULL )
 	{
-		while( NULL != (mcb = OSDynamicCast(MCB, iterator->getNextObject())) )
-		{
-			// for all mcb's check and relinquich resources
-			if (mcb->expiration > 1)		// Life in this channel allocation yet?
-				mcb->expiration--;			// Yes, but the clock is ticking...
-			else if (mcb->expiration == 1)	// Dead in the water?
-			{ 
-				mcb->expiration = 0;        // Yes, mark it expired
-				if (mcb->groupCount > 0)
-					mcb->groupCount--;
-					
-				IOFWAsyncStreamListener *asyncStreamRxClient = OSDynamicCast(IOFWAsyncStreamListener, mcb->asyncStreamID);
-				if(asyncStreamRxClient != NULL)
-				{
-					fControl->removeAsyncStreamListener( asyncStreamRxClient );
-					asyncStreamRxClient->release();
-				}
+		if( thread_call_cancel_wait( threadCall ) )
+			release();		// Taken by mcapSchedule for the run that never happened
+		thread_call_free( threadCall );
+	}
 
-				mcb->asyncStreamID = NULL;
-				releaseMulticastARB(mcb);
-				
-				if (mcb->ownerNodeID == fLcb->ownNodeID) // We own the channel?
-				{  
-					mcb->finalWarning = 4;  // Yes, four final advertisements
-					mcb->nextTransmit = 1;  // Starting right now... 
-				}
-			}
-			
-			// If we own this channel, then proceed below
-			if (mcb->ownerNodeID != fLcb->ownNodeID)
-				continue;                     // Cycle to next array entry 
-			else if (mcb->nextTransmit > 1)  // Time left before next transmit? 
-				mcb->nextTransmit--;                         // Keep on ticking... 
-			else if (mcb->nextTransmit == 1) 
-			{              // Due to expire now? 
-				if (mcb->groupCount > 0)      // Still in use at this machine? 
-					mcb->expiration = 60;      // Renew this channel's lease
-					
-				txMCAP(mcb, 0);          // Broadcast the MCAP advertisement
-				
-				if (mcb->expiration > 0)
-					mcb->nextTransmit = 10;    // Send MCAP again in ten seconds 
-				else if (--mcb->finalWarning > 0)
-					mcb->nextTransmit = 10;    // Channel deallocation warning 
-				else 
-				{
-					mcb->ownerNodeID = MCAP_UNOWNED; // Reliquish our ownership 
-					mcb->nextTransmit = 0;           // We're really, really done! 
-					releaseMulticastARB(mcb);
-				}
+	// Channels we own go back to the IRM
+	for ( int channel = 0; channel < kMaxChannels; channel++ )
+	{
+		IOFireWireIRMAllocation *allocation = NULL;
+
+		IORecursiveLockLock(fIPLock);
+
+		MCB *mcb = (mcapState != NULL) ? OSDynamicCast(MCB, mcapState->getObject(channel)) : NULL;
+		if( mcb != NULL )
+		{
+			allocation			= OSDynamicCast(IOFireWireIRMAllocation, mcb->irmAllocation);
+			mcb->irmAllocation	= NULL;
+			mcb->irmRelease		= false;
+			mcb->irmReclaim		= false;
+			mcb->irmHoldoff		= 0;
+			mcb->irmRetries		= 0;
+			mcb->owned			= false;
+			mcb->ownerNodeID	= MCAP_UNOWNED;
+
+			if( mcb->advert != NULL )
+			{
+				mcb->advert->release();
+				mcb->advert = NULL;
 			}
 		}
-		iterator->release();
+
+		IORecursiveLockUnlock(fIPLock);
+
+		if( allocation != NULL )
+		{
+			allocation->deallocateIsochResources();
+			allocation->release();
+		}
 	}
-	
-    IORecursiveLockUnlock(fIPLock);
 }
 
 void IOFWIPBusInterface::releaseMulticastARB(MCB *mcb)
@@ -2883,6 +5480,7 @@ void IOFWIPBusInterface::releaseMulticastARB(MCB *mcb)
 		{
 			if (arb->handle.multicast.channel == mcb->channel)
 			{
+				fMCAPGroupGen++;
 				multicastArb->removeObject(arb); 
 				arb->release();
 				continue;
@@ -2922,7 +5520,14 @@ void IOFWIPBusInterface::resetMARBCache()
 	{
 		while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
 		{
-			arb->handle.multicast.channel = DEFAULT_BROADCAST_CHANNEL;
+			// Groups on channels we own stay there, mcapBusReset keeps the channels
+			MCB *mcb = OSDynamicCast(MCB, mcapState->getObject(arb->handle.multicast.channel));
+			if( (mcb != NULL) and mcb->owned )
+				continue;
+
+			arb->handle.multicast.channel	= DEFAULT_BROADCAST_CHANNEL;
+			arb->mcapPhase					= MCAP_PHASE_IDLE;
+			fMCAPGroupGen++;
 		}
 		iterator->release();
 	}
@@ -2942,7 +5547,7 @@ void IOFWIPBusInterface::resetMcapState()
 		while( NULL != (mcb = OSDynamicCast(MCB, iterator->getNextObject())) )
 		{
 			// Since Mac just does MCAP receive switch to channel 31
-		   if( mcb->ownerNodeID != fLcb->ownNodeID ) // we don't own the channel
+		   if( not mcb->owned ) // we don't own the channel
 		   {
 				// leave channel & groupcount untouched.
 				IOFWAsyncStreamListener *asyncStreamRxClient = OSDynamicCast(IOFWAsyncStreamListener, mcb->asyncStreamID);
@@ -3136,7 +5741,7 @@ MARB *IOFWIPBusInterface::getMulticastArb(UInt32 groupAddress)
 	if( iterator )
 	{
 		while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
-			if (arb->handle.multicast.groupAddress == groupAddress)
+			if ((arb->handle.multicast.groupAddress == groupAddress) and (arb->groupType != MCAST_TYPE_IPV6))
 				break;
 
 		iterator->release();
@@ -3147,6 +5752,73 @@ MARB *IOFWIPBusInterface::getMulticastArb(UInt32 groupAddress)
     return arb;
 }
 
+/*!
+	@function getMulticastArb6
+	@abstract Locates the multicast MARB for an IPv6 group by its link address.
+			  Groups that differ only in bytes 2 to 9 share the link address, and
+			  the MARB, as they share the link layer filter.
+	@param fwaddr - IPv6 multicast link address.
+	@result Returns MARB if successfull else NULL.
+*/
+MARB *IOFWIPBusInterface::getMulticastArb6(const UInt8 *fwaddr)
+{  
+	recursiveScopeLock lock(fIPLock);
+
+	MARB *arb = 0;
+	OSCollectionIterator *iterator = OSCollectionIterator::withCollection( multicastArb );
+	
+	if( iterator )
+	{
+		while( NULL != (arb = OSDynamicCast(MARB, iterator->getNextObject())) )
+		{
+			if (arb->groupType != MCAST_TYPE_IPV6)
+				continue;
+
+			UInt8 arbaddr[FIREWIRE_ADDR_LEN];
+			FIREWIRE_MAP_IPV6_MULTICAST(arb->group6, arbaddr);
+
+			if (memcmp(arbaddr, fwaddr, sizeof(arbaddr)) == 0)
+				break;
+		}
+
+		iterator->release();
+	}
+         
+    return arb;
+}
+
+/*!
+	@function getMcapGroupArb
+	@abstract Locates the MARB an MCAP descriptor is for. IPv6 descriptors are
+			  mapped to their link address and matched on that, the whole group
+			  they carry is kept for our own advertisements.
+	@param groupDescr - MCAP group descriptor, IPv4 or IPv6.
+	@result Returns MARB if successfull else NULL.
+*/
+MARB *IOFWIPBusInterface::getMcapGroupArb(MCAST_DESCR *groupDescr)
+{
+	if (groupDescr->type != MCAST_TYPE_IPV6)
+		return getMulticastArb(groupDescr->groupAddress);
+
+	recursiveScopeLock lock(fIPLock);
+
+	UInt8	*group6 = ((MCAST_DESCR_IPV6*)groupDescr)->groupAddress;
+	UInt8	fwaddr[FIREWIRE_ADDR_LEN];
+
+	FIREWIRE_MAP_IPV6_MULTICAST(group6, fwaddr);
+
+	MARB *arb = getMulticastArb6(fwaddr);
+
+	if ((arb != NULL) and (not arb->group6Known))
+	{
+		memcpy(arb->group6, group6, sizeof(arb->group6));
+		arb->group6Known = true;
+		fMCAPGroupGen++;
+	}
+
+	return arb;
+}
+
 /*!
 	@function getRcb
 	@abstract Locates a reassembly control block.
@@ -3221,14 +5893,16 @@ bool IOFWIPMBufCommand::init()
 
 	fMbuf			= NULL;
 	fIPLocalNode	= NULL;
+	fIPBusIf		= NULL;
 	fStatus			= kIOReturnSuccess;
 
 	return true;
 }
 
-void IOFWIPMBufCommand::reinit(mbuf_t pkt, IOFireWireIP *ipNode, IOCommandPool *pool)
+void IOFWIPMBufCommand::reinit(mbuf_t pkt, IOFireWireIP *ipNode, IOFWIPBusInterface *busIf, IOCommandPool *pool)
 {
 	fIPLocalNode	= ipNode;	
+	fIPBusIf		= busIf;
 	fMbuf			= pkt;
 	fStatus			= kIOReturnSuccess;
 	fPool			= pool;
@@ -3244,6 +5918,8 @@ void IOFWIPMBufCommand::releaseWithStatus(IOReturn status)
 {
 	if (status == kIOFireWireOutOfTLabels)
 		fStatus = status;
+	else if ( (status == kIOFireWireBusReset) && (fStatus == kIOReturnSuccess) )
+		fStatus = status;	// A fragment was lost to the reset, the whole datagram is replayed
 	
 	if(this->getRetainCount() == 2)
 	{
@@ -3252,7 +5928,10 @@ void IOFWIPMBufCommand::releaseWithStatus(IOReturn status)
 			if( fMbuf && (fStatus != kIOFireWireOutOfTLabels) )
 			{
 				fIPLocalNode->fIPoFWDiagnostics.inActiveMbufs++;
-				fIPLocalNode->freePacket(fMbuf);
+				if( fStatus == kIOFireWireBusReset )
+					fIPBusIf->txHoldPacket(fMbuf);
+				else
+					fIPLocalNode->freePacket(fMbuf);
 				fMbuf = NULL;
 			}
 			fIPLocalNode = NULL;
@@ -3321,6 +6000,107 @@ mbuf_t IOFWIPBusInterface::allocateMbuf( UInt32 size )
     return getPacket( size, MBUF_DONTWAIT, kIOPacketBufferAlign1, kIOPacketBufferAlign16 );
 }
 
+/*!
+	@function rxAllocateMbuf
+	@abstract Receive buffers come from a cache of single cluster packets, so a burst
+			  doesn't depend on getPacket succeeding inline. Packets larger than a big
+			  cluster (jumbo datagrams) and an empty cache fall back to allocateMbuf.
+			  A cache running low schedules rxCacheRefill on the workloop.
+	@param size - packet length, including the firewire header.
+	@result mbuf_t - the packet, with its length set to size.
+*/
+mbuf_t IOFWIPBusInterface::rxAllocateMbuf( UInt32 size )
+{
+	mbuf_t	*cache	= NULL;
+	UInt32	*count	= NULL;
+	mbuf_t	m		= NULL;
+
+	if( size <= kRxSmallBufferSize )
+	{
+		cache	= fRxSmallCache;
+		count	= &fRxSmallCount;
+	}
+	else if( size <= kRxLargeBufferSize )
+	{
+		cache	= fRxLargeCache;
+		count	= &fRxLargeCount;
+	}
+	else
+		return allocateMbuf(size);
+
+	// Only the pop is locked, a miss allocates without holding fIPLock
+	IORecursiveLockLock(fIPLock);
+
+	if( *count > 0 )
+	{
+		m = cache[--(*count)];
+		cache[*count] = NULL;
+
+		if( (*count < kRxCacheDepth / 2) and (fRxFlushSource != NULL) )
+			fRxFlushSource->interruptOccurred(NULL, NULL, 0);
+	}
+	else
+		fIPLocalNode->fIPoFWDiagnostics.fRxCacheMisses++;
+
+	IORecursiveLockUnlock(fIPLock);
+
+	if( m == NULL )
+		return allocateMbuf(size);
+
+	mbuf_setlen(m, size);
+	mbuf_pkthdr_setlen(m, size);
+
+	return m;
+}
+
+void IOFWIPBusInterface::rxCacheRefill()
+{
+	recursiveScopeLock lock(fIPLock);
+
+	// stop has freed the caches for good
+	if( not fStarted )
+		return;
+
+	while( fRxSmallCount < kRxCacheDepth )
+	{
+		unsigned int	chunks	= 1;
+		mbuf_t			m		= NULL;
+
+		if( mbuf_allocpacket(MBUF_DONTWAIT, kRxSmallBufferSize, &chunks, &m) != 0 )
+			break;
+
+		fRxSmallCache[fRxSmallCount++] = m;
+	}
+
+	while( fRxLargeCount < kRxCacheDepth )
+	{
+		unsigned int	chunks	= 1;
+		mbuf_t			m		= NULL;
+
+		if( mbuf_allocpacket(MBUF_DONTWAIT, kRxLargeBufferSize, &chunks, &m) != 0 )
+			break;
+
+		fRxLargeCache[fRxLargeCount++] = m;
+	}
+}
+
+void IOFWIPBusInterface::rxCacheFree()
+{
+	recursiveScopeLock lock(fIPLock);
+
+	while( fRxSmallCount > 0 )
+	{
+		fIPLocalNode->freePacket(fRxSmallCache[--fRxSmallCount]);
+		fRxSmallCache[fRxSmallCount] = NULL;
+	}
+
+	while( fRxLargeCount > 0 )
+	{
+		fIPLocalNode->freePacket(fRxLargeCache[--fRxLargeCount]);
+		fRxLargeCache[fRxLargeCount] = NULL;
+	}
+}
+
 void IOFWIPBusInterface::moveMbufWithOffset(SInt32 tempOffset, mbuf_t *srcm, vm_address_t *src, SInt32 *srcLen)
 {
     mbuf_t temp = NULL;
@@ -3372,6 +6152,11 @@ void IOFWIPBusInterface::moveMbufWithOffset(SInt32 tempOffset, mbuf_t *srcm, vm_
 	@param offset - offset into the mbuf data pointer.
 	@param srcbuf - source buf.
 	@param srcbufLen - source buffer length.
+	@discussion The pseudo address space hands rxUnicast a pointer into the controller's
+			AR DMA buffer, which is recycled as soon as the handler returns, so it can't
+			be loaned to the stack as external mbuf storage. Instead receive buffers are
+			single clusters from the rxAllocateMbuf cache, and for those the payload goes
+			in with one straight copy, without walking the chain or taking fIPLock.
 	@result bool - true if success else false.
 */
 bool IOFWIPBusInterface::bufferToMbuf(mbuf_t m, 
@@ -3379,6 +6164,13 @@ bool IOFWIPBusInterface::bufferToMbuf(mbuf_t m,
 								vm_address_t  *srcbuf, 
 								UInt32 srcbufLen)
 {
+	if( (mbuf_next(m) == NULL) and (offset + srcbufLen <= mbuf_len(m)) )
+	{
+		bcopy((void*)srcbuf, (UInt8*)mbuf_data(m) + offset, srcbufLen);
+		fIPLocalNode->fIPoFWDiagnostics.fRxDirectCopies++;
+		return true;
+	}
+
     IORecursiveLockLock(fIPLock);
 
 	// Get the source
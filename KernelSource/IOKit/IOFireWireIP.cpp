@@ -88,6 +88,8 @@ bool IOFireWireIP::start(IOService *provider)
 		
 		memset(fLcb, 0, sizeof(LCB));
 
+		fMaxDatagramSize = FIREWIRE_MTU;
+
 		fDiagnostics_Symbol = OSSymbol::withCStringNoCopy("Diagnostics");
 		
 		fDiagnostics = IOFireWireIPDiagnostics::createDiagnostics(this);
@@ -408,17 +410,35 @@ IOReturn IOFireWireIP::message(UInt32 type, IOService *provider, void *argument)
 #pragma mark -
 #pragma mark  IOFWController methods 
 
+/*!
+	@function setMaxPacketSize
+	@abstract Called from syncSIOCSIFMTU when the MTU needs a frame above kIOFWMaxPacketSize,
+			or drops back from one. Frames up to kIOFWMaxJumboPacketSize enable jumbo datagrams,
+			which are sent fragmented and accepted up to the same size on receive. Datagrams
+			above FIREWIRE_MTU use the reserved bits beside RFC 2734's 12 bit size and offset
+			fields, a non-RFC extension only Apple peers understand. Unicast jumbo datagrams
+			are therefore only sent to Macintosh ARBs. Broadcast and multicast ones reach
+			every node, so the MTU should only be raised on links with Apple peers alone.
+			RFC 2734 has no way to learn a peer's limit, so every node must be set the same.
+	@param maxSize - frame size including the link header.
+	@result kIOReturnError if maxSize is above kIOFWMaxJumboPacketSize.
+*/
 IOReturn IOFireWireIP::setMaxPacketSize(UInt32 maxSize)
 {
-	if (maxSize > kIOFWMaxPacketSize)
+	if (maxSize > kIOFWMaxJumboPacketSize)
 		return kIOReturnError;
 	
+	if (maxSize > kIOFWMaxPacketSize)
+		fMaxDatagramSize = maxSize - FIREWIRE_HDR_LEN;
+	else
+		fMaxDatagramSize = FIREWIRE_MTU;
+	
     return kIOReturnSuccess;
 }
 
 IOReturn IOFireWireIP::getMaxPacketSize(UInt32 * maxSize) const
 {
-	*maxSize = kIOFWMaxPacketSize;
+	*maxSize = kIOFWMaxJumboPacketSize;
 
 	return kIOReturnSuccess;
 }
@@ -462,17 +482,19 @@ bool IOFireWireIP::configureInterface( IONetworkInterface *netif )
 	
 } // end configureInterface
 
+/*-------------------------------------------------------------------------
+ * Only rxUnicastFlush hands packets to the stack, from rxUnicastComplete
+ * or the deferred flush event source, both on the controller workloop.
+ * The workloop serializes the input queue, so no lock is held across
+ * the handoff.
+ *-------------------------------------------------------------------------*/
 void IOFireWireIP::receivePackets(mbuf_t pkt, UInt32 pkt_len, UInt32 options)
 {
 	if(options == true)
 		fPacketsQueued = true;
-
-    IORecursiveLockLock(ipLock);
 		
 	networkInterface->inputPacket(pkt, pkt_len, options);
 	networkStatAdd(&fpNetStats->inputPackets);
-	
-    IORecursiveLockUnlock(ipLock);
 }
 
 IOOutputQueue* IOFireWireIP::createOutputQueue()
@@ -520,23 +542,6 @@ bool IOFireWireIP::multicastCacheHandler(IOFWAddress *addrs, UInt32 count)
 	return ret;
 }
 
-bool IOFireWireIP::arpCacheHandler(IP1394_ARP *fwa)
-{
-	bool ret = false;
-	
-	if( busifEnabled )
-	{
-		IORecursiveLockLock(ipLock);
-
-		if( fUpdateARPCache )
-			ret = (*fUpdateARPCache)(fPrivateInterface, fwa);
-
-		IORecursiveLockUnlock(ipLock);
-	}
-	
-	return ret;
-}
-
 UInt32 IOFireWireIP::transmitPacket(mbuf_t m, void * param)
 {
 	IOReturn status = kIOReturnOutputDropped;
@@ -716,7 +721,8 @@ bool IOFireWireIP::createMediumState()
 	@function getFeatures
 	@abstract 
 	@param none.
-	@result Tell family we can handle multipage mbufs. kIONetworkFeatureMultiPages
+	@result Tell family we can handle multipage mbufs and TCP/IPv4 large sends,
+			which IOFWIPBusInterface::txLargeSend segments. kIONetworkFeatureMultiPages
 */
 UInt32 IOFireWireIP::getFeatures() const
 {
@@ -724,6 +730,7 @@ UInt32 IOFireWireIP::getFeatures() const
     
 #if VERSION_MAJOR >= 9
     result |= kIONetworkFeatureMultiPages;
+    result |= kIONetworkFeatureTSOIPv4;
 #endif
     
     return result;
@@ -783,6 +790,10 @@ void IOFireWireIP::makeEthernetAddress(CSRNodeUniqueID	*fwuid, UInt8 *bufAddr, U
 
 void IOFireWireIP::updateMTU(UInt32 mtu)
 {
+	// A jumbo MTU is set by hand, every later link payload change is ignored until it's dropped
+	if( fMaxDatagramSize > FIREWIRE_MTU )
+		return;
+
 	networkInterface->setIfnetMTU( mtu );
 }
 
@@ -839,7 +850,6 @@ void IOFireWireIP::registerFWIPPrivateHandlers(IOFireWireIPPrivateHandlers *priv
 
 	fPrivateInterface		= privateSelf->newService;
 	fOutAction				= privateSelf->transmitPacket;
-	fUpdateARPCache			= privateSelf->updateARPCache;
 	fUpdateMulticastCache	= privateSelf->updateMulticastCache;
 
 	busifEnabled		= true;
@@ -858,7 +868,6 @@ void IOFireWireIP::deRegisterFWIPPrivateHandlers()
 	busifEnabled		= false;
 	fPrivateInterface	= NULL;
 	fOutAction			= NULL;
-	fUpdateARPCache		= NULL;
 	fClientStarting		= false;
 
     IORecursiveLockUnlock(ipLock);
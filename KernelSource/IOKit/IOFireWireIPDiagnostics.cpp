@@ -83,6 +83,17 @@ bool IOFireWireIPDiagnostics::serialize( OSSerialize * s ) const
 	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fMaxQueueSize, "fwMaxQueueSize");
 	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fServiceInOutput, "fwServiceInOP");
 	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fServiceInCallback, "fwServiceInCB");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxCompleteBatches, "fwTxCompleteBatches");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxLargeSendPkts, "fwTxLargeSendPkts");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxLargeSendSegments, "fwTxLargeSendSegments");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxControlHeld, "fwTxControlHeld");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxControlReserveStalls, "fwTxControlReserveStalls");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fAQMDrops, "fwAQMDrops");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fAQMMarks, "fwAQMMarks");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fRxCacheMisses, "fwRxCacheMisses");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fRxDirectCopies, "fwRxDirectCopies");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fRxCoalescedPkts, "fwRxCoalescedPkts");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fRxCoalescedSegments, "fwRxCoalescedSegments");
 	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fLastStarted, "fwLastStarted");
 	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fMaxPacketSize, "fwMaxPacketSize");
 	
@@ -102,6 +113,19 @@ bool IOFireWireIPDiagnostics::serialize( OSSerialize * s ) const
 	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fInCorrectMCAPDesc, "fwInCorrectMCAPDesc");
 	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fUnknownMCAPDesc, "fwUnknownMCAPDesc");	
 	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fUnknownGroupAddress, "fwUnknownGroupAddress");	
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxMcastOnChannel, "fwTxMcastOnChannel");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxBcastReplicated, "fwTxBcastReplicated");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fMCAPChannelsAllocated, "fwMCAPChannelsAllocated");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fMCAPAllocationFailures, "fwMCAPAllocationFailures");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fMCAPTakeovers, "fwMCAPTakeovers");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fMCAPAdvertBuilds, "fwMCAPAdvertBuilds");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fMCAPRepliesLimited, "fwMCAPRepliesLimited");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fRxMcastFiltered, "fwRxMcastFiltered");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxHeldPkts, "fwTxHeldPkts");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxHeldReplayed, "fwTxHeldReplayed");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fTxHeldExpired, "fwTxHeldExpired");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fLinkStatusUpdates, "fwLinkStatusUpdates");
+	updateNumberEntry( dictionary, fIPObj->fIPoFWDiagnostics.fLinkStatusCoalesced, "fwLinkStatusCoalesced");
 
 	ok = dictionary->serialize(s);
 	dictionary->release();
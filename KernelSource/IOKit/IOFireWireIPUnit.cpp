@@ -199,11 +199,7 @@ IOReturn IOFireWireIPUnit::message(UInt32 type, IOService *provider, void *argum
 void IOFireWireIPUnit::updateDrb()
 {
 	if(fDrb)
-	{
-		fDrb->maxSpeed	 = fDevice->FWSpeed();
-		fDrb->maxPayload = fDevice->maxPackLog(true);
-		fFWBusInterface->updateBroadcastValues(true);
-	}
+		fFWBusInterface->updateDRBwithDevice(fDrb, fDevice);
 }
 
 bool IOFireWireIPUnit::configureFWBusInterface(IOFireWireController *controller)